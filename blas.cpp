@@ -0,0 +1,100 @@
+#include "blas.hpp"
+
+#ifdef SIMPLEPHYSICS_BLAS
+
+#include <cblas.h>
+#include <cstddef>
+
+// LAPACK has no portable C header, these are the Fortran symbols with the
+// hidden string lengths at the end
+extern "C"
+{
+    void sgetrf_(const int* m, const int* n, float* a, const int* lda, int* ipiv, int* info);
+    void dgetrf_(const int* m, const int* n, double* a, const int* lda, int* ipiv, int* info);
+    void sgetrs_(const char* trans, const int* n, const int* nrhs, const float* a, const int* lda, const int* ipiv, float* b, const int* ldb, int* info, std::size_t);
+    void dgetrs_(const char* trans, const int* n, const int* nrhs, const double* a, const int* lda, const int* ipiv, double* b, const int* ldb, int* info, std::size_t);
+    void spotrf_(const char* uplo, const int* n, float* a, const int* lda, int* info, std::size_t);
+    void dpotrf_(const char* uplo, const int* n, double* a, const int* lda, int* info, std::size_t);
+    void spotrs_(const char* uplo, const int* n, const int* nrhs, const float* a, const int* lda, float* b, const int* ldb, int* info, std::size_t);
+    void dpotrs_(const char* uplo, const int* n, const int* nrhs, const double* a, const int* lda, double* b, const int* ldb, int* info, std::size_t);
+}
+
+static const int one = 1;
+
+void Blas::Gemm(int m, int n, int k, const float* A, const float* B, float* C)
+{
+    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k, 1.0f, A, k, B, n, 0.0f, C, n);
+}
+
+void Blas::Gemm(int m, int n, int k, const double* A, const double* B, double* C)
+{
+    cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k, 1.0, A, k, B, n, 0.0, C, n);
+}
+
+void Blas::Gemv(int m, int n, const float* A, const float* x, float* y)
+{
+    cblas_sgemv(CblasRowMajor, CblasNoTrans, m, n, 1.0f, A, n, x, 1, 0.0f, y, 1);
+}
+
+void Blas::Gemv(int m, int n, const double* A, const double* x, double* y)
+{
+    cblas_dgemv(CblasRowMajor, CblasNoTrans, m, n, 1.0, A, n, x, 1, 0.0, y, 1);
+}
+
+int Blas::Getrf(int n, float* A, int* ipiv)
+{
+    int info;
+    sgetrf_(&n, &n, A, &n, ipiv, &info);
+    return info;
+}
+
+int Blas::Getrf(int n, double* A, int* ipiv)
+{
+    int info;
+    dgetrf_(&n, &n, A, &n, ipiv, &info);
+    return info;
+}
+
+int Blas::GetrsTransposed(int n, const float* A, const int* ipiv, float* b)
+{
+    int info;
+    sgetrs_("T", &n, &one, A, &n, ipiv, b, &n, &info, 1);
+    return info;
+}
+
+int Blas::GetrsTransposed(int n, const double* A, const int* ipiv, double* b)
+{
+    int info;
+    dgetrs_("T", &n, &one, A, &n, ipiv, b, &n, &info, 1);
+    return info;
+}
+
+int Blas::Potrf(int n, float* A)
+{
+    int info;
+    spotrf_("U", &n, A, &n, &info, 1);
+    return info;
+}
+
+int Blas::Potrf(int n, double* A)
+{
+    int info;
+    dpotrf_("U", &n, A, &n, &info, 1);
+    return info;
+}
+
+int Blas::Potrs(int n, const float* A, float* b)
+{
+    int info;
+    spotrs_("U", &n, &one, A, &n, b, &n, &info, 1);
+    return info;
+}
+
+int Blas::Potrs(int n, const double* A, double* b)
+{
+    int info;
+    dpotrs_("U", &n, &one, A, &n, b, &n, &info, 1);
+    return info;
+}
+
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+
+// Thin overloads over the BLAS and LAPACK routines la.cpp can route to, only
+// compiled with -DSIMPLEPHYSICS_BLAS (make BLAS=1). Matrices are row major
+// like MatT, the LAPACK calls see them transposed and la.cpp accounts for it.
+// info follows LAPACK, 0 on success.
+
+#ifdef SIMPLEPHYSICS_BLAS
+
+namespace Blas
+{
+    // C = A*B, A is m x k, B is k x n
+    void Gemm(int m, int n, int k, const float* A, const float* B, float* C);
+    void Gemm(int m, int n, int k, const double* A, const double* B, double* C);
+
+    // y = A*x, A is m x n
+    void Gemv(int m, int n, const float* A, const float* x, float* y);
+    void Gemv(int m, int n, const double* A, const double* x, double* y);
+
+    // LU of the column major n x n matrix A, ipiv is 1 based
+    int Getrf(int n, float* A, int* ipiv);
+    int Getrf(int n, double* A, int* ipiv);
+
+    // solves with the transpose of the matrix Getrf factored
+    int GetrsTransposed(int n, const float* A, const int* ipiv, float* b);
+    int GetrsTransposed(int n, const double* A, const int* ipiv, double* b);
+
+    // Cholesky of a symmetric n x n matrix, the factor is written to the
+    // upper triangle in column major order (the lower one of a row major matrix)
+    int Potrf(int n, float* A);
+    int Potrf(int n, double* A);
+
+    int Potrs(int n, const float* A, float* b);
+    int Potrs(int n, const double* A, double* b);
+}
+
+#endif
@@ -0,0 +1,566 @@
+#include "checkpoint.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+static const char checkpointMagic[4] = { 'S', 'P', 'C', 'K' };
+static constexpr uint32_t checkpointVersion = 3;
+
+// time, substeps, totalError, sleeping, sleepEnergy, sleepError, sleepTime, wakeAccel
+static constexpr int scalarsV2 = 8;
+
+// then regularization, redundantTolerance, solver, iterativeTolerance, threads,
+// projection, projectIterations, projectTolerance, projectSolves, projectSteps
+static constexpr int scalarsV3 = scalarsV2 + 10;
+
+Checkpoint::Checkpoint()
+    : mapped(NULL), mappedSize(0)
+{
+}
+
+Checkpoint::~Checkpoint()
+{
+    Unmap();
+}
+
+template<typename T>
+static void Append(std::vector<double>& out, const VecT<T>& v)
+{
+    out.insert(out.end(), v.buf.begin(), v.buf.end());
+}
+
+template<typename T, int D>
+void Checkpoint::Capture(const SystemT<T, D>& system)
+{
+    constexpr int DF = D;
+
+    Unmap();
+
+    std::vector<Particle> particles(system.N);
+    for (int i = 0; i < system.N; i++)
+    {
+        particles[i].x = system.pos.At(i*DF);
+        particles[i].y = system.pos.At(i*DF+1);
+        if (DF > 2) particles[i].z = system.pos.At(i*DF+2);
+        particles[i].m = 1.0/system.massInv.At(i*DF);
+    }
+
+    std::vector<char> scene;
+    EncodeScene(scene, particles, system.forces, system.constraints);
+    scene.resize((scene.size() + 7) & ~(std::size_t) 7);
+
+    std::vector<double> state;
+    state.reserve(scalarsV3 + 5*system.N*DF + 4*system.NC);
+
+    state.push_back(system.time);
+    state.push_back(system.substeps);
+    state.push_back(system.totalError);
+    state.push_back(system.sleeping);
+    state.push_back(system.sleepEnergy);
+    state.push_back(system.sleepError);
+    state.push_back(system.sleepTime);
+    state.push_back(system.wakeAccel);
+    state.push_back(system.regularization);
+    state.push_back(system.redundantTolerance);
+    state.push_back(system.solver);
+    state.push_back(system.iterativeTolerance);
+    state.push_back(system.threads);
+    state.push_back(system.projection);
+    state.push_back(system.projectIterations);
+    state.push_back(system.projectTolerance);
+    state.push_back(system.projectSolves);
+    state.push_back(system.projectSteps);
+
+    Append(state, system.pos);
+    Append(state, system.vel);
+    Append(state, system.massInv);
+
+    // the rounding carried into the next update of a float System
+    if (system.compensated)
+    {
+        Append(state, system.posCarry);
+        Append(state, system.velCarry);
+    }
+
+    Append(state, system.C);
+    Append(state, system.Cd);
+    Append(state, system.l);
+    state.insert(state.end(), system.redundant.begin(), system.redundant.end());
+
+    // parameters, each list prefixed with its length
+    std::vector<double> params;
+    for (const ForceT<T, D>* f : system.forces)
+    {
+        params.clear();
+        f->Params(params);
+        state.push_back(params.size());
+        state.insert(state.end(), params.begin(), params.end());
+    }
+
+    for (const ConstraintT<T, D>* c : system.constraints)
+    {
+        params.clear();
+        c->Params(params);
+        state.push_back(params.size());
+        state.insert(state.end(), params.begin(), params.end());
+    }
+
+    for (const Island& island : system.islands)
+    {
+        state.push_back(island.particles.size());
+        state.push_back(island.constraints.size());
+        state.push_back(island.forces.size());
+        state.push_back(island.restForce.size());
+        state.push_back(island.energy);
+        state.push_back(island.error);
+        state.push_back(island.drift);
+        state.push_back(island.idle);
+        state.push_back(island.asleep);
+
+        state.insert(state.end(), island.particles.begin(), island.particles.end());
+        state.insert(state.end(), island.constraints.begin(), island.constraints.end());
+        state.insert(state.end(), island.forces.begin(), island.forces.end());
+        state.insert(state.end(), island.restForce.begin(), island.restForce.end());
+    }
+
+    Header header;
+    std::memcpy(header.magic, checkpointMagic, 4);
+    header.version = checkpointVersion;
+    header.N = system.N;
+    header.DF = DF;
+    header.NC = system.NC;
+    header.NF = system.NF;
+    header.islands = system.islands.size();
+    header.scalar = sizeof(T);
+    header.sceneBytes = scene.size();
+    header.stateDoubles = state.size();
+
+    buf.resize(sizeof(Header) + scene.size() + state.size()*sizeof(double));
+
+    char* p = buf.data();
+    std::memcpy(p, &header, sizeof(header)); p += sizeof(header);
+    std::memcpy(p, scene.data(), scene.size()); p += scene.size();
+    std::memcpy(p, state.data(), state.size()*sizeof(double));
+}
+
+const Checkpoint::Header* Checkpoint::Head() const
+{
+    const char* data = mapped ? mapped : buf.data();
+    std::size_t size = mapped ? mappedSize : buf.size();
+
+    if (size < sizeof(Header)) return NULL;
+
+    const Header* header = reinterpret_cast<const Header*>(data);
+
+    if (std::memcmp(header->magic, checkpointMagic, 4) != 0 || header->version > checkpointVersion) return NULL;
+
+    // written without sums that could wrap for a corrupt header
+    std::size_t rest = size - sizeof(Header);
+    if (header->sceneBytes % 8 != 0 || header->sceneBytes > rest || header->stateDoubles > (rest - header->sceneBytes)/sizeof(double)) return NULL;
+
+    return header;
+}
+
+const double* Checkpoint::State() const
+{
+    const Header* header = Head();
+    return reinterpret_cast<const double*>(reinterpret_cast<const char*>(header) + sizeof(Header) + header->sceneBytes);
+}
+
+template<typename T>
+static void Copy(VecT<T>& v, const double* p)
+{
+    std::copy(p, p + v.buf.size(), v.buf.begin());
+}
+
+static void Copy(std::vector<int>& v, const double* p, int n)
+{
+    v.resize(n);
+    for (int i = 0; i < n; i++) v[i] = p[i];
+}
+
+static int MaxThreads()
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// a whole number in [0, limit), NaN fails too
+static bool Index(double v, double limit)
+{
+    return v >= 0.0 && v < limit && v == (double) (long) v;
+}
+
+template<typename T, int D>
+bool Checkpoint::Restore(SystemT<T, D>& system) const
+{
+    constexpr int DF = D;
+
+    const Header* header = Head();
+    if (!header) return false;
+
+    uint32_t scalar = header->version >= 3 ? header->scalar : sizeof(double);
+
+    if ((int) header->N != system.N || (int) header->DF != D || (int) header->NC != system.NC || (int) header->NF != system.NF || scalar != sizeof(T))
+    {
+        std::printf("WARNING: checkpoint does not match the system\n");
+        return false;
+    }
+
+    int N = system.N, NC = system.NC, NF = system.NF;
+
+    // Everything is checked before the System is touched, a file that is
+    // truncated or corrupt leaves it as it was. Every read goes through take,
+    // which fails instead of running past stateDoubles.
+    const double* p = State();
+    const double* end = p + header->stateDoubles;
+
+    auto take = [&](double n) -> const double*
+    {
+        if (!(n >= 0.0 && n <= (double) (end - p))) return NULL;
+
+        const double* q = p;
+        p += (std::size_t) n;
+        return q;
+    };
+
+    bool ok = true;
+
+    const double* scalars = take(header->version >= 3 ? scalarsV3 : scalarsV2);
+    ok = scalars != NULL;
+
+    // an out of range solver would match no branch of SolveIsland
+    if (ok && header->version >= 3) ok = Index(scalars[10], SOLVER_COUNT);
+
+    const double* pos = ok ? take(N*DF) : NULL;
+    const double* vel = pos ? take(N*DF) : NULL;
+    const double* massInv = vel ? take(N*DF) : NULL;
+    const double* carry = massInv && system.compensated ? take(2*N*DF) : massInv;
+    const double* C = carry ? take(NC) : NULL;
+    const double* Cd = C ? take(NC) : NULL;
+    const double* l = Cd ? take(NC) : NULL;
+    const double* redundant = l && header->version >= 2 ? take(NC) : l;
+
+    ok = redundant != NULL;
+
+    // parameters, each list prefixed with its length
+    std::vector<const double*> forceParams(NF), constraintParams(NC);
+    std::vector<double> params;
+
+    for (int i = 0; ok && i < NF; i++)
+    {
+        params.clear();
+        system.forces[i]->Params(params);
+
+        const double* n = take(1);
+        if (n && *n != params.size()) { std::printf("WARNING: checkpoint force mismatch\n"); return false; }
+
+        ok = n && (forceParams[i] = take(params.size())) != NULL;
+    }
+
+    for (int i = 0; ok && i < NC; i++)
+    {
+        params.clear();
+        system.constraints[i]->Params(params);
+
+        const double* n = take(1);
+        if (n && *n != params.size()) { std::printf("WARNING: checkpoint constraint mismatch\n"); return false; }
+
+        ok = n && (constraintParams[i] = take(params.size())) != NULL;
+    }
+
+    // every particle and constraint in exactly one island, no island empty,
+    // restForce empty or one entry per coordinate of the island
+    ok = ok && header->islands <= (uint32_t) N;
+
+    std::vector<const double*> islandData(ok ? header->islands : 0);
+    std::vector<int> particleIsland(N, -1), constraintIsland(NC, -1);
+
+    for (int i = 0; ok && i < islandData.size(); i++)
+    {
+        const double* h = take(9);
+        ok = h && Index(h[0] - 1, N) && Index(h[1], NC + 1) && Index(h[2], NF + 1) && (h[3] == 0.0 || h[3] == h[0]*DF);
+
+        const double* q = ok ? take(h[0] + h[1] + h[2] + h[3]) : NULL;
+        ok = q != NULL;
+
+        islandData[i] = h;
+
+        int np = ok ? h[0] : 0, nc = ok ? h[1] : 0, nf = ok ? h[2] : 0;
+
+        for (int k = 0; ok && k < np; k++)
+        {
+            ok = Index(q[k], N) && particleIsland[(int) q[k]] == -1;
+            if (ok) particleIsland[(int) q[k]] = i;
+        }
+
+        for (int k = 0; ok && k < nc; k++)
+        {
+            ok = Index(q[np + k], NC) && constraintIsland[(int) q[np + k]] == -1;
+            if (ok) constraintIsland[(int) q[np + k]] = i;
+        }
+
+        for (int k = 0; ok && k < nf; k++)
+            ok = Index(q[np + nc + k], NF);
+    }
+
+    ok = ok && std::find(particleIsland.begin(), particleIsland.end(), -1) == particleIsland.end()
+            && std::find(constraintIsland.begin(), constraintIsland.end(), -1) == constraintIsland.end();
+
+    if (!ok)
+    {
+        std::printf("WARNING: checkpoint is truncated or corrupt\n");
+        return false;
+    }
+
+    // the parameters hold particle indices, they are only known to the
+    // elements, so set them and put the old ones back if one is out of range
+    // or a constraint reaches outside its island
+    std::vector<std::vector<double>> oldForces(NF), oldConstraints(NC);
+    std::vector<int> particles;
+
+    for (int i = 0; i < NF; i++)
+    {
+        system.forces[i]->Params(oldForces[i]);
+        system.forces[i]->SetParams(forceParams[i]);
+
+        particles.clear();
+        system.forces[i]->Particles(particles);
+
+        for (int q : particles)
+            if (q < 0 || q >= N) ok = false;
+    }
+
+    for (int i = 0; i < NC; i++)
+    {
+        system.constraints[i]->Params(oldConstraints[i]);
+        system.constraints[i]->SetParams(constraintParams[i]);
+
+        particles.clear();
+        system.constraints[i]->Particles(particles);
+
+        for (int q : particles)
+            if (q < 0 || q >= N || particleIsland[q] != constraintIsland[i]) ok = false;
+    }
+
+    if (!ok)
+    {
+        for (int i = 0; i < NF; i++) system.forces[i]->SetParams(oldForces[i].data());
+        for (int i = 0; i < NC; i++) system.constraints[i]->SetParams(oldConstraints[i].data());
+
+        std::printf("WARNING: checkpoint is truncated or corrupt\n");
+        return false;
+    }
+
+    system.time = scalars[0];
+    system.substeps = scalars[1];
+    system.totalError = scalars[2];
+    system.sleeping = scalars[3] != 0.0;
+    system.sleepEnergy = scalars[4];
+    system.sleepError = scalars[5];
+    system.sleepTime = scalars[6];
+    system.wakeAccel = scalars[7];
+
+    // version 2 did not store the settings, keep those of the System
+    if (header->version >= 3)
+    {
+        system.regularization = scalars[8];
+        system.redundantTolerance = scalars[9];
+        system.solver = (Solver) scalars[10];
+        system.iterativeTolerance = scalars[11];
+        system.threads = std::min(std::max(1.0, scalars[12]), (double) MaxThreads());
+        system.projection = scalars[13] != 0.0;
+        system.projectIterations = std::max(0.0, scalars[14]);
+        system.projectTolerance = scalars[15];
+        system.projectSolves = scalars[16];
+        system.projectSteps = scalars[17];
+    }
+
+    Copy(system.pos, pos);
+    Copy(system.vel, vel);
+    Copy(system.massInv, massInv);
+
+    if (system.compensated)
+    {
+        Copy(system.posCarry, carry);
+        Copy(system.velCarry, carry + N*DF);
+    }
+
+    Copy(system.C, C);
+    Copy(system.Cd, Cd);
+    Copy(system.l, l);
+
+    // version 1 did not store redundancy, keep what the System found
+    if (header->version >= 2)
+        for (int i = 0; i < NC; i++) system.redundant[i] = redundant[i] != 0.0;
+
+    // parameters may have moved particles between elements
+    for (int i = 0; i < NC; i++)
+    {
+        system.constraintParticles[i].clear();
+        system.constraints[i]->Particles(system.constraintParticles[i]);
+        system.J.ClearRow(i);
+        system.Jd.ClearRow(i);
+    }
+
+    for (int i = 0; i < NF; i++)
+    {
+        system.forceParticles[i].clear();
+        system.forces[i]->Particles(system.forceParticles[i]);
+    }
+
+    system.islands.resize(header->islands);
+
+    for (int i = 0; i < header->islands; i++)
+    {
+        Island& island = system.islands[i];
+        const double* h = islandData[i];
+
+        int np = h[0], nc = h[1], nf = h[2], nr = h[3];
+        island.energy = h[4];
+        island.error = h[5];
+        island.drift = h[6];
+        island.idle = h[7];
+        island.asleep = h[8] != 0.0;
+
+        const double* q = h + 9;
+
+        Copy(island.particles, q, np);
+        Copy(island.constraints, q + np, nc);
+        Copy(island.forces, q + np + nc, nf);
+
+        island.restForce.assign(q + np + nc + nf, q + np + nc + nf + nr);
+
+        for (int k = 0; k < np; k++)
+        {
+            system.islandOf[island.particles[k]] = i;
+            system.localOf[island.particles[k]] = k;
+        }
+    }
+
+    for (Island& island : system.islands)
+    {
+        island.rows.assign(island.particles.size(), std::vector<int>());
+
+        for (int r = 0; r < island.constraints.size(); r++)
+            for (int q : system.constraintParticles[island.constraints[r]])
+                island.rows[system.localOf[q]].push_back(r);
+    }
+
+    system.topology++;
+
+    return true;
+}
+
+template<typename T, int D>
+SystemT<T, D>* Checkpoint::MakeSystem(SceneT<T, D>& scene) const
+{
+    const Header* header = Head();
+    if (!header) return NULL;
+
+    const char* data = reinterpret_cast<const char*>(header) + sizeof(Header);
+
+    if (!DecodeScene(data, header->sceneBytes, scene.particles, scene.elements)) return NULL;
+
+    SystemT<T, D>* system = scene.MakeSystem();
+
+    if (!Restore(*system))
+    {
+        delete system;
+        return NULL;
+    }
+
+    return system;
+}
+
+bool Checkpoint::Save(const char* path) const
+{
+    const Header* header = Head();
+    if (!header) return false;
+
+    std::size_t size = sizeof(Header) + header->sceneBytes + header->stateDoubles*sizeof(double);
+
+    std::FILE* file = std::fopen(path, "wb");
+    if (!file) return false;
+
+    bool ok = std::fwrite(header, 1, size, file) == size;
+
+    return std::fclose(file) == 0 && ok;
+}
+
+bool Checkpoint::Load(const char* path)
+{
+    Unmap();
+
+    std::FILE* file = std::fopen(path, "rb");
+    if (!file) return false;
+
+    std::fseek(file, 0, SEEK_END);
+    long size = std::ftell(file);
+    std::fseek(file, 0, SEEK_SET);
+
+    buf.resize(size > 0 ? size : 0);
+    bool ok = size > 0 && std::fread(buf.data(), 1, size, file) == (std::size_t) size;
+    std::fclose(file);
+
+    return ok && Head() != NULL;
+}
+
+bool Checkpoint::Map(const char* path)
+{
+    Unmap();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) { close(fd); return false; }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) return false;
+
+    mapped = static_cast<const char*>(map);
+    mappedSize = st.st_size;
+
+    if (!Head()) { Unmap(); return false; }
+
+    return true;
+}
+
+void Checkpoint::Unmap()
+{
+    if (mapped) munmap(const_cast<char*>(mapped), mappedSize);
+
+    mapped = NULL;
+    mappedSize = 0;
+}
+
+template void Checkpoint::Capture(const SystemT<float, 2>&);
+template bool Checkpoint::Restore(SystemT<float, 2>&) const;
+template SystemT<float, 2>* Checkpoint::MakeSystem(SceneT<float, 2>&) const;
+
+template void Checkpoint::Capture(const SystemT<double, 2>&);
+template bool Checkpoint::Restore(SystemT<double, 2>&) const;
+template SystemT<double, 2>* Checkpoint::MakeSystem(SceneT<double, 2>&) const;
+
+template void Checkpoint::Capture(const SystemT<float, 3>&);
+template bool Checkpoint::Restore(SystemT<float, 3>&) const;
+template SystemT<float, 3>* Checkpoint::MakeSystem(SceneT<float, 3>&) const;
+
+template void Checkpoint::Capture(const SystemT<double, 3>&);
+template bool Checkpoint::Restore(SystemT<double, 3>&) const;
+template SystemT<double, 3>* Checkpoint::MakeSystem(SceneT<double, 3>&) const;
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "scene.hpp"
+#include "system.hpp"
+
+// Full state of a running System: the scene it is built from (types and
+// parameters of every force and constraint), positions, velocities,
+// multipliers, constraint values, redundant constraints, island membership,
+// sleep state and the solver, projection and regularization settings.
+// Restoring and stepping again reproduces the original trajectory bit for
+// bit. J and Jd are not stored, every awake island re-evaluates them before
+// they are used and sleeping islands never read them.
+//
+// Works for every SystemT, a checkpoint only restores into a System of the
+// scalar and dimension it was captured from.
+//
+// The state is a flat array of doubles. Restore copies straight out of it,
+// whether it lives in buf or in a file mapped by Map, without decoding
+// anything in between.
+struct Checkpoint
+{
+    struct Header
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t N, DF, NC, NF;
+        uint32_t islands;
+        uint32_t scalar;     // bytes of T, 0 before version 3 (always double)
+        uint64_t sceneBytes; // padded to 8
+        uint64_t stateDoubles;
+    };
+
+    std::vector<char> buf;
+
+    Checkpoint();
+    ~Checkpoint();
+
+    template<typename T, int D>
+    void Capture(const SystemT<T, D>& system);
+
+    // into a System with the same particles, forces and constraints, which
+    // is the one it was captured from or one made with MakeSystem
+    template<typename T, int D>
+    bool Restore(SystemT<T, D>& system) const;
+
+    // builds a new System from the stored scene, scene owns the elements
+    template<typename T, int D>
+    SystemT<T, D>* MakeSystem(SceneT<T, D>& scene) const;
+
+    bool Save(const char* path) const;
+    bool Load(const char* path);
+    bool Map(const char* path);
+
+private:
+    const Header* Head() const;
+    const double* State() const;
+    void Unmap();
+
+    const char* mapped;
+    std::size_t mappedSize;
+};
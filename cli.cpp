@@ -0,0 +1,567 @@
+#include "cli.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <unistd.h>
+#include <vector>
+
+#include "generators.hpp"
+#include "golden.hpp"
+#include "la.hpp"
+#include "profile.hpp"
+#include "render.hpp"
+#include "scene.hpp"
+#include "stream.hpp"
+#include "sweep.hpp"
+#include "system.hpp"
+#include "trace.hpp"
+#include "tune.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+static constexpr double tick = 1.0/60.0;
+
+static int Usage()
+{
+    std::printf("usage:\n"
+        "  SimplePhysics                                     open the editor\n"
+        "  SimplePhysics run <scene> <seconds> <out> [substeps] [--trace <file> [--every <k>]] [--profile <trace.json>] [--float] [--project] [--backend <name>] [--stream <name>] [--solver <name> [--threads <n>]] [--tune-cache <file>]\n"
+        "  SimplePhysics sweep <scene> <seconds> <out> [substeps] [--k <from:to:n>] [--mass <from:to:n>] [--workers <n>] [--states <file>]\n"
+        "                                                    run every combination of spring and mass scales in worker processes\n"
+        "  SimplePhysics generate <kind> <out> [size]       write a generated scene, kind is chain, pendulum, bridge, cloth or network\n"
+        "  SimplePhysics render <scene> <out.ppm> [--detail <full|reduced|auto>]  draw a scene without a window\n"
+        "  SimplePhysics golden <record|check> <dir> [--only <name>] [--slack <fraction>]\n"
+        "                                                    record or check golden trajectories and throughput of the reference scenes\n"
+        "  SimplePhysics bench [n ...]                       time the dense kernels on every backend\n"
+        "  SimplePhysics replay <trace>                      scrub through a recorded trace\n"
+        "  SimplePhysics watch <name>                        show a stream published by run --stream\n");
+    return 1;
+}
+
+template<typename T, int D>
+static bool WriteState(const char* path, const SystemT<T, D>& system)
+{
+    constexpr int DF = D;
+
+    std::FILE* file = std::fopen(path, "w");
+    if (!file) return false;
+
+    std::fprintf(file, "# time %0.9f substeps %ld totalError %0.17g\n", system.time, system.substeps, system.totalError);
+    std::fprintf(file, DF == 2 ? "# x, y, vx, vy\n" : "# x, y, z, vx, vy, vz\n");
+
+    for (int i = 0; i < system.N; i++)
+    {
+        for (int d = 0; d < DF; d++)
+            std::fprintf(file, "%0.17g, ", (double) system.pos.At(i*DF+d));
+
+        for (int d = 0; d < DF; d++)
+            std::fprintf(file, d + 1 < DF ? "%0.17g, " : "%0.17g\n", (double) system.vel.At(i*DF+d));
+    }
+
+    return std::fclose(file) == 0;
+}
+
+template<typename T, int D>
+static int RunScene(const char* scenePath, double seconds, const char* outPath, int substeps, const char* tracePath, int every, const char* profilePath, bool project, const char* streamName, Solver solver, int threads, const char* tunePath)
+{
+    SceneT<T, D> scene;
+    if (!scene.Load(scenePath)) { std::printf("ERROR: could not load %s\n", scenePath); return 1; }
+
+    SystemT<T, D>* system = scene.MakeSystem();
+    system->projection = project;
+
+    // timed, so the solver and with it the output may change from run to run
+    if (solver == SOLVER_COUNT)
+    {
+        PrintTune(Tune(*system, tunePath));
+    }
+    else
+    {
+        system->solver = solver;
+        system->threads = threads;
+    }
+
+    Recorder* recorder = NULL;
+
+    if (tracePath)
+    {
+        recorder = new Recorder(tracePath, *system, every, TRACE_VEL | TRACE_MULTIPLIERS | TRACE_ERROR);
+        if (!recorder->Ok()) { std::printf("ERROR: could not write %s\n", tracePath); return 1; }
+
+        system->recorder = recorder;
+    }
+
+    StreamWriter* stream = NULL;
+    Snapshot snapshot;
+
+    if (streamName)
+    {
+        system->Publish(snapshot);
+
+        // room for particles and elements added while running
+        stream = new StreamWriter(streamName, 2*system->N + 64, 2*snapshot.segments.size() + 64);
+        if (!stream->Ok()) { std::printf("ERROR: could not create stream %s\n", streamName); return 1; }
+
+        stream->Publish(snapshot);
+    }
+
+    int ticks = (int) (seconds/tick + 0.5);
+
+    Clock::time_point start = Clock::now();
+
+    for (int i = 0; i < ticks; i++)
+    {
+        system->Step(tick, substeps);
+
+        if (stream)
+        {
+            system->Publish(snapshot);
+            stream->Publish(snapshot);
+        }
+    }
+
+    // attached viewers keep the last frame
+    if (stream) delete stream;
+
+    double wall = std::chrono::duration<double>(Clock::now() - start).count();
+
+    // waits for the writer to drain
+    if (recorder) delete recorder;
+
+    std::printf("%s: %d particles, %d constraints, %0.3f s simulated in %0.3f s (%dD, %s, %s)\n", scenePath, system->N, system->NC, system->time, wall, D, sizeof(T) == sizeof(float) ? "float" : "double", BackendName(GetBackend()));
+
+    if (project)
+    {
+        std::printf("projection: %ld Newton iterations over %ld island projections (%0.2f each)\n",
+            system->projectSteps, system->projectSolves, system->projectSolves ? (double) system->projectSteps/system->projectSolves : 0.0);
+    }
+
+    bool ok = WriteState(outPath, *system);
+    if (!ok) std::printf("ERROR: could not write %s\n", outPath);
+
+    if (profilePath)
+    {
+#ifndef SIMPLEPHYSICS_PROFILE
+        std::printf("WARNING: built without SIMPLEPHYSICS_PROFILE, the profile is empty\n");
+#endif
+        Profile::Print();
+
+        if (!Profile::WriteChromeTrace(profilePath))
+        {
+            std::printf("ERROR: could not write %s\n", profilePath);
+            ok = false;
+        }
+    }
+
+    delete system;
+
+    return ok ? 0 : 1;
+}
+
+static int Run(int argc, char** argv)
+{
+    if (argc < 5) return Usage();
+
+    const char* scenePath = argv[2];
+    double seconds = std::atof(argv[3]);
+    const char* outPath = argv[4];
+    int substeps = 10000;
+    const char* tracePath = NULL;
+    int every = 100;
+    const char* profilePath = NULL;
+    bool single = false;
+    bool project = false;
+    const char* streamName = NULL;
+    Solver solver = SOLVER_LU;
+    int threads = 1;
+    const char* tunePath = NULL;
+
+    for (int i = 5; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc) tracePath = argv[++i];
+        else if (std::strcmp(argv[i], "--every") == 0 && i + 1 < argc) every = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--profile") == 0 && i + 1 < argc) profilePath = argv[++i];
+        else if (std::strcmp(argv[i], "--float") == 0) single = true;
+        else if (std::strcmp(argv[i], "--project") == 0) project = true;
+        else if (std::strcmp(argv[i], "--stream") == 0 && i + 1 < argc) streamName = argv[++i];
+        else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--tune-cache") == 0 && i + 1 < argc) tunePath = argv[++i];
+        else if (std::strcmp(argv[i], "--solver") == 0 && i + 1 < argc)
+        {
+            const char* name = argv[++i];
+            solver = std::strcmp(name, "auto") == 0 ? SOLVER_COUNT : SolverByName(name);
+
+            if (solver == SOLVER_COUNT && std::strcmp(name, "auto") != 0)
+            {
+                std::printf("ERROR: unknown solver %s, use auto, lu, cholesky or cg\n", name);
+                return 1;
+            }
+        }
+        else if (std::strcmp(argv[i], "--backend") == 0 && i + 1 < argc)
+        {
+            const char* name = argv[++i];
+            Backend backend = std::strcmp(name, "blas") == 0 ? BACKEND_BLAS : BACKEND_BUILTIN;
+
+            if (std::strcmp(name, BackendName(backend)) != 0 || !SetBackend(backend))
+            {
+                std::printf("ERROR: backend %s is not available, this build has builtin%s\n", name, BackendAvailable(BACKEND_BLAS) ? " and blas" : "");
+                return 1;
+            }
+        }
+        else substeps = std::atoi(argv[i]);
+    }
+
+    int dimensions = SceneDimensions(scenePath);
+
+    if (dimensions == 3)
+    {
+        if (single) return RunScene<float, 3>(scenePath, seconds, outPath, substeps, tracePath, every, profilePath, project, streamName, solver, threads, tunePath);
+        return RunScene<double, 3>(scenePath, seconds, outPath, substeps, tracePath, every, profilePath, project, streamName, solver, threads, tunePath);
+    }
+
+    if (single) return RunScene<float, 2>(scenePath, seconds, outPath, substeps, tracePath, every, profilePath, project, streamName, solver, threads, tunePath);
+    return RunScene<double, 2>(scenePath, seconds, outPath, substeps, tracePath, every, profilePath, project, streamName, solver, threads, tunePath);
+}
+
+// seconds per call of f, repeated until about 0.2 s have passed
+template<typename F>
+static double Time(F f)
+{
+    int reps = 1;
+
+    while (true)
+    {
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < reps; i++) f();
+        double wall = std::chrono::duration<double>(Clock::now() - start).count();
+
+        if (wall > 0.2 || reps >= (1 << 24)) return wall/reps;
+        reps *= 2;
+    }
+}
+
+static double Residual(const Mat& A, const Vec& x, const Vec& b)
+{
+    Vec Ax = A*x;
+
+    double worst = 0.0;
+    for (int i = 0; i < b.Size(); i++)
+        worst = std::max(worst, std::abs(Ax.At(i) - b.At(i)));
+
+    return worst;
+}
+
+// The same kernels and matrices on every compiled in backend, the matrices
+// are symmetric positive definite so LU and Cholesky both apply
+static int Bench(int argc, char** argv)
+{
+    std::vector<int> sizes;
+    for (int i = 2; i < argc; i++) sizes.push_back(std::atoi(argv[i]));
+    if (sizes.empty()) sizes = { 16, 64, 256, 512 };
+
+    Backend initial = GetBackend();
+
+    std::printf("%8s %5s %12s %12s %12s %12s %10s %10s\n", "backend", "n", "gemv us", "gemm us", "lu us", "chol us", "lu res", "chol res");
+
+    for (int n : sizes)
+    {
+        std::mt19937 rng(n);
+        std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+
+        Mat M(n, n);
+        Vec b(n);
+        for (double& v : M.buf) v = uniform(rng);
+        for (double& v : b.buf) v = uniform(rng);
+
+        Mat Mt = M;
+        Mt.Transpose();
+
+        SetBackend(BACKEND_BUILTIN);
+        Mat A = M*Mt;
+        for (int i = 0; i < n; i++) A.At(i, i) += n;
+
+        for (Backend backend : { BACKEND_BUILTIN, BACKEND_BLAS })
+        {
+            if (!SetBackend(backend)) continue;
+
+            Vec y(n);
+            Mat C(n, n);
+
+            double gemv = Time([&] { y = A*b; });
+            double gemm = Time([&] { C = A*M; });
+
+            Vec xlu(n), xchol(n);
+            double lu = Time([&]
+            {
+                Mat F = A;
+                std::vector<int> pivots;
+                F.Factor(pivots);
+                xlu = F.SolveFactored(pivots, b);
+            });
+            double chol = Time([&]
+            {
+                Mat F = A;
+                F.FactorCholesky();
+                xchol = F.SolveCholesky(b);
+            });
+
+            std::printf("%8s %5d %12.2f %12.2f %12.2f %12.2f %10.2e %10.2e\n", BackendName(backend), n,
+                gemv*1e6, gemm*1e6, lu*1e6, chol*1e6, Residual(A, xlu, b), Residual(A, xchol, b));
+        }
+    }
+
+    SetBackend(initial);
+
+    return 0;
+}
+
+static int GenerateScene(int argc, char** argv)
+{
+    if (argc < 4) return Usage();
+
+    Generator generator = GeneratorByName(argv[2]);
+    if (generator == GENERATE_COUNT) return Usage();
+
+    static const int sizes[GENERATE_COUNT] = { 1000, 10, 200, 100, 5000 };
+    int size = argc > 4 ? std::atoi(argv[4]) : sizes[generator];
+
+    Scene scene;
+    scene.elements.Add<Gravity>(200.0);
+    Generate(generator, scene.particles, scene.elements, 100.0, 100.0, size);
+
+    if (!scene.Save(argv[3])) { std::printf("ERROR: could not write %s\n", argv[3]); return 1; }
+
+    std::printf("%s: %s with %zu particles, %zu forces, %zu constraints\n", argv[3], GeneratorName(generator),
+        scene.particles.size(), scene.elements.forces.size(), scene.elements.constraints.size());
+
+    return 0;
+}
+
+template<typename T, int D>
+static int RenderScene(const char* scenePath, const char* outPath, RenderDetail detail)
+{
+    constexpr int width = 1300;
+    constexpr int height = 800;
+
+    SceneT<T, D> scene;
+    if (!scene.Load(scenePath)) { std::printf("ERROR: could not load %s\n", scenePath); return 1; }
+
+    SystemT<T, D>* system = scene.MakeSystem();
+
+    Snapshot snapshot;
+    system->Publish(snapshot);
+    delete system;
+
+    RenderBatch batch;
+    double build = Time([&]() { BuildBatch(snapshot, width, height, detail, batch); });
+
+    std::vector<unsigned char> rgb;
+    RasterizeBatch(batch, width, height, rgb);
+
+    std::FILE* file = std::fopen(outPath, "wb");
+    if (!file) { std::printf("ERROR: could not write %s\n", outPath); return 1; }
+
+    std::fprintf(file, "P6\n%d %d\n255\n", width, height);
+    bool ok = std::fwrite(rgb.data(), 1, rgb.size(), file) == rgb.size();
+    ok = std::fclose(file) == 0 && ok;
+
+    if (!ok) { std::printf("ERROR: could not write %s\n", outPath); return 1; }
+
+    std::printf("%s: %d particles, %zu segments, %d culled, %d merged, %d vertices at %s detail, batch built in %0.3f ms\n", outPath,
+        snapshot.N, snapshot.segments.size(), batch.culled, batch.merged, batch.Vertices(), batch.reduced ? "reduced" : "full", build*1e3);
+
+    return 0;
+}
+
+static int Render(int argc, char** argv)
+{
+    if (argc < 4) return Usage();
+
+    RenderDetail detail = RENDER_AUTO;
+
+    for (int i = 4; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--detail") == 0 && i + 1 < argc)
+        {
+            const char* name = argv[++i];
+
+            if (std::strcmp(name, "full") == 0) detail = RENDER_FULL;
+            else if (std::strcmp(name, "reduced") == 0) detail = RENDER_REDUCED;
+            else if (std::strcmp(name, "auto") != 0) return Usage();
+        }
+        else return Usage();
+    }
+
+    if (SceneDimensions(argv[2]) == 3) return RenderScene<double, 3>(argv[2], argv[3], detail);
+    return RenderScene<double, 2>(argv[2], argv[3], detail);
+}
+
+// from:to:n, n values evenly spaced, or a single value
+static bool ParseRange(const char* text, std::vector<double>& out)
+{
+    double from, to;
+    int n;
+
+    out.clear();
+
+    if (std::sscanf(text, "%lf:%lf:%d", &from, &to, &n) == 3 && n > 0)
+    {
+        for (int i = 0; i < n; i++)
+            out.push_back(n == 1 ? from : from + (to - from)*i/(n - 1));
+
+        return true;
+    }
+
+    if (std::sscanf(text, "%lf", &from) != 1) return false;
+
+    out.push_back(from);
+    return true;
+}
+
+template<typename T, int D>
+static int SweepScene(const char* scenePath, double seconds, const char* outPath, int substeps, const std::vector<double>& ks, const std::vector<double>& masses, int workers, const char* statesPath)
+{
+    constexpr int DF = D;
+
+    SceneT<T, D> scene;
+    if (!scene.Load(scenePath)) { std::printf("ERROR: could not load %s\n", scenePath); return 1; }
+
+    std::vector<SweepVariant> variants;
+    for (double k : ks)
+        for (double mass : masses)
+            variants.push_back({ k, mass });
+
+    std::vector<SweepRun> runs;
+
+    Clock::time_point start = Clock::now();
+
+    if (!Sweep(scene, variants, seconds, substeps, workers, runs)) { std::printf("ERROR: could not set up the shared memory of the sweep\n"); return 1; }
+
+    double wall = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::FILE* file = std::fopen(outPath, "w");
+    if (!file) { std::printf("ERROR: could not write %s\n", outPath); return 1; }
+
+    int failed = 0;
+    double busy = 0.0;
+
+    std::fprintf(file, "# variant, k scale, mass scale, done, attempts, max totalError, wall, time\n");
+
+    for (int i = 0; i < runs.size(); i++)
+    {
+        const SweepRun& r = runs[i];
+        bool done = r.status == SWEEP_DONE;
+
+        std::fprintf(file, "%d, %0.17g, %0.17g, %d, %d, %0.17g, %0.6f, %0.9f\n", i, r.variant.k, r.variant.mass, done ? 1 : 0, r.attempts,
+            done ? r.maxError : NAN, done ? r.wall : NAN, done ? r.time : NAN);
+
+        if (done) busy += r.wall;
+        else failed++;
+    }
+
+    bool ok = std::fclose(file) == 0;
+    if (!ok) std::printf("ERROR: could not write %s\n", outPath);
+
+    if (statesPath)
+    {
+        file = std::fopen(statesPath, "w");
+
+        if (file)
+        {
+            std::fprintf(file, DF == 2 ? "# variant, particle, x, y, vx, vy\n" : "# variant, particle, x, y, z, vx, vy, vz\n");
+
+            for (int i = 0; i < runs.size(); i++)
+            {
+                const std::vector<double>& state = runs[i].state;
+                int N = state.size()/(2*DF);
+
+                for (int p = 0; p < N; p++)
+                {
+                    std::fprintf(file, "%d, %d", i, p);
+
+                    for (int d = 0; d < DF; d++) std::fprintf(file, ", %0.17g", state[p*DF + d]);
+                    for (int d = 0; d < DF; d++) std::fprintf(file, ", %0.17g", state[(N + p)*DF + d]);
+
+                    std::fprintf(file, "\n");
+                }
+            }
+        }
+
+        if (!file || std::fclose(file) != 0)
+        {
+            std::printf("ERROR: could not write %s\n", statesPath);
+            ok = false;
+        }
+    }
+
+    std::printf("%s: %zu variants in %0.3f s, %0.3f s of runs (%0.1fx), %d failed\n", scenePath, runs.size(), wall, busy, wall > 0.0 ? busy/wall : 0.0, failed);
+
+    return ok && failed == 0 ? 0 : 1;
+}
+
+static int RunSweep(int argc, char** argv)
+{
+    if (argc < 5) return Usage();
+
+    const char* scenePath = argv[2];
+    double seconds = std::atof(argv[3]);
+    const char* outPath = argv[4];
+    int substeps = 1000;
+    std::vector<double> ks = { 1.0 }, masses = { 1.0 };
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* statesPath = NULL;
+
+    for (int i = 5; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--k") == 0 && i + 1 < argc) { if (!ParseRange(argv[++i], ks)) return Usage(); }
+        else if (std::strcmp(argv[i], "--mass") == 0 && i + 1 < argc) { if (!ParseRange(argv[++i], masses)) return Usage(); }
+        else if (std::strcmp(argv[i], "--workers") == 0 && i + 1 < argc) workers = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--states") == 0 && i + 1 < argc) statesPath = argv[++i];
+        else substeps = std::atoi(argv[i]);
+    }
+
+    if (SceneDimensions(scenePath) == 3) return SweepScene<double, 3>(scenePath, seconds, outPath, substeps, ks, masses, workers, statesPath);
+    return SweepScene<double, 2>(scenePath, seconds, outPath, substeps, ks, masses, workers, statesPath);
+}
+
+static int Golden(int argc, char** argv)
+{
+    if (argc < 4) return Usage();
+
+    const char* filter = NULL;
+    double slack = 0.25;
+
+    for (int i = 4; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--only") == 0 && i + 1 < argc) filter = argv[++i];
+        else if (std::strcmp(argv[i], "--slack") == 0 && i + 1 < argc) slack = std::atof(argv[++i]);
+        else return Usage();
+    }
+
+    if (std::strcmp(argv[2], "record") == 0) return RecordGolden(argv[3], filter) == 0 ? 0 : 1;
+    if (std::strcmp(argv[2], "check") != 0) return Usage();
+
+    int failed = CheckGolden(argv[3], filter, slack);
+    if (failed) std::printf("%d scene%s failed\n", failed, failed == 1 ? "" : "s");
+
+    return failed == 0 ? 0 : 1;
+}
+
+int RunCommand(int argc, char** argv)
+{
+    if (argc < 2) return Usage();
+
+    if (std::strcmp(argv[1], "run") == 0) return Run(argc, argv);
+    if (std::strcmp(argv[1], "sweep") == 0) return RunSweep(argc, argv);
+    if (std::strcmp(argv[1], "golden") == 0) return Golden(argc, argv);
+    if (std::strcmp(argv[1], "bench") == 0) return Bench(argc, argv);
+    if (std::strcmp(argv[1], "generate") == 0) return GenerateScene(argc, argv);
+    if (std::strcmp(argv[1], "render") == 0) return Render(argc, argv);
+
+    return Usage();
+}
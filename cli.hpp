@@ -0,0 +1,36 @@
+#pragma once
+
+// Headless entry points, selected by the first command line argument:
+//
+//   run <scene.sps> <seconds> <out.csv> [substeps] [--trace <file> [--every <k>]] [--profile <trace.json>]
+//       simulate a scene for the given time at 60 ticks per second and
+//       write the final state of every particle, optionally recording a
+//       frame every k substeps and printing and exporting profile data.
+//       --stream <name> publishes every tick to shared memory (stream.hpp)
+//       --solver <auto|lu|cholesky|cg> picks the island solver, LU by
+//       default, auto times the candidates and caches the winner (tune.hpp)
+//       in the file given by --tune-cache, without it the choice is not kept
+//
+//   sweep <scene.sps> <seconds> <out.csv> [substeps] [--k <from:to:n>] [--mass <from:to:n>] [--workers <n>] [--states <file>]
+//       runs the scene with every combination of spring k and particle mass
+//       scales in worker processes (sweep.hpp) and writes one line of
+//       metrics per variant, the final states optionally
+//
+//   generate <kind> <out.sps> [size]
+//       writes a scene made by one of the generators in generators.hpp
+//
+//   render <scene.sps> <out.ppm> [--detail <full|reduced|auto>]
+//       draws the scene with the software version of the batched renderer
+//       (render.hpp) into a 1300 x 800 image and prints what was culled
+//
+//   golden <record|check> <dir> [--only <name>] [--slack <fraction>]
+//       records golden traces and throughput budgets of the reference scenes
+//       in golden.hpp, or checks against them and exits with 1 when a scene
+//       leaves its tolerance or loses more than slack (0.25) of its throughput
+//
+//   bench [n ...]
+//       times Mat*Vec, Mat*Mat, LU and Cholesky of n x n matrices on every
+//       backend of this build (see Backend in la.hpp)
+//
+// replay and watch are handled by viewer.hpp since they need a window.
+int RunCommand(int argc, char** argv);
@@ -4,237 +4,296 @@
 
 #include "system.hpp"
 
-PositionConstraint::PositionConstraint(int a_, double x_, double y_)
-    : a(a_), x(x_), y(y_)
+template<typename T, int D>
+PositionConstraintT<T, D>::PositionConstraintT(int a_, T x_, T y_, T z_)
+    : a(a_), x(x_), y(y_), z(z_)
 {
 }
 
+template<typename T, int D>
+T PositionConstraintT<T, D>::Target(int d) const
+{
+    return d == 0 ? x : d == 1 ? y : z;
+}
+
 // constraint value
-void PositionConstraint::C(System& system, int i)
+template<typename T, int D>
+void PositionConstraintT<T, D>::C(SystemT<T, D>& system, int i)
 {
-    double ax = system.pos.At(a*system.DF);
-    double ay = system.pos.At(a*system.DF+1);
+    constexpr int DF = D;
 
-    double dx = x - ax;
-    double dy = y - ay;
+    T dsq = 0.0;
 
-    double d = std::sqrt(dx*dx + dy*dy);
+    for (int d = 0; d < DF; d++)
+    {
+        T delta = Target(d) - system.pos.At(a*DF+d);
+        dsq += delta*delta;
+    }
 
-    system.C.At(i) = d;
+    system.C.At(i) = std::sqrt(dsq);
 }
 
 // time derivative of C
-void PositionConstraint::Cd(System& system, int i)
+template<typename T, int D>
+void PositionConstraintT<T, D>::Cd(SystemT<T, D>& system, int i)
 {
-    double ax = system.pos.At(a*system.DF);
-    double ay = system.pos.At(a*system.DF+1);
+    constexpr int DF = D;
 
-    double vx = system.vel.At(a*system.DF);
-    double vy = system.vel.At(a*system.DF+1);
+    T dsq = 0.0;
+    T dot = 0.0;
 
-    double dx = x - ax;
-    double dy = y - ay;
-
-    double d = std::sqrt(dx*dx + dy*dy);
+    for (int d = 0; d < DF; d++)
+    {
+        T delta = Target(d) - system.pos.At(a*DF+d);
+        dsq += delta*delta;
+        dot += delta*system.vel.At(a*DF+d);
+    }
 
-    double p1 = (x - ax) * vx;
-    double p2 = (y - ay) * vy;
+    T dist = std::sqrt(dsq);
 
-    if (d == 0.0) system.Cd.At(i) = 0.0;
-    else system.Cd.At(i) = (-1.0*(p1+p2))/d;
+    if (dist == 0.0) system.Cd.At(i) = 0.0;
+    else system.Cd.At(i) = -dot/dist;
 }
 
 // derivative of C wrt pos (q)
-void PositionConstraint::J(System& system, int i)
+template<typename T, int D>
+void PositionConstraintT<T, D>::J(SystemT<T, D>& system, int i)
 {
-    double ax = system.pos.At(a*system.DF);
-    double ay = system.pos.At(a*system.DF+1);
-
-    double dx = x - ax;
-    double dy = y - ay;
+    constexpr int DF = D;
 
-    double d = std::sqrt(dx*dx + dy*dy);
+    T delta[DF];
+    T dsq = 0.0;
 
-    if (d == 0.0)
+    for (int d = 0; d < DF; d++)
     {
-        system.J.At(i, a*system.DF) = 0.0;
-        system.J.At(i, a*system.DF+1) = 0.0;
+        delta[d] = Target(d) - system.pos.At(a*DF+d);
+        dsq += delta[d]*delta[d];
     }
-    else
+
+    T dist = std::sqrt(dsq);
+
+    for (int d = 0; d < DF; d++)
     {
-        system.J.At(i, a*system.DF) = (-1.0*(x-ax))/d;
-        system.J.At(i, a*system.DF+1) = (-1.0*(y-ay))/d;
+        if (dist == 0.0) system.J.At(i, a*DF+d) = 0.0;
+        else system.J.At(i, a*DF+d) = -delta[d]/dist;
     }
 }
 
 // derivative of Cd wrt pos (q) or time derivative of J
-void PositionConstraint::Jd(System& system, int i)
+template<typename T, int D>
+void PositionConstraintT<T, D>::Jd(SystemT<T, D>& system, int i)
 {
-    double ax = system.pos.At(a*system.DF);
-    double ay = system.pos.At(a*system.DF+1);
-
-    double vx = system.vel.At(a*system.DF);
-    double vy = system.vel.At(a*system.DF+1);
+    constexpr int DF = D;
 
-    double dx = x - ax;
-    double dy = y - ay;
+    T dot = 0.0;
 
-    double d = std::sqrt(dx*dx + dy*dy);
+    for (int d = 0; d < DF; d++)
+        dot += (Target(d) - system.pos.At(a*DF+d))*system.vel.At(a*DF+d);
 
-    double p1 = (x - ax) * vx;
-    double p2 = (y - ay) * vy;
+    T c = system.C.At(i);
+    T Csq = c*c;
 
-    double Csq = system.C.At(i)*system.C.At(i);
-
-    if (Csq == 0.0)
-    {
-        system.Jd.At(i, a*system.DF) = 0.0;
-        system.Jd.At(i, a*system.DF+1) = 0.0;
-    }
-    else
+    for (int d = 0; d < DF; d++)
     {
-        system.Jd.At(i, a*system.DF) = ((system.C.At(i)*vx)-((-1.0*(p1+p2))*system.J.At(i, a*system.DF)))/Csq;
-        system.Jd.At(i, a*system.DF+1) = ((system.C.At(i)*vy)-((-1.0*(p1+p2))*system.J.At(i, a*system.DF+1)))/Csq;
+        if (Csq == 0.0) system.Jd.At(i, a*DF+d) = 0.0;
+        else system.Jd.At(i, a*DF+d) = ((c*system.vel.At(a*DF+d))-(-dot*system.J.At(i, a*DF+d)))/Csq;
     }
 }
 
+template<typename T, int D>
+void PositionConstraintT<T, D>::Particles(std::vector<int>& out) const
+{
+    out.push_back(a);
+}
+
+template<typename T, int D>
+void PositionConstraintT<T, D>::Remap(int from, int to)
+{
+    if (a == from) a = to;
+}
+
+template<typename T, int D>
+void PositionConstraintT<T, D>::Params(std::vector<double>& out) const
+{
+    out.push_back(a);
+    out.push_back(x); out.push_back(y);
+    if (D > 2) out.push_back(z);
+}
 
-DistanceConstraint::DistanceConstraint(int a_, int b_, double dist_)
+template<typename T, int D>
+void PositionConstraintT<T, D>::SetParams(const double* in)
+{
+    a = in[0];
+    x = in[1]; y = in[2];
+    if (D > 2) z = in[3];
+}
+
+template<typename T, int D>
+void PositionConstraintT<T, D>::Segments(std::vector<Segment>& out) const
+{
+    out.push_back({ a, -1, SEGMENT_HOLD });
+}
+
+template<typename T, int D>
+DistanceConstraintT<T, D>::DistanceConstraintT(int a_, int b_, T dist_)
     : a(a_), b(b_), dist(dist_)
 {
 }
 
 // constraint value
-void DistanceConstraint::C(System& system, int i)
+template<typename T, int D>
+void DistanceConstraintT<T, D>::C(SystemT<T, D>& system, int i)
 {
-    double ax = system.pos.At(a*system.DF);
-    double ay = system.pos.At(a*system.DF+1);
+    constexpr int DF = D;
 
-    double bx = system.pos.At(b*system.DF);
-    double by = system.pos.At(b*system.DF+1);
+    T dsq = 0.0;
 
-    double dx = bx - ax;
-    double dy = by - ay;
-
-    double d = std::sqrt(dx*dx + dy*dy);
+    for (int d = 0; d < DF; d++)
+    {
+        T delta = system.pos.At(b*DF+d) - system.pos.At(a*DF+d);
+        dsq += delta*delta;
+    }
 
     // TODO: which way should this subtraction be?
-    system.C.At(i) = d - dist;
+    system.C.At(i) = std::sqrt(dsq) - dist;
 }
 
 // time derivative of C
-void DistanceConstraint::Cd(System& system, int i)
+template<typename T, int D>
+void DistanceConstraintT<T, D>::Cd(SystemT<T, D>& system, int i)
 {
-    double ax = system.pos.At(a*system.DF);
-    double ay = system.pos.At(a*system.DF+1);
-
-    double avx = system.vel.At(a*system.DF);
-    double avy = system.vel.At(a*system.DF+1);
-
-    double bx = system.pos.At(b*system.DF);
-    double by = system.pos.At(b*system.DF+1);
-
-    double bvx = system.vel.At(b*system.DF);
-    double bvy = system.vel.At(b*system.DF+1);
+    constexpr int DF = D;
 
-    double dx = bx - ax;
-    double dy = by - ay;
+    T dsq = 0.0;
+    T top = 0.0;
 
-    double d = std::sqrt(dx*dx + dy*dy);
+    for (int d = 0; d < DF; d++)
+    {
+        T delta = system.pos.At(b*DF+d) - system.pos.At(a*DF+d);
+        dsq += delta*delta;
+        top += delta*(system.vel.At(b*DF+d) - system.vel.At(a*DF+d));
+    }
 
-    double top = (bx-ax)*(bvx-avx)+(by-ay)*(bvy-avy);
+    T len = std::sqrt(dsq);
 
     // TODO: which way should this subtraction be?
-    if (d == 0.0)
+    if (len == 0.0)
     {
         system.Cd.At(i) = 0.0;
     }
     else
     {
-        system.Cd.At(i) = ((top)/d);
+        system.Cd.At(i) = ((top)/len);
     }
 }
 
 // derivative of C wrt system.pos (q)
-void DistanceConstraint::J(System& system, int i)
+template<typename T, int D>
+void DistanceConstraintT<T, D>::J(SystemT<T, D>& system, int i)
 {
-    double ax = system.pos.At(a*system.DF);
-    double ay = system.pos.At(a*system.DF+1);
-
-    double bx = system.pos.At(b*system.DF);
-    double by = system.pos.At(b*system.DF+1);
-
-    double dx = bx - ax;
-    double dy = by - ay;
+    constexpr int DF = D;
 
-    double d = std::sqrt(dx*dx + dy*dy);
+    T delta[DF];
+    T dsq = 0.0;
 
-    if (d == 0.0)
+    for (int d = 0; d < DF; d++)
     {
-        system.J.At(i, a*system.DF) = 0.0;
-        system.J.At(i, a*system.DF+1) = 0.0;
-
-        system.J.At(i, b*system.DF) = 0.0;
-        system.J.At(i, b*system.DF+1) = 0.0;
+        delta[d] = system.pos.At(b*DF+d) - system.pos.At(a*DF+d);
+        dsq += delta[d]*delta[d];
     }
-    else
-    {
-        system.J.At(i, a*system.DF) = -1.0*dx/d;
-        system.J.At(i, a*system.DF+1) = -1.0*dy/d;
 
-        system.J.At(i, b*system.DF) = dx/d;
-        system.J.At(i, b*system.DF+1) = dy/d;
+    T len = std::sqrt(dsq);
+
+    for (int d = 0; d < DF; d++)
+    {
+        if (len == 0.0)
+        {
+            system.J.At(i, a*DF+d) = 0.0;
+            system.J.At(i, b*DF+d) = 0.0;
+        }
+        else
+        {
+            system.J.At(i, a*DF+d) = -delta[d]/len;
+            system.J.At(i, b*DF+d) = delta[d]/len;
+        }
     }
 }
 
 // derivative of Cd wrt system.pos (q) or time derivative of J
-void DistanceConstraint::Jd(System& system, int i)
+template<typename T, int D>
+void DistanceConstraintT<T, D>::Jd(SystemT<T, D>& system, int i)
 {
-    double ax = system.pos.At(a*system.DF);
-    double ay = system.pos.At(a*system.DF+1);
-
-    double avx = system.vel.At(a*system.DF);
-    double avy = system.vel.At(a*system.DF+1);
-
-    double bx = system.pos.At(b*system.DF);
-    double by = system.pos.At(b*system.DF+1);
-
-    double bvx = system.vel.At(b*system.DF);
-    double bvy = system.vel.At(b*system.DF+1);
+    constexpr int DF = D;
 
-    double dx = bx - ax;
-    double dy = by - ay;
+    T dv[DF];
+    T dsq = 0.0;
+    T top = 0.0;
 
-    double d = std::sqrt(dx*dx + dy*dy);
-    double top = (bx-ax)*(bvx-avx)+(by-ay)*(bvy-avy);
+    for (int d = 0; d < DF; d++)
+    {
+        T delta = system.pos.At(b*DF+d) - system.pos.At(a*DF+d);
+        dv[d] = system.vel.At(b*DF+d) - system.vel.At(a*DF+d);
+        dsq += delta*delta;
+        top += delta*dv[d];
+    }
 
-    double dsq = d*d;
+    T len = std::sqrt(dsq);
+    T lsq = len*len;
 
-    if (dsq == 0.0)
+    for (int d = 0; d < DF; d++)
     {
-        system.Jd.At(i, a*system.DF) = 0.0;
-        system.Jd.At(i, a*system.DF+1) = 0.0;
-
-        system.Jd.At(i, b*system.DF) = 0.0;
-        system.Jd.At(i, b*system.DF+1) = 0.0;
+        if (lsq == 0.0)
+        {
+            system.Jd.At(i, a*DF+d) = 0.0;
+            system.Jd.At(i, b*DF+d) = 0.0;
+        }
+        else
+        {
+            system.Jd.At(i, a*DF+d) = (-len*dv[d]-top*system.J.At(i, a*DF+d))/lsq;
+            system.Jd.At(i, b*DF+d) = (len*dv[d]-top*system.J.At(i, b*DF+d))/lsq;
+        }
     }
-    else
-    {
-        system.Jd.At(i, a*system.DF) = (-1.0*d*(bvx-avx)-top*system.J.At(i, a*system.DF))/dsq;
-        system.Jd.At(i, a*system.DF+1) = (-1.0*d*(bvy-avy)-top*system.J.At(i, a*system.DF+1))/dsq;
+}
 
-        system.Jd.At(i, b*system.DF) = (d*(bvx-avx)-top*system.J.At(i, b*system.DF))/dsq;
-        system.Jd.At(i, b*system.DF+1) = (d*(bvy-avy)-top*system.J.At(i, b*system.DF+1))/dsq;
-    }
+template<typename T, int D>
+void DistanceConstraintT<T, D>::Segments(std::vector<Segment>& out) const
+{
+    out.push_back({ a, b, SEGMENT_ROD });
 }
 
-void DistanceConstraint::Draw(System& system)
+template<typename T, int D>
+void DistanceConstraintT<T, D>::Particles(std::vector<int>& out) const
 {
-    double ax = system.pos.At(a*system.DF);
-    double ay = system.pos.At(a*system.DF+1);
+    out.push_back(a);
+    out.push_back(b);
+}
+
+template<typename T, int D>
+void DistanceConstraintT<T, D>::Remap(int from, int to)
+{
+    if (a == from) a = to;
+    if (b == from) b = to;
+}
 
-    double bx = system.pos.At(b*system.DF);
-    double by = system.pos.At(b*system.DF+1);
+template<typename T, int D>
+void DistanceConstraintT<T, D>::Params(std::vector<double>& out) const
+{
+    out.push_back(a); out.push_back(b);
+    out.push_back(dist);
+}
 
-    DrawLine(ax, ay, bx, by, BLUE);
+template<typename T, int D>
+void DistanceConstraintT<T, D>::SetParams(const double* in)
+{
+    a = in[0]; b = in[1];
+    dist = in[2];
 }
+
+template struct PositionConstraintT<float, 2>;
+template struct PositionConstraintT<double, 2>;
+template struct PositionConstraintT<float, 3>;
+template struct PositionConstraintT<double, 3>;
+template struct DistanceConstraintT<float, 2>;
+template struct DistanceConstraintT<double, 2>;
+template struct DistanceConstraintT<float, 3>;
+template struct DistanceConstraintT<double, 3>;
@@ -1,48 +1,80 @@
 #pragma once
 
-#include <raylib.h>
+#include <vector>
 
 #include "la.hpp"
+#include "snapshot.hpp"
 
-class System;
+template<typename T, int D> struct SystemT;
 
-struct Constraint
+// Constraints are templated on the scalar T and the dimension D like SystemT,
+// Constraint, PositionConstraint, ... are the double 2D versions.
+template<typename T, int D>
+struct ConstraintT
 {
-    virtual ~Constraint() = default;
+    virtual ~ConstraintT() = default;
 
-    virtual void C(System& system, int i) = 0;
-    virtual void Cd(System& system, int i) = 0;
+    virtual void C(SystemT<T, D>& system, int i) = 0;
+    virtual void Cd(SystemT<T, D>& system, int i) = 0;
 
-    virtual void J(System& system, int i) = 0;
-    virtual void Jd(System& system, int i) = 0;
+    virtual void J(SystemT<T, D>& system, int i) = 0;
+    virtual void Jd(SystemT<T, D>& system, int i) = 0;
 
-    virtual void Draw(System& system) {  };
+    virtual void Segments(std::vector<Segment>& out) const {  };
+
+    // particles whose columns of J this constraint writes
+    virtual void Particles(std::vector<int>& out) const = 0;
+
+    // particle index from was moved to index to
+    virtual void Remap(int from, int to) = 0;
+
+    // every parameter as a flat list of doubles, for checkpoints
+    virtual void Params(std::vector<double>& out) const = 0;
+    virtual void SetParams(const double* in) = 0;
 };
 
-struct PositionConstraint : public Constraint
+template<typename T, int D>
+struct PositionConstraintT : public ConstraintT<T, D>
 {
     int a;
-    double x, y;
+    T x, y, z; // z is ignored in 2D
 
-    PositionConstraint(int a_, double x_, double y_);
+    PositionConstraintT(int a_, T x_, T y_, T z_ = 0.0);
 
-    virtual void C(System& system, int i) override;
-    virtual void Cd(System& system, int i) override;
-    virtual void J(System& system, int i) override;
-    virtual void Jd(System& system, int i) override;
+    T Target(int d) const;
+
+    virtual void C(SystemT<T, D>& system, int i) override;
+    virtual void Cd(SystemT<T, D>& system, int i) override;
+    virtual void J(SystemT<T, D>& system, int i) override;
+    virtual void Jd(SystemT<T, D>& system, int i) override;
+    virtual void Particles(std::vector<int>& out) const override;
+    virtual void Remap(int from, int to) override;
+    virtual void Params(std::vector<double>& out) const override;
+    virtual void SetParams(const double* in) override;
+
+    virtual void Segments(std::vector<Segment>& out) const override;
 };
 
-struct DistanceConstraint : public Constraint
+template<typename T, int D>
+struct DistanceConstraintT : public ConstraintT<T, D>
 {
     int a, b;
-    double dist;
+    T dist;
 
-    DistanceConstraint(int a_, int b_, double dist_);
+    DistanceConstraintT(int a_, int b_, T dist_);
 
-    virtual void C(System& system, int i) override;
-    virtual void Cd(System& system, int i) override;
-    virtual void J(System& system, int i) override;
-    virtual void Jd(System& system, int i) override;
+    virtual void C(SystemT<T, D>& system, int i) override;
+    virtual void Cd(SystemT<T, D>& system, int i) override;
+    virtual void J(SystemT<T, D>& system, int i) override;
+    virtual void Jd(SystemT<T, D>& system, int i) override;
+    virtual void Particles(std::vector<int>& out) const override;
+    virtual void Remap(int from, int to) override;
+    virtual void Params(std::vector<double>& out) const override;
+    virtual void SetParams(const double* in) override;
 
-    virtual void Draw(System& system) override;
+    virtual void Segments(std::vector<Segment>& out) const override;
 };
+
+typedef ConstraintT<double, 2> Constraint;
+typedef PositionConstraintT<double, 2> PositionConstraint;
+typedef DistanceConstraintT<double, 2> DistanceConstraint;
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "constraints.hpp"
+#include "forces.hpp"
+
+// Refers to one element of type E in a Pool. A removed slot bumps its
+// generation, so a stale handle resolves to NULL instead of to whatever
+// was allocated in the slot afterwards.
+template<typename E>
+struct Handle
+{
+    uint32_t index = ~0u;
+    uint32_t generation = 0;
+};
+
+// Objects of a single type, allocated in chunks of chunkSize that never move.
+// Pointers stay valid until the object is removed and objects of one type
+// sit next to each other in memory. Freed slots are reused by the next Add.
+template<typename E>
+class Pool
+{
+public:
+    static constexpr int chunkSize = 256;
+
+    Pool() = default;
+    Pool(Pool&& other) { Swap(other); }
+    Pool& operator=(Pool&& other) { Clear(); Swap(other); return *this; }
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+    ~Pool() { Clear(); }
+
+    template<typename... Args>
+    Handle<E> Add(Args&&... args)
+    {
+        uint32_t i;
+
+        if (!freeSlots.empty())
+        {
+            i = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        else
+        {
+            if (slots % chunkSize == 0) chunks.emplace_back(new Chunk());
+            i = slots++;
+        }
+
+        Chunk& chunk = *chunks[i/chunkSize];
+        new (chunk.storage + (i%chunkSize)*sizeof(E)) E(std::forward<Args>(args)...);
+        chunk.alive[i%chunkSize] = true;
+        live++;
+
+        return { i, chunk.generation[i%chunkSize] };
+    }
+
+    E* Get(Handle<E> h)
+    {
+        if (h.index >= slots) return NULL;
+
+        Chunk& chunk = *chunks[h.index/chunkSize];
+        int k = h.index%chunkSize;
+
+        return chunk.alive[k] && chunk.generation[k] == h.generation ? At(h.index) : NULL;
+    }
+
+    bool Remove(Handle<E> h)
+    {
+        E* e = Get(h);
+        if (!e) return false;
+
+        Chunk& chunk = *chunks[h.index/chunkSize];
+        e->~E();
+        chunk.alive[h.index%chunkSize] = false;
+        chunk.generation[h.index%chunkSize]++;
+        freeSlots.push_back(h.index);
+        live--;
+
+        return true;
+    }
+
+    void Clear()
+    {
+        for (uint32_t i = 0; i < slots; i++)
+            if (chunks[i/chunkSize]->alive[i%chunkSize]) At(i)->~E();
+
+        chunks.clear();
+        freeSlots.clear();
+        slots = 0;
+        live = 0;
+    }
+
+    void Swap(Pool& other)
+    {
+        chunks.swap(other.chunks);
+        freeSlots.swap(other.freeSlots);
+        std::swap(slots, other.slots);
+        std::swap(live, other.live);
+    }
+
+    int Size() const { return live; }
+
+    // f(E&) on every live object, in memory order
+    template<typename F>
+    void ForEach(F f)
+    {
+        for (uint32_t i = 0; i < slots; i++)
+            if (chunks[i/chunkSize]->alive[i%chunkSize]) f(*At(i));
+    }
+
+    template<typename F>
+    void ForEach(F f) const
+    {
+        for (uint32_t i = 0; i < slots; i++)
+            if (chunks[i/chunkSize]->alive[i%chunkSize]) f(*At(i));
+    }
+
+private:
+    struct Chunk
+    {
+        alignas(E) unsigned char storage[chunkSize*sizeof(E)];
+        uint32_t generation[chunkSize] = {  };
+        bool alive[chunkSize] = {  };
+    };
+
+    std::vector<std::unique_ptr<Chunk>> chunks;
+    std::vector<uint32_t> freeSlots;
+    uint32_t slots = 0; // slots ever used, live or free
+    int live = 0;
+
+    E* At(uint32_t i) { return std::launder(reinterpret_cast<E*>(chunks[i/chunkSize]->storage) + i%chunkSize); }
+    const E* At(uint32_t i) const { return std::launder(reinterpret_cast<const E*>(chunks[i/chunkSize]->storage) + i%chunkSize); }
+};
+
+// Owns the forces and constraints of a scene, one Pool per element type.
+// forces and constraints list them in the order they were added, as the
+// pointers a SystemT is built from. A System never owns its elements, the
+// ElementsT has to outlive every System made from it.
+template<typename T, int D>
+struct ElementsT
+{
+    std::vector<ForceT<T, D>*> forces;
+    std::vector<ConstraintT<T, D>*> constraints;
+
+    ElementsT() = default;
+    ElementsT(const ElementsT&) = delete;
+    ElementsT& operator=(const ElementsT&) = delete;
+
+    template<typename E, typename... Args>
+    Handle<E> Add(Args&&... args)
+    {
+        Handle<E> h = Of<E>().Add(std::forward<Args>(args)...);
+        List<E>().push_back(Of<E>().Get(h));
+        return h;
+    }
+
+    template<typename E>
+    E* Get(Handle<E> h) { return Of<E>().Get(h); }
+
+    // keeps the order of the remaining elements
+    template<typename E>
+    bool Remove(Handle<E> h)
+    {
+        E* e = Of<E>().Get(h);
+        if (!e) return false;
+
+        auto& list = List<E>();
+        list.erase(std::find(list.begin(), list.end(), e));
+
+        return Of<E>().Remove(h);
+    }
+
+    void Clear()
+    {
+        forces.clear();
+        constraints.clear();
+        std::apply([](auto&... pool) { (pool.Clear(), ...); }, pools);
+    }
+
+    void Swap(ElementsT& other)
+    {
+        forces.swap(other.forces);
+        constraints.swap(other.constraints);
+        pools.swap(other.pools);
+    }
+
+    // the pool of one element type, for typed iteration without casts
+    template<typename E>
+    Pool<E>& Of() { return std::get<Pool<E>>(pools); }
+
+    template<typename E>
+    const Pool<E>& Of() const { return std::get<Pool<E>>(pools); }
+
+private:
+    std::tuple<
+        Pool<GravityT<T, D>>,
+        Pool<SpringT<T, D>>,
+        Pool<NBodyT<T, D>>,
+        Pool<PositionConstraintT<T, D>>,
+        Pool<DistanceConstraintT<T, D>>> pools;
+
+    template<typename E>
+    auto& List()
+    {
+        if constexpr (std::is_base_of<ForceT<T, D>, E>::value) return forces;
+        else return constraints;
+    }
+};
+
+typedef ElementsT<double, 2> Elements;
+typedef ElementsT<double, 3> Elements3;
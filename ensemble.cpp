@@ -0,0 +1,621 @@
+#include "ensemble.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <typeinfo>
+
+typedef std::chrono::steady_clock Clock;
+
+Ensemble::Ensemble(const std::vector<System*>& members_)
+    : members(members_), wall(members_.size(), 0.0)
+{
+    std::vector<const Force*> seen;
+
+    for (System* s : members)
+    {
+        for (int i = 0; i < s->NF; i++)
+        {
+            const NBody* nbody = dynamic_cast<const NBody*>(s->forces[i]);
+            if (!nbody) continue;
+
+            if (std::find(seen.begin(), seen.end(), nbody) == seen.end())
+            {
+                seen.push_back(nbody);
+                continue;
+            }
+
+            copies.push_back({ s, i, s->forces[i], std::unique_ptr<Force>(new NBody(*nbody)) });
+            s->forces[i] = copies.back().copy.get();
+        }
+    }
+}
+
+Ensemble::~Ensemble()
+{
+    for (Copy& c : copies)
+        c.member->forces[c.force] = c.shared;
+}
+
+void Ensemble::Run(double seconds, double tick, int substeps)
+{
+    int ticks = (int) (seconds/tick + 0.5);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int m = 0; m < (int) members.size(); m++)
+    {
+        Clock::time_point start = Clock::now();
+
+        for (int t = 0; t < ticks; t++)
+            members[m]->Step(tick, substeps);
+
+        wall[m] += std::chrono::duration<double>(Clock::now() - start).count();
+    }
+}
+
+void Ensemble::Positions(std::vector<double>& out) const
+{
+    out.clear();
+    for (const System* s : members)
+        out.insert(out.end(), s->pos.buf.begin(), s->pos.buf.end());
+}
+
+void Ensemble::Errors(std::vector<double>& out) const
+{
+    out.clear();
+    for (const System* s : members)
+        out.push_back(s->totalError);
+}
+
+enum BatchElement
+{
+    BATCH_GRAVITY = 0,
+    BATCH_SPRING,
+    BATCH_POSITION,
+    BATCH_DISTANCE,
+};
+
+static int ForceType(const Force* f)
+{
+    if (dynamic_cast<const Gravity*>(f)) return BATCH_GRAVITY;
+    if (dynamic_cast<const Spring*>(f)) return BATCH_SPRING;
+    return -1;
+}
+
+static int ConstraintType(const Constraint* c)
+{
+    if (dynamic_cast<const PositionConstraint*>(c)) return BATCH_POSITION;
+    if (dynamic_cast<const DistanceConstraint*>(c)) return BATCH_DISTANCE;
+    return -1;
+}
+
+bool BatchedEnsemble::Compatible(const std::vector<System*>& members)
+{
+    if (members.empty()) return false;
+
+    const System& first = *members[0];
+    if (first.DF != 2) return false;
+
+    std::vector<int> a, b;
+
+    for (const System* s : members)
+    {
+        if (s->N != first.N || s->NF != first.NF || s->NC != first.NC || s->DF != first.DF) return false;
+        if (s->sleeping || s->projection) return false;
+
+        for (int i = 0; i < s->NF; i++)
+        {
+            int type = ForceType(s->forces[i]);
+            if (type == -1 || type != ForceType(first.forces[i])) return false;
+
+            a.clear(); b.clear();
+            s->forces[i]->Particles(a);
+            first.forces[i]->Particles(b);
+            if (a != b) return false;
+        }
+
+        for (int i = 0; i < s->NC; i++)
+        {
+            int type = ConstraintType(s->constraints[i]);
+            if (type == -1 || type != ConstraintType(first.constraints[i])) return false;
+
+            a.clear(); b.clear();
+            s->constraints[i]->Particles(a);
+            first.constraints[i]->Particles(b);
+            if (a != b) return false;
+        }
+    }
+
+    return true;
+}
+
+BatchedEnsemble::BatchedEnsemble(const std::vector<System*>& members)
+    : M(members.size())
+    , N(members[0]->N)
+    , DF(members[0]->DF)
+    , NC(members[0]->NC)
+    , ks(members[0]->ks)
+    , kd(members[0]->kd)
+{
+    const System& first = *members[0];
+
+    int params = 0;
+
+    for (int i = 0; i < first.NF; i++)
+    {
+        Element e = { ForceType(first.forces[i]), -1, -1, params };
+
+        if (e.type == BATCH_SPRING)
+        {
+            const Spring* s = static_cast<const Spring*>(first.forces[i]);
+            e.a = s->a; e.b = s->b;
+            params += 2;
+        }
+        else
+        {
+            params += 1;
+        }
+
+        forces.push_back(e);
+    }
+
+    for (int i = 0; i < first.NC; i++)
+    {
+        Element e = { ConstraintType(first.constraints[i]), -1, -1, params };
+
+        if (e.type == BATCH_POSITION)
+        {
+            e.a = static_cast<const PositionConstraint*>(first.constraints[i])->a;
+            params += 2;
+        }
+        else
+        {
+            const DistanceConstraint* d = static_cast<const DistanceConstraint*>(first.constraints[i]);
+            e.a = d->a; e.b = d->b;
+            params += 1;
+        }
+
+        constraints.push_back(e);
+    }
+
+    for (const Island& island : first.islands)
+    {
+        if (island.constraints.empty()) continue;
+
+        BatchIsland bi;
+        bi.particles = island.particles;
+        bi.constraints = island.constraints;
+        bi.rows.resize(island.particles.size());
+
+        for (int i = 0; i < island.particles.size(); i++)
+        {
+            int p = island.particles[i];
+
+            for (int r : island.rows[i])
+            {
+                const Element& e = constraints[island.constraints[r]];
+                bi.rows[i].push_back(std::make_pair(r, e.a == p ? 0 : 1));
+            }
+        }
+
+        islands.push_back(bi);
+    }
+
+    for (int start = 0; start < M; start += lanes)
+    {
+        Batch batch;
+        int L = batch.L = std::min(lanes, M - start);
+
+        batch.pos.resize(N*DF*L);
+        batch.vel.resize(N*DF*L);
+        batch.force.resize(N*DF*L);
+        batch.massInv.resize(N*DF*L);
+        batch.params.resize(params*L);
+        batch.C.resize(NC*L);
+        batch.Cd.resize(NC*L);
+        batch.l.resize(NC*L);
+        batch.J.resize(NC*4*L);
+        batch.Jd.resize(NC*4*L);
+        batch.redundant.resize(NC*L);
+        batch.regularization.resize(L);
+        batch.largest.resize(L);
+        batch.totalError.resize(L);
+
+        for (int m = 0; m < L; m++)
+        {
+            const System& s = *members[start + m];
+
+            for (int k = 0; k < N*DF; k++)
+            {
+                batch.pos[k*L + m] = s.pos.At(k);
+                batch.vel[k*L + m] = s.vel.At(k);
+                batch.massInv[k*L + m] = s.massInv.At(k);
+            }
+
+            for (int c = 0; c < NC; c++)
+                batch.redundant[c*L + m] = s.redundant[c];
+
+            batch.regularization[m] = s.regularization;
+
+            std::vector<double> v;
+
+            for (int i = 0; i < s.NF; i++)
+            {
+                v.clear();
+                s.forces[i]->Params(v);
+
+                // Params holds the particle indices first, the lane parameters after
+                if (forces[i].type == BATCH_GRAVITY) batch.params[forces[i].param*L + m] = v[0];
+                else for (int j = 0; j < 2; j++) batch.params[(forces[i].param + j)*L + m] = v[2 + j];
+            }
+
+            for (int i = 0; i < s.NC; i++)
+            {
+                v.clear();
+                s.constraints[i]->Params(v);
+
+                if (constraints[i].type == BATCH_POSITION) for (int j = 0; j < 2; j++) batch.params[(constraints[i].param + j)*L + m] = v[1 + j];
+                else batch.params[constraints[i].param*L + m] = v[2];
+            }
+        }
+
+        batches.push_back(batch);
+    }
+}
+
+void BatchedEnsemble::Evaluate(Batch& bt, int c)
+{
+    const int L = bt.L;
+    const Element& e = constraints[c];
+
+    double* C = &bt.C[c*L];
+    double* Cd = &bt.Cd[c*L];
+    double* J = &bt.J[c*4*L];
+    double* Jd = &bt.Jd[c*4*L];
+
+    const double* ax = &bt.pos[(e.a*DF)*L];
+    const double* ay = &bt.pos[(e.a*DF+1)*L];
+    const double* avx = &bt.vel[(e.a*DF)*L];
+    const double* avy = &bt.vel[(e.a*DF+1)*L];
+
+    if (e.type == BATCH_POSITION)
+    {
+        const double* x = &bt.params[e.param*L];
+        const double* y = &bt.params[(e.param+1)*L];
+
+        #pragma omp simd
+        for (int m = 0; m < L; m++)
+        {
+            double dx = x[m] - ax[m];
+            double dy = y[m] - ay[m];
+            double d = std::sqrt(dx*dx + dy*dy);
+            double dv = dx*avx[m] + dy*avy[m];
+
+            double inv = d == 0.0 ? 0.0 : 1.0/d;
+
+            C[m] = d;
+            Cd[m] = -dv*inv;
+
+            double jx = -dx*inv;
+            double jy = -dy*inv;
+            J[m] = jx; J[L + m] = jy; J[2*L + m] = 0.0; J[3*L + m] = 0.0;
+
+            double invsq = inv*inv;
+            Jd[m] = (d*avx[m] + dv*jx)*invsq;
+            Jd[L + m] = (d*avy[m] + dv*jy)*invsq;
+            Jd[2*L + m] = 0.0; Jd[3*L + m] = 0.0;
+        }
+    }
+    else
+    {
+        const double* dist = &bt.params[e.param*L];
+        const double* bx = &bt.pos[(e.b*DF)*L];
+        const double* by = &bt.pos[(e.b*DF+1)*L];
+        const double* bvx = &bt.vel[(e.b*DF)*L];
+        const double* bvy = &bt.vel[(e.b*DF+1)*L];
+
+        #pragma omp simd
+        for (int m = 0; m < L; m++)
+        {
+            double dx = bx[m] - ax[m];
+            double dy = by[m] - ay[m];
+            double rvx = bvx[m] - avx[m];
+            double rvy = bvy[m] - avy[m];
+            double d = std::sqrt(dx*dx + dy*dy);
+            double top = dx*rvx + dy*rvy;
+
+            double inv = d == 0.0 ? 0.0 : 1.0/d;
+
+            C[m] = d - dist[m];
+            Cd[m] = top*inv;
+
+            double jx = dx*inv;
+            double jy = dy*inv;
+            J[m] = -jx; J[L + m] = -jy; J[2*L + m] = jx; J[3*L + m] = jy;
+
+            double invsq = inv*inv;
+            Jd[m] = (-d*rvx + top*jx)*invsq;
+            Jd[L + m] = (-d*rvy + top*jy)*invsq;
+            Jd[2*L + m] = (d*rvx - top*jx)*invsq;
+            Jd[3*L + m] = (d*rvy - top*jy)*invsq;
+        }
+    }
+}
+
+void BatchedEnsemble::Solve(Batch& bt, const BatchIsland& island)
+{
+    const int L = bt.L;
+    const int n = island.constraints.size();
+
+    bt.A.assign(n*n*L, 0.0);
+    bt.b.assign(n*L, 0.0);
+
+    double* A = bt.A.data();
+    double* b = bt.b.data();
+
+    // b = -Jd*qd - J*W*Q - ks*C - kd*Cd
+    for (int r = 0; r < n; r++)
+    {
+        int c = island.constraints[r];
+        const Element& e = constraints[c];
+
+        for (int slot = 0; slot < 2; slot++)
+        {
+            int p = slot == 0 ? e.a : e.b;
+            if (p == -1) continue;
+
+            for (int d = 0; d < DF; d++)
+            {
+                int k = p*DF + d;
+                const double* J = &bt.J[(c*4 + slot*2 + d)*L];
+                const double* Jd = &bt.Jd[(c*4 + slot*2 + d)*L];
+
+                #pragma omp simd
+                for (int m = 0; m < L; m++)
+                    b[r*L + m] -= Jd[m]*bt.vel[k*L + m] + J[m]*bt.massInv[k*L + m]*bt.force[k*L + m];
+            }
+        }
+
+        #pragma omp simd
+        for (int m = 0; m < L; m++)
+            b[r*L + m] -= ks*bt.C[c*L + m] + kd*bt.Cd[c*L + m];
+    }
+
+    // J*W*Jt from constraint pairs that share a particle
+    for (int i = 0; i < island.particles.size(); i++)
+    {
+        const std::vector<std::pair<int, int>>& rows = island.rows[i];
+
+        for (int d = 0; d < DF; d++)
+        {
+            const double* w = &bt.massInv[(island.particles[i]*DF + d)*L];
+
+            for (const std::pair<int, int>& r : rows)
+            {
+                const double* Jr = &bt.J[(island.constraints[r.first]*4 + r.second*2 + d)*L];
+
+                for (const std::pair<int, int>& s : rows)
+                {
+                    const double* Js = &bt.J[(island.constraints[s.first]*4 + s.second*2 + d)*L];
+                    double* a = &A[(r.first*n + s.first)*L];
+
+                    #pragma omp simd
+                    for (int m = 0; m < L; m++)
+                        a[m] += Jr[m]*w[m]*Js[m];
+                }
+            }
+        }
+    }
+
+    // decouple redundant rows, their multiplier solves to 0, then add
+    // eps*I with eps = regularization times the largest diagonal entry, the
+    // same as System::Assemble does for every member
+    double* largest = bt.largest.data();
+    std::fill(largest, largest + L, 0.0);
+
+    for (int r = 0; r < n; r++)
+    {
+        const double* redundant = &bt.redundant[island.constraints[r]*L];
+
+        for (int s = 0; s < n; s++)
+        {
+            double* ars = &A[(r*n + s)*L];
+            double* asr = &A[(s*n + r)*L];
+
+            #pragma omp simd
+            for (int m = 0; m < L; m++)
+                if (redundant[m] != 0.0) ars[m] = asr[m] = 0.0;
+        }
+
+        double* arr = &A[(r*n + r)*L];
+
+        #pragma omp simd
+        for (int m = 0; m < L; m++)
+        {
+            if (redundant[m] != 0.0)
+            {
+                arr[m] = 1.0;
+                b[r*L + m] = 0.0;
+            }
+
+            largest[m] = std::max(largest[m], arr[m]);
+        }
+    }
+
+    for (int m = 0; m < L; m++)
+        if (largest[m] == 0.0) largest[m] = 1.0;
+
+    for (int r = 0; r < n; r++)
+    {
+        double* arr = &A[(r*n + r)*L];
+
+        #pragma omp simd
+        for (int m = 0; m < L; m++)
+            arr[m] += bt.regularization[m]*largest[m];
+    }
+
+    // J*W*Jt + eps*I is symmetric positive definite, so eliminating without
+    // pivoting is stable and keeps every lane on the same path
+    for (int k = 0; k < n; k++)
+    {
+        for (int r = k + 1; r < n; r++)
+        {
+            #pragma omp simd
+            for (int m = 0; m < L; m++)
+            {
+                double piv = A[(k*n + k)*L + m];
+                double f = piv == 0.0 ? 0.0 : A[(r*n + k)*L + m]/piv;
+
+                for (int c = k; c < n; c++)
+                    A[(r*n + c)*L + m] -= f*A[(k*n + c)*L + m];
+
+                b[r*L + m] -= f*b[k*L + m];
+            }
+        }
+    }
+
+    for (int r = n - 1; r >= 0; r--)
+    {
+        double* l = &bt.l[island.constraints[r]*L];
+
+        #pragma omp simd
+        for (int m = 0; m < L; m++)
+        {
+            double v = b[r*L + m];
+            for (int c = r + 1; c < n; c++)
+                v -= A[(r*n + c)*L + m]*bt.l[island.constraints[c]*L + m];
+
+            double piv = A[(r*n + r)*L + m];
+            l[m] = piv == 0.0 ? 0.0 : v/piv;
+        }
+    }
+
+    // force + Jt*l
+    for (int r = 0; r < n; r++)
+    {
+        int c = island.constraints[r];
+        const Element& e = constraints[c];
+
+        for (int slot = 0; slot < 2; slot++)
+        {
+            int p = slot == 0 ? e.a : e.b;
+            if (p == -1) continue;
+
+            for (int d = 0; d < DF; d++)
+            {
+                double* f = &bt.force[(p*DF + d)*L];
+                const double* J = &bt.J[(c*4 + slot*2 + d)*L];
+                const double* l = &bt.l[c*L];
+
+                #pragma omp simd
+                for (int m = 0; m < L; m++)
+                    f[m] += J[m]*l[m];
+            }
+        }
+    }
+}
+
+void BatchedEnsemble::Step(Batch& bt, double h)
+{
+    const int L = bt.L;
+
+    std::fill(bt.force.begin(), bt.force.end(), 0.0);
+
+    for (const Element& e : forces)
+    {
+        if (e.type == BATCH_GRAVITY)
+        {
+            const double* g = &bt.params[e.param*L];
+
+            for (int p = 0; p < N; p++)
+            {
+                double* f = &bt.force[(p*DF+1)*L];
+                const double* w = &bt.massInv[(p*DF)*L];
+
+                #pragma omp simd
+                for (int m = 0; m < L; m++)
+                    f[m] += g[m]/w[m];
+            }
+        }
+        else
+        {
+            const double* len = &bt.params[e.param*L];
+            const double* k = &bt.params[(e.param+1)*L];
+
+            #pragma omp simd
+            for (int m = 0; m < L; m++)
+            {
+                double dx = bt.pos[(e.a*DF)*L + m] - bt.pos[(e.b*DF)*L + m];
+                double dy = bt.pos[(e.a*DF+1)*L + m] - bt.pos[(e.b*DF+1)*L + m];
+                double d = std::sqrt(dx*dx + dy*dy);
+                double F = -k[m]*(d - len[m]);
+
+                bt.force[(e.a*DF)*L + m] += -1.0*dx/d*F;
+                bt.force[(e.a*DF+1)*L + m] += -1.0*dy/d*F;
+                bt.force[(e.b*DF)*L + m] += dx/d*F;
+                bt.force[(e.b*DF+1)*L + m] += dy/d*F;
+            }
+        }
+    }
+
+    for (const BatchIsland& island : islands)
+    {
+        for (int c : island.constraints)
+            Evaluate(bt, c);
+
+        Solve(bt, island);
+    }
+
+    #pragma omp simd
+    for (int i = 0; i < N*DF*L; i++)
+    {
+        bt.vel[i] += bt.force[i]*bt.massInv[i]*h;
+        bt.pos[i] += bt.vel[i]*h;
+    }
+
+    std::fill(bt.totalError.begin(), bt.totalError.end(), 0.0);
+
+    for (int c = 0; c < NC; c++)
+    {
+        #pragma omp simd
+        for (int m = 0; m < L; m++)
+            bt.totalError[m] += std::abs(bt.C[c*L + m]);
+    }
+}
+
+void BatchedEnsemble::Run(double seconds, double tick, int substeps)
+{
+    int ticks = (int) (seconds/tick + 0.5);
+    double h = tick/substeps;
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < (int) batches.size(); i++)
+    {
+        for (int t = 0; t < ticks; t++)
+            for (int s = 0; s < substeps; s++)
+                Step(batches[i], h);
+    }
+}
+
+void BatchedEnsemble::Positions(std::vector<double>& out) const
+{
+    out.resize(M*N*DF);
+
+    int start = 0;
+    for (const Batch& bt : batches)
+    {
+        for (int m = 0; m < bt.L; m++)
+            for (int k = 0; k < N*DF; k++)
+                out[(start + m)*N*DF + k] = bt.pos[k*bt.L + m];
+
+        start += bt.L;
+    }
+}
+
+void BatchedEnsemble::Errors(std::vector<double>& out) const
+{
+    out.clear();
+
+    for (const Batch& bt : batches)
+        out.insert(out.end(), bt.totalError.begin(), bt.totalError.end());
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "system.hpp"
+
+// Steps many independent Systems, one member per task on the OpenMP
+// thread pool. Works for any mix of scenes, members may share forces and
+// constraints. An NBody keeps its tree in the object while it is applied,
+// so a member that shares one with an earlier member is given its own copy
+// while the Ensemble exists.
+struct Ensemble
+{
+    std::vector<System*> members;
+    std::vector<double> wall; // seconds spent on each member
+
+    explicit Ensemble(const std::vector<System*>& members_);
+    ~Ensemble();
+
+    Ensemble(const Ensemble&) = delete;
+    Ensemble& operator=(const Ensemble&) = delete;
+
+    void Run(double seconds, double tick, int substeps);
+
+    // results as arrays, one entry (or one row of N*DF) per member
+    void Positions(std::vector<double>& out) const;
+    void Errors(std::vector<double>& out) const;
+
+private:
+    struct Copy
+    {
+        System* member;
+        int force;
+        Force* shared; // put back on destruction
+        std::unique_ptr<Force> copy;
+    };
+
+    std::vector<Copy> copies;
+};
+
+// Ensemble of Systems that share one topology (same particles, elements and
+// particle indices) and only differ in masses and parameters. The state is
+// stored structure of arrays with the member as the innermost index, so every
+// kernel, including the J*W*Jt assembly and the solve, runs the same
+// instruction over a group of members at once.
+//
+// Members are split into batches of lanes, batches run in parallel. Only
+// Gravity, Spring, PositionConstraint and DistanceConstraint are supported
+// and members have to run with sleeping and projection off, use Compatible
+// to check and fall back to Ensemble otherwise. Redundant constraints and
+// the regularization of every member are handled like System does, so the
+// results agree with stepping each member on its own up to rounding.
+class BatchedEnsemble
+{
+public:
+    static constexpr int lanes = 64;
+
+    static bool Compatible(const std::vector<System*>& members);
+
+    explicit BatchedEnsemble(const std::vector<System*>& members);
+
+    void Run(double seconds, double tick, int substeps);
+
+    void Positions(std::vector<double>& out) const;
+    void Errors(std::vector<double>& out) const;
+
+    int M, N, DF, NC;
+
+private:
+    struct Element
+    {
+        int type;
+        int a, b;
+        int param; // offset of the first lane parameter in Batch::params
+    };
+
+    // one group of up to `lanes` members, every array is [index][lane]
+    struct Batch
+    {
+        int L;
+        std::vector<double> pos, vel, force, massInv;
+        std::vector<double> params;
+        std::vector<double> C, Cd, l, J, Jd; // J and Jd hold 4 entries per constraint
+        std::vector<double> redundant;       // 1 for the redundant constraints of a member
+        std::vector<double> regularization;  // one per lane
+        std::vector<double> A, b, largest;   // scratch for the island solves
+        std::vector<double> totalError;
+    };
+
+    struct BatchIsland
+    {
+        std::vector<int> particles;
+        std::vector<int> constraints;
+        // per island particle, (local row, slot of the particle in that constraint)
+        std::vector<std::vector<std::pair<int, int>>> rows;
+    };
+
+    void Step(Batch& batch, double h);
+    void Evaluate(Batch& batch, int c);
+    void Solve(Batch& batch, const BatchIsland& island);
+
+    std::vector<Element> forces;
+    std::vector<Element> constraints;
+    std::vector<BatchIsland> islands;
+    std::vector<Batch> batches;
+
+    double ks, kd;
+};
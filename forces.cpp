@@ -1,57 +1,324 @@
 #include "forces.hpp"
 
+#include <algorithm>
 #include <cmath>
-#include <raylib.h>
 
 #include "system.hpp"
 
-Gravity::Gravity(double a_)
+template<typename T, int D>
+GravityT<T, D>::GravityT(T a_)
     : a(a_)
 {
 }
 
-void Gravity::Apply(System& system)
+template<typename T, int D>
+void GravityT<T, D>::Apply(SystemT<T, D>& system)
 {
+    constexpr int DF = D;
+
     for (int i = 0; i < system.N; i++)
-        system.force.At(i*system.DF+1) += (1.0/system.massInv.At(i)) * a;
+        system.force.At(i*DF+1) += (T(1)/system.massInv.At(i*DF)) * a;
+}
+
+template<typename T, int D>
+void GravityT<T, D>::Params(std::vector<double>& out) const
+{
+    out.push_back(a);
 }
 
-Spring::Spring(int a_, int b_, double len_, double k_)
+template<typename T, int D>
+void GravityT<T, D>::SetParams(const double* in)
+{
+    a = in[0];
+}
+
+template<typename T, int D>
+SpringT<T, D>::SpringT(int a_, int b_, T len_, T k_)
     : a(a_), b(b_), len(len_), k(k_)
 {
 }
 
-void Spring::Apply(System& system)
+template<typename T, int D>
+void SpringT<T, D>::Apply(SystemT<T, D>& system)
+{
+    constexpr int DF = D;
+
+    T delta[DF];
+    T dsq = 0.0;
+
+    for (int d = 0; d < DF; d++)
+    {
+        delta[d] = system.pos.At(a*DF+d) - system.pos.At(b*DF+d);
+        dsq += delta[d]*delta[d];
+    }
+
+    T dist = std::sqrt(dsq);
+
+    T x = dist - len;
+
+    T F = -k * x;
+
+    for (int d = 0; d < DF; d++)
+    {
+        system.force.At(a*DF+d) += -delta[d]/dist*F;
+        system.force.At(b*DF+d) += delta[d]/dist*F;
+    }
+}
+
+template<typename T, int D>
+void SpringT<T, D>::Segments(std::vector<Segment>& out) const
+{
+    out.push_back({ a, b, SEGMENT_SPRING });
+}
+
+template<typename T, int D>
+void SpringT<T, D>::Particles(std::vector<int>& out) const
+{
+    out.push_back(a);
+    out.push_back(b);
+}
+
+template<typename T, int D>
+void SpringT<T, D>::Remap(int from, int to)
+{
+    if (a == from) a = to;
+    if (b == from) b = to;
+}
+
+template<typename T, int D>
+void SpringT<T, D>::Params(std::vector<double>& out) const
+{
+    out.push_back(a); out.push_back(b);
+    out.push_back(len); out.push_back(k);
+}
+
+template<typename T, int D>
+void SpringT<T, D>::SetParams(const double* in)
+{
+    a = in[0]; b = in[1];
+    len = in[2]; k = in[3];
+}
+
+template<typename T, int D>
+NBodyT<T, D>::NBodyT(T G_, T theta_, T softening_)
+    : G(G_), theta(theta_), softening(softening_)
+{
+}
+
+template<typename T, int D>
+void NBodyT<T, D>::Params(std::vector<double>& out) const
+{
+    out.push_back(G); out.push_back(theta); out.push_back(softening);
+}
+
+template<typename T, int D>
+void NBodyT<T, D>::SetParams(const double* in)
+{
+    G = in[0]; theta = in[1]; softening = in[2];
+}
+
+static constexpr int maxTreeDepth = 48;
+
+template<typename T, int D>
+int NBodyT<T, D>::NewNode(const T* center, T half)
+{
+    Node node;
+    for (int d = 0; d < D; d++) { node.center[d] = center[d]; node.mc[d] = 0.0; }
+    node.half = half;
+    node.m = 0.0;
+    for (int c = 0; c < children; c++) node.child[c] = -1;
+    node.particle = -1;
+
+    nodes.push_back(node);
+    return nodes.size() - 1;
+}
+
+template<typename T, int D>
+bool NBodyT<T, D>::Leaf(const Node& n)
 {
-    double ax = system.pos.At(a*system.DF);
-    double ay = system.pos.At(a*system.DF+1);
+    for (int c = 0; c < children; c++)
+        if (n.child[c] != -1) return false;
 
-    double bx = system.pos.At(b*system.DF);
-    double by = system.pos.At(b*system.DF+1);
+    return true;
+}
 
-    double dx = (ax - bx);
-    double dy = (ay - by);
+// child of node containing point, creating it when absent
+template<typename T, int D>
+int NBodyT<T, D>::Child(int node, const T* point)
+{
+    int quad = 0;
+    for (int d = 0; d < D; d++)
+        quad |= (point[d] >= nodes[node].center[d]) << d;
 
-    double d = std::sqrt(dx*dx + dy*dy);
+    if (nodes[node].child[quad] == -1)
+    {
+        T h = nodes[node].half*T(0.5);
 
-    double x = d - len;
+        T center[D];
+        for (int d = 0; d < D; d++)
+            center[d] = nodes[node].center[d] + (quad & (1 << d) ? h : -h);
+
+        // NewNode may reallocate the pool, so nodes[node] is looked up again
+        int c = NewNode(center, h);
+        nodes[node].child[quad] = c;
+    }
+
+    return nodes[node].child[quad];
+}
+
+template<typename T, int D>
+void NBodyT<T, D>::Insert(SystemT<T, D>& system, int node, int p, int depth)
+{
+    constexpr int DF = D;
 
-    double F = -k * x;
+    T pp[DF];
+    for (int d = 0; d < DF; d++) pp[d] = system.pos.At(p*DF+d);
+    T pm = T(1)/system.massInv.At(p*DF);
 
-    system.force.At(a*system.DF) += -1.0*dx/d*F;
-    system.force.At(a*system.DF+1) += -1.0*dy/d*F;
+    while (true)
+    {
+        Node& n = nodes[node];
 
-    system.force.At(b*system.DF) += dx/d*F;
-    system.force.At(b*system.DF+1) += dy/d*F;
+        bool leaf = Leaf(n);
+
+        if (leaf && n.m == 0.0)
+        {
+            n.particle = p;
+            n.m = pm;
+            for (int d = 0; d < DF; d++) n.mc[d] = pp[d];
+            return;
+        }
+
+        // running center of mass of everything below this node
+        T m = n.m + pm;
+        for (int d = 0; d < DF; d++) n.mc[d] = (n.mc[d]*n.m + pp[d]*pm) / m;
+        n.m = m;
+
+        // coincident particles, stop splitting and just lump them together
+        if (depth >= maxTreeDepth) return;
+
+        if (leaf)
+        {
+            // push the resident particle one level down
+            int q = n.particle;
+            n.particle = -1;
+
+            T qp[DF];
+            for (int d = 0; d < DF; d++) qp[d] = system.pos.At(q*DF+d);
+
+            int c = Child(node, qp);
+            nodes[c].particle = q;
+            nodes[c].m = T(1)/system.massInv.At(q*DF);
+            for (int d = 0; d < DF; d++) nodes[c].mc[d] = qp[d];
+        }
+
+        node = Child(node, pp);
+        depth++;
+    }
 }
 
-void Spring::Draw(System& system)
+template<typename T, int D>
+void NBodyT<T, D>::Build(SystemT<T, D>& system)
 {
-    double ax = system.pos.At(a*system.DF);
-    double ay = system.pos.At(a*system.DF+1);
+    constexpr int DF = D;
+
+    nodes.clear();
+
+    if (system.N == 0) return;
+
+    T lo[DF], hi[DF];
+    for (int d = 0; d < DF; d++) lo[d] = hi[d] = system.pos.At(d);
 
-    double bx = system.pos.At(b*system.DF);
-    double by = system.pos.At(b*system.DF+1);
+    for (int i = 1; i < system.N; i++)
+    {
+        for (int d = 0; d < DF; d++)
+        {
+            T x = system.pos.At(i*DF+d);
+            lo[d] = std::min(lo[d], x); hi[d] = std::max(hi[d], x);
+        }
+    }
 
-    DrawLine(ax, ay, bx, by, YELLOW);
+    T extent = 0.0;
+    T center[DF];
+
+    for (int d = 0; d < DF; d++)
+    {
+        extent = std::max(extent, hi[d] - lo[d]);
+        center[d] = T(0.5)*(lo[d] + hi[d]);
+    }
+
+    NewNode(center, T(0.5)*extent + T(1e-9));
+
+    for (int i = 0; i < system.N; i++)
+        Insert(system, 0, i, 0);
+}
+
+template<typename T, int D>
+void NBodyT<T, D>::Apply(SystemT<T, D>& system)
+{
+    constexpr int DF = D;
+
+    Build(system);
+
+    if (nodes.empty()) return;
+
+    const T eps2 = softening*softening;
+    const T theta2 = theta*theta;
+
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (int i = 0; i < system.N; i++)
+    {
+        T pp[DF], f[DF];
+        for (int d = 0; d < DF; d++) { pp[d] = system.pos.At(i*DF+d); f[d] = 0.0; }
+        T pm = T(1)/system.massInv.At(i*DF);
+
+        int stack[children*maxTreeDepth + children];
+        int top = 0;
+        stack[top++] = 0;
+
+        while (top > 0)
+        {
+            const Node& n = nodes[stack[--top]];
+
+            if (n.particle == i) continue;
+
+            T delta[DF];
+            T r2 = 0.0;
+
+            for (int d = 0; d < DF; d++)
+            {
+                delta[d] = n.mc[d] - pp[d];
+                r2 += delta[d]*delta[d];
+            }
+
+            // (size / distance)^2 < theta^2, the cell is far enough to be one point
+            if (Leaf(n) || T(4)*n.half*n.half < theta2*r2)
+            {
+                T s = r2 + eps2;
+                T g = G*pm*n.m / (s*std::sqrt(s));
+                for (int d = 0; d < DF; d++) f[d] += g*delta[d];
+            }
+            else
+            {
+                for (int c = 0; c < children; c++)
+                    if (n.child[c] != -1) stack[top++] = n.child[c];
+            }
+        }
+
+        for (int d = 0; d < DF; d++)
+            system.force.At(i*DF+d) += f[d];
+    }
 }
+
+template struct GravityT<float, 2>;
+template struct GravityT<double, 2>;
+template struct GravityT<float, 3>;
+template struct GravityT<double, 3>;
+template struct SpringT<float, 2>;
+template struct SpringT<double, 2>;
+template struct SpringT<float, 3>;
+template struct SpringT<double, 3>;
+template struct NBodyT<float, 2>;
+template struct NBodyT<double, 2>;
+template struct NBodyT<float, 3>;
+template struct NBodyT<double, 3>;
@@ -1,35 +1,105 @@
 #pragma once
 
+#include <vector>
+
 #include "la.hpp"
+#include "snapshot.hpp"
 
-class System;
+template<typename T, int D> struct SystemT;
 
-struct Force
+// Forces are templated on the scalar T and the dimension D like SystemT,
+// Force, Gravity, ... are the double 2D versions the editor uses.
+template<typename T, int D>
+struct ForceT
 {
-    virtual ~Force() = default;
+    virtual ~ForceT() = default;
+
+    virtual void Apply(SystemT<T, D>& system) = 0;
+    virtual void Segments(std::vector<Segment>& out) const {  }
+
+    // particles this force couples together, global fields like gravity
+    // report none so they do not merge everything into one island
+    virtual void Particles(std::vector<int>& out) const {  }
+
+    // particle index from was moved to index to
+    virtual void Remap(int from, int to) {  }
 
-    virtual void Apply(System& system) = 0;
-    virtual void Draw(System& system) {  }
+    // every parameter as a flat list of doubles, for checkpoints
+    virtual void Params(std::vector<double>& out) const {  }
+    virtual void SetParams(const double* in) {  }
 };
 
-struct Gravity : public Force
+template<typename T, int D>
+struct GravityT : public ForceT<T, D>
 {
-    double a;
+    T a;
 
-    Gravity(double a_);
+    GravityT(T a_);
 
-    virtual void Apply(System& system) override;
+    virtual void Apply(SystemT<T, D>& system) override;
+    virtual void Params(std::vector<double>& out) const override;
+    virtual void SetParams(const double* in) override;
 };
 
-struct Spring : public Force
+template<typename T, int D>
+struct SpringT : public ForceT<T, D>
 {
     int a, b;
 
-    double len;
-    double k;
+    T len;
+    T k;
+
+    SpringT(int a_, int b_, T len_, T k_);
+
+    virtual void Apply(SystemT<T, D>& system) override;
+    virtual void Segments(std::vector<Segment>& out) const override;
+    virtual void Particles(std::vector<int>& out) const override;
+    virtual void Remap(int from, int to) override;
+    virtual void Params(std::vector<double>& out) const override;
+    virtual void SetParams(const double* in) override;
+};
+
+// Mutual attraction between every pair of particles (F = G*ma*mb/(r^2+eps^2)),
+// approximated with a Barnes-Hut tree (a quadtree in 2D, an octree in 3D).
+// Cells whose size/distance ratio is below theta are treated as a single
+// point mass at their center of mass.
+// Use a negative G for an electrostatic-like repulsion between like charges.
+template<typename T, int D>
+struct NBodyT : public ForceT<T, D>
+{
+    static constexpr int children = 1 << D;
+
+    struct Node
+    {
+        T center[D], half;   // cell center and half extent
+        T m;                 // total mass in the cell
+        T mc[D];             // center of mass
+        int child[children]; // -1 when absent, all -1 for a leaf
+        int particle;        // particle stored in a leaf, -1 if empty or internal
+    };
+
+    T G;
+    T theta;
+    T softening;
 
-    Spring(int a_, int b_, double len_, double k_);
+    // node pool, cleared (not freed) on every rebuild
+    std::vector<Node> nodes;
 
-    virtual void Apply(System& system) override;
-    virtual void Draw(System& system) override;
+    NBodyT(T G_, T theta_ = 0.5, T softening_ = 1.0);
+
+    virtual void Apply(SystemT<T, D>& system) override;
+    virtual void Params(std::vector<double>& out) const override;
+    virtual void SetParams(const double* in) override;
+
+private:
+    int NewNode(const T* center, T half);
+    static bool Leaf(const Node& n);
+    int Child(int node, const T* point);
+    void Insert(SystemT<T, D>& system, int node, int p, int depth);
+    void Build(SystemT<T, D>& system);
 };
+
+typedef ForceT<double, 2> Force;
+typedef GravityT<double, 2> Gravity;
+typedef SpringT<double, 2> Spring;
+typedef NBodyT<double, 2> NBody;
@@ -0,0 +1,237 @@
+#include "generators.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <utility>
+
+#include "spatial.hpp"
+
+static const char* generatorNames[GENERATE_COUNT] = { "chain", "pendulum", "bridge", "cloth", "network" };
+
+const char* GeneratorName(Generator generator)
+{
+    return generator >= 0 && generator < GENERATE_COUNT ? generatorNames[generator] : "unknown";
+}
+
+Generator GeneratorByName(const char* name)
+{
+    for (int g = 0; g < GENERATE_COUNT; g++)
+        if (std::strcmp(name, generatorNames[g]) == 0) return (Generator) g;
+
+    return GENERATE_COUNT;
+}
+
+static int Add(std::vector<Particle>& particles, double x, double y)
+{
+    particles.push_back({ .x = x, .y = y, .m = 1.0 });
+    return particles.size() - 1;
+}
+
+static double Dist(const std::vector<Particle>& particles, int a, int b)
+{
+    double dx = particles[a].x - particles[b].x;
+    double dy = particles[a].y - particles[b].y;
+
+    return std::sqrt(dx*dx + dy*dy);
+}
+
+template<typename T, int D>
+int GenerateChain(std::vector<Particle>& particles, ElementsT<T, D>& elements, double x, double y, int links, double spacing, double k)
+{
+    int base = particles.size();
+
+    for (int i = 0; i <= links; i++)
+        Add(particles, x + i*spacing, y);
+
+    elements.template Add<PositionConstraintT<T, D>>(base, x, y);
+
+    for (int i = 0; i < links; i++)
+        elements.template Add<SpringT<T, D>>(base + i, base + i + 1, spacing, k);
+
+    return particles.size() - base;
+}
+
+template<typename T, int D>
+int GeneratePendulum(std::vector<Particle>& particles, ElementsT<T, D>& elements, double x, double y, int links, double length)
+{
+    int base = particles.size();
+
+    for (int i = 0; i <= links; i++)
+        Add(particles, x + i*length, y);
+
+    elements.template Add<PositionConstraintT<T, D>>(base, x, y);
+
+    for (int i = 0; i < links; i++)
+        elements.template Add<DistanceConstraintT<T, D>>(base + i, base + i + 1, length);
+
+    return particles.size() - base;
+}
+
+template<typename T, int D>
+int GenerateBridge(std::vector<Particle>& particles, ElementsT<T, D>& elements, double x, double y, int planks, double spacing)
+{
+    int base = particles.size();
+
+    // deck particle i is base + 2*i, the rail particle above it follows
+    for (int i = 0; i <= planks; i++)
+    {
+        Add(particles, x + i*spacing, y + 2*spacing);
+        Add(particles, x + i*spacing, y);
+    }
+
+    int last = base + 2*planks;
+
+    for (int end : { base, last })
+    {
+        elements.template Add<PositionConstraintT<T, D>>(end, particles[end].x, particles[end].y);
+        elements.template Add<PositionConstraintT<T, D>>(end + 1, particles[end + 1].x, particles[end + 1].y);
+    }
+
+    // a taut rod deck between two holds has no room to move, give it slack
+    for (int i = 0; i < planks; i++)
+    {
+        int deck = base + 2*i, rail = deck + 1;
+
+        elements.template Add<DistanceConstraintT<T, D>>(deck, deck + 2, 1.02*spacing);
+        elements.template Add<SpringT<T, D>>(rail, rail + 2, spacing, -1000.0);
+        elements.template Add<SpringT<T, D>>(deck, rail, 2*spacing, -500.0);
+    }
+
+    elements.template Add<SpringT<T, D>>(last, last + 1, 2*spacing, -500.0);
+
+    return particles.size() - base;
+}
+
+template<typename T, int D>
+int GenerateCloth(std::vector<Particle>& particles, ElementsT<T, D>& elements, double x, double y, int cols, int rows, double spacing, double k)
+{
+    int base = particles.size();
+
+    for (int r = 0; r < rows; r++)
+        for (int c = 0; c < cols; c++)
+            Add(particles, x + c*spacing, y + r*spacing);
+
+    auto at = [&](int r, int c) { return base + r*cols + c; };
+
+    for (int c = 0; c < cols; c++)
+        if (c % 4 == 0 || c == cols - 1) elements.template Add<PositionConstraintT<T, D>>(at(0, c), x + c*spacing, y);
+
+    double diagonal = std::sqrt(2.0)*spacing;
+
+    for (int r = 0; r < rows; r++)
+    {
+        for (int c = 0; c < cols; c++)
+        {
+            if (c + 1 < cols) elements.template Add<SpringT<T, D>>(at(r, c), at(r, c + 1), spacing, k);
+            if (r + 1 < rows) elements.template Add<SpringT<T, D>>(at(r, c), at(r + 1, c), spacing, k);
+
+            if (r + 1 < rows && c + 1 < cols)
+            {
+                elements.template Add<SpringT<T, D>>(at(r, c), at(r + 1, c + 1), diagonal, k);
+                elements.template Add<SpringT<T, D>>(at(r, c + 1), at(r + 1, c), diagonal, k);
+            }
+        }
+    }
+
+    return particles.size() - base;
+}
+
+template<typename T, int D>
+int GenerateNetwork(std::vector<Particle>& particles, ElementsT<T, D>& elements, double x, double y, int nodes, double spacing, int degree, unsigned seed)
+{
+    int base = particles.size();
+
+    double side = spacing*std::sqrt((double) nodes);
+
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, side);
+
+    SpatialGrid grid(2*spacing);
+
+    for (int i = 0; i < nodes; i++)
+    {
+        int p = Add(particles, x + uniform(rng), y + uniform(rng));
+        grid.Insert(p - base, particles[p].x, particles[p].y);
+    }
+
+    std::vector<int> near;
+    std::vector<std::pair<double, int>> sorted;
+    std::vector<std::pair<int, int>> links;
+
+    for (int i = 0; i < nodes; i++)
+    {
+        const Particle& p = particles[base + i];
+
+        // widen the search until there are enough neighbours
+        near.clear();
+        for (double r = 2*spacing; near.size() <= (std::size_t) degree && r < 2*side; r *= 2)
+        {
+            near.clear();
+            grid.Query(p.x, p.y, r, near);
+        }
+
+        sorted.clear();
+        for (int j : near)
+            if (j != i) sorted.push_back({ Dist(particles, base + i, base + j), j });
+
+        std::sort(sorted.begin(), sorted.end());
+
+        for (int n = 0; n < degree && n < sorted.size(); n++)
+            links.push_back({ std::min(i, sorted[n].second), std::max(i, sorted[n].second) });
+
+        if (p.y < y + spacing) elements.template Add<PositionConstraintT<T, D>>(base + i, p.x, p.y);
+    }
+
+    // neighbourhood is not symmetric, a pair may have been found from both ends
+    std::sort(links.begin(), links.end());
+    links.erase(std::unique(links.begin(), links.end()), links.end());
+
+    for (const std::pair<int, int>& l : links)
+        elements.template Add<SpringT<T, D>>(base + l.first, base + l.second, Dist(particles, base + l.first, base + l.second), -100.0);
+
+    return particles.size() - base;
+}
+
+template<typename T, int D>
+int Generate(Generator generator, std::vector<Particle>& particles, ElementsT<T, D>& elements, double x, double y, int size, unsigned seed)
+{
+    switch (generator)
+    {
+        case GENERATE_CHAIN: return GenerateChain(particles, elements, x, y, size, 15.0, -500.0);
+        case GENERATE_PENDULUM: return GeneratePendulum(particles, elements, x, y, size, 60.0);
+        case GENERATE_BRIDGE: return GenerateBridge(particles, elements, x, y, size, 25.0);
+        case GENERATE_CLOTH: return GenerateCloth(particles, elements, x, y, size, std::max(2, 2*size/3), 15.0, -1000.0);
+        case GENERATE_NETWORK: return GenerateNetwork(particles, elements, x, y, size, 20.0, 3, seed);
+        default: return 0;
+    }
+}
+
+template int GenerateChain(std::vector<Particle>&, ElementsT<float, 2>&, double, double, int, double, double);
+template int GeneratePendulum(std::vector<Particle>&, ElementsT<float, 2>&, double, double, int, double);
+template int GenerateBridge(std::vector<Particle>&, ElementsT<float, 2>&, double, double, int, double);
+template int GenerateCloth(std::vector<Particle>&, ElementsT<float, 2>&, double, double, int, int, double, double);
+template int GenerateNetwork(std::vector<Particle>&, ElementsT<float, 2>&, double, double, int, double, int, unsigned);
+template int Generate(Generator, std::vector<Particle>&, ElementsT<float, 2>&, double, double, int, unsigned);
+
+template int GenerateChain(std::vector<Particle>&, ElementsT<double, 2>&, double, double, int, double, double);
+template int GeneratePendulum(std::vector<Particle>&, ElementsT<double, 2>&, double, double, int, double);
+template int GenerateBridge(std::vector<Particle>&, ElementsT<double, 2>&, double, double, int, double);
+template int GenerateCloth(std::vector<Particle>&, ElementsT<double, 2>&, double, double, int, int, double, double);
+template int GenerateNetwork(std::vector<Particle>&, ElementsT<double, 2>&, double, double, int, double, int, unsigned);
+template int Generate(Generator, std::vector<Particle>&, ElementsT<double, 2>&, double, double, int, unsigned);
+
+template int GenerateChain(std::vector<Particle>&, ElementsT<float, 3>&, double, double, int, double, double);
+template int GeneratePendulum(std::vector<Particle>&, ElementsT<float, 3>&, double, double, int, double);
+template int GenerateBridge(std::vector<Particle>&, ElementsT<float, 3>&, double, double, int, double);
+template int GenerateCloth(std::vector<Particle>&, ElementsT<float, 3>&, double, double, int, int, double, double);
+template int GenerateNetwork(std::vector<Particle>&, ElementsT<float, 3>&, double, double, int, double, int, unsigned);
+template int Generate(Generator, std::vector<Particle>&, ElementsT<float, 3>&, double, double, int, unsigned);
+
+template int GenerateChain(std::vector<Particle>&, ElementsT<double, 3>&, double, double, int, double, double);
+template int GeneratePendulum(std::vector<Particle>&, ElementsT<double, 3>&, double, double, int, double);
+template int GenerateBridge(std::vector<Particle>&, ElementsT<double, 3>&, double, double, int, double);
+template int GenerateCloth(std::vector<Particle>&, ElementsT<double, 3>&, double, double, int, int, double, double);
+template int GenerateNetwork(std::vector<Particle>&, ElementsT<double, 3>&, double, double, int, double, int, unsigned);
+template int Generate(Generator, std::vector<Particle>&, ElementsT<double, 3>&, double, double, int, unsigned);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+
+#include "elements.hpp"
+#include "system.hpp"
+
+// Procedural structures for the editor and the generate command. Every
+// generator appends particles and elements (particle indices start after
+// the existing particles) and returns the number of particles it added.
+// Structures are laid out in the x, y plane starting at (x, y) and growing
+// right and down, like screen coordinates. Springs use the editor's sign
+// convention, a negative k pulls the ends together.
+
+enum Generator
+{
+    GENERATE_CHAIN = 0, // springs between consecutive particles, the first one held
+    GENERATE_PENDULUM,  // rods between consecutive particles, the first one held
+    GENERATE_BRIDGE,    // sagging rod deck between two holds, hung from a spring rail
+    GENERATE_CLOTH,     // grid with structural and shear springs, held along the top
+    GENERATE_NETWORK,   // random particles linked to their nearest neighbours by springs
+    GENERATE_COUNT,
+};
+
+const char* GeneratorName(Generator generator);
+
+// GENERATE_COUNT if name is not a generator
+Generator GeneratorByName(const char* name);
+
+template<typename T, int D>
+int GenerateChain(std::vector<Particle>& particles, ElementsT<T, D>& elements, double x, double y, int links, double spacing, double k);
+
+template<typename T, int D>
+int GeneratePendulum(std::vector<Particle>& particles, ElementsT<T, D>& elements, double x, double y, int links, double length);
+
+template<typename T, int D>
+int GenerateBridge(std::vector<Particle>& particles, ElementsT<T, D>& elements, double x, double y, int planks, double spacing);
+
+template<typename T, int D>
+int GenerateCloth(std::vector<Particle>& particles, ElementsT<T, D>& elements, double x, double y, int cols, int rows, double spacing, double k);
+
+// nodes scattered over a square holding about one per spacing^2, each one
+// linked to its degree nearest neighbours, the top band is held
+template<typename T, int D>
+int GenerateNetwork(std::vector<Particle>& particles, ElementsT<T, D>& elements, double x, double y, int nodes, double spacing, int degree, unsigned seed);
+
+// any of the above with default parameters, size is the links, planks,
+// columns (rows are two thirds of them) or nodes
+template<typename T, int D>
+int Generate(Generator generator, std::vector<Particle>& particles, ElementsT<T, D>& elements, double x, double y, int size, unsigned seed = 1);
@@ -0,0 +1,611 @@
+#include "golden.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <sys/stat.h>
+
+#include "checkpoint.hpp"
+#include "ensemble.hpp"
+#include "render.hpp"
+#include "scene.hpp"
+#include "trace.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+static constexpr double tick = 1.0/60.0;
+
+static const char* budgetsName = "budgets.txt";
+
+// Throughput is the median of this many timed runs after the accuracy run,
+// which warms up caches, the allocator and the clock of the CPU. Each timed
+// run steps fresh copies of the scene until at least timedSeconds have
+// passed, a scene that takes a few milliseconds is otherwise at the mercy
+// of the scheduler. The spread between the fastest and the slowest run is
+// recorded as the noise of the budget.
+static constexpr int timedRuns = 5;
+static constexpr double timedSeconds = 0.2;
+
+// Tolerances sit three orders of magnitude above what reordering the
+// arithmetic does (the BLAS backend, FMA with -march=native). Raising
+// System::regularization tenfold already fails every double scene.
+static const std::vector<GoldenScene> library =
+{
+    // name               generator          size  D  float  solver           project  seconds  substeps  tolerance  checks
+    { "pendulum",         GENERATE_PENDULUM,    3, 2, false, SOLVER_LU,       false,   2.0,     1000,     1e-6,      GOLDEN_ENSEMBLE },
+    { "pendulum-project", GENERATE_PENDULUM,    3, 2, false, SOLVER_LU,       true,    2.0,     100,      1e-6,      GOLDEN_RESTORE },
+    { "pendulum-float",   GENERATE_PENDULUM,    3, 2, true,  SOLVER_LU,       false,   2.0,     1000,     5e-4,      GOLDEN_RESTORE },
+    { "pendulum-3d",      GENERATE_PENDULUM,    3, 3, false, SOLVER_LU,       false,   2.0,     1000,     1e-6,      GOLDEN_RESTORE },
+    { "chain",            GENERATE_CHAIN,     100, 2, false, SOLVER_LU,       false,   1.0,     200,      1e-6,      GOLDEN_ENSEMBLE | GOLDEN_RASTER },
+    { "bridge",           GENERATE_BRIDGE,     40, 2, false, SOLVER_CHOLESKY, false,   1.0,     200,      1e-6,      GOLDEN_RESTORE | GOLDEN_ENSEMBLE | GOLDEN_RASTER },
+    { "cloth",            GENERATE_CLOTH,      16, 2, false, SOLVER_CG,       false,   1.0,     100,      1e-6,      GOLDEN_RESTORE | GOLDEN_RASTER },
+    { "network",          GENERATE_NETWORK,   400, 2, false, SOLVER_LU,       false,   1.0,     100,      1e-6,      GOLDEN_RASTER },
+};
+
+struct GoldenRun
+{
+    long ticks;
+    double worst;      // largest position difference
+    double diverged;   // time the tolerance was first exceeded, -1 if never
+    bool complete;     // the golden trace covered every tick
+};
+
+static long Ticks(const GoldenScene& g)
+{
+    return (long) (g.seconds/tick + 0.5);
+}
+
+template<typename T, int D>
+static SystemT<T, D>* Build(const GoldenScene& g, SceneT<T, D>& scene)
+{
+    scene.elements.template Add<GravityT<T, D>>(200.0);
+    Generate(g.generator, scene.particles, scene.elements, 100.0, 100.0, g.size);
+
+    SystemT<T, D>* system = scene.MakeSystem();
+    system->solver = g.solver;
+    system->projection = g.project;
+
+    return system;
+}
+
+// steps the scene, recording into tracePath and comparing with golden when given
+template<typename T, int D>
+static bool Run(const GoldenScene& g, const char* tracePath, const Trace* golden, GoldenRun& out)
+{
+    SceneT<T, D> scene;
+    SystemT<T, D>* system = Build(g, scene);
+
+    Recorder* recorder = NULL;
+
+    if (tracePath)
+    {
+        recorder = new Recorder(tracePath, *system, g.substeps, TRACE_VEL | TRACE_ERROR);
+        system->recorder = recorder;
+    }
+
+    int n = system->N*system->DF;
+
+    out.ticks = Ticks(g);
+    out.worst = 0.0;
+    out.diverged = -1.0;
+    out.complete = true;
+
+    if (golden && (golden->header.N != (uint32_t) system->N || golden->header.DF != (uint32_t) system->DF || golden->header.interval != (uint32_t) g.substeps))
+        out.complete = false;
+
+    for (long t = 0; t < out.ticks; t++)
+    {
+        system->Step(tick, g.substeps);
+
+        if (!golden || !out.complete) continue;
+
+        if (t >= golden->Frames() || golden->Substeps(t) != system->substeps)
+        {
+            out.complete = false;
+            continue;
+        }
+
+        const double* pos = golden->Pos(t);
+
+        for (int i = 0; i < n; i++)
+        {
+            double d = std::abs((double) system->pos.At(i) - pos[i]);
+            if (std::isnan(d)) d = std::numeric_limits<double>::infinity();
+
+            out.worst = std::max(out.worst, d);
+        }
+
+        if (out.worst > g.tolerance && out.diverged < 0.0) out.diverged = system->time;
+    }
+
+    bool ok = true;
+
+    if (recorder)
+    {
+        ok = recorder->Ok();
+        delete recorder;
+    }
+
+    delete system;
+
+    return ok;
+}
+
+static bool Run(const GoldenScene& g, const char* tracePath, const Trace* golden, GoldenRun& out)
+{
+    if (g.dimensions == 3) return g.single ? Run<float, 3>(g, tracePath, golden, out) : Run<double, 3>(g, tracePath, golden, out);
+    return g.single ? Run<float, 2>(g, tracePath, golden, out) : Run<double, 2>(g, tracePath, golden, out);
+}
+
+// substeps per second of System::Step over the whole scene, repeated until
+// timedSeconds have passed, building the System is not timed
+template<typename T, int D>
+static double Timed(const GoldenScene& g)
+{
+    long ticks = Ticks(g);
+    long substeps = 0;
+    double wall = 0.0;
+
+    while (wall < timedSeconds)
+    {
+        SceneT<T, D> scene;
+        SystemT<T, D>* system = Build(g, scene);
+
+        Clock::time_point start = Clock::now();
+
+        for (long t = 0; t < ticks; t++)
+            system->Step(tick, g.substeps);
+
+        wall += std::chrono::duration<double>(Clock::now() - start).count();
+        substeps += ticks*g.substeps;
+
+        delete system;
+    }
+
+    return substeps/wall;
+}
+
+static double Timed(const GoldenScene& g)
+{
+    if (g.dimensions == 3) return g.single ? Timed<float, 3>(g) : Timed<double, 3>(g);
+    return g.single ? Timed<float, 2>(g) : Timed<double, 2>(g);
+}
+
+// the median of timedRuns runs, noise is the spread of the runs relative to it
+static double Throughput(const GoldenScene& g, double& noise)
+{
+    std::vector<double> runs;
+
+    for (int i = 0; i < timedRuns; i++)
+        runs.push_back(Timed(g));
+
+    std::sort(runs.begin(), runs.end());
+
+    double median = runs[timedRuns/2];
+    noise = median > 0.0 ? (runs.back() - runs.front())/median : 0.0;
+
+    return median;
+}
+
+// GOLDEN_RESTORE, the largest position difference between the straight
+// run and the restored one over the ticks after the restore, -1 if the
+// checkpoint did not restore
+template<typename T, int D>
+static double Restore(const GoldenScene& g)
+{
+    long ticks = Ticks(g), half = ticks/2;
+
+    SceneT<T, D> scene;
+    SystemT<T, D>* system = Build(g, scene);
+
+    int n = system->N*system->DF;
+
+    std::vector<double> straight;
+
+    for (long t = 0; t < ticks; t++)
+    {
+        system->Step(tick, g.substeps);
+        if (t >= half) straight.insert(straight.end(), system->pos.buf.begin(), system->pos.buf.end());
+    }
+
+    delete system;
+
+    SceneT<T, D> first;
+    system = Build(g, first);
+
+    for (long t = 0; t < half; t++)
+        system->Step(tick, g.substeps);
+
+    Checkpoint checkpoint;
+    checkpoint.Capture(*system);
+
+    delete system;
+
+    // nothing of the first run is left, the restored System and its
+    // elements come from the checkpoint alone
+    SceneT<T, D> restored;
+    system = checkpoint.MakeSystem(restored);
+
+    if (!system) return -1.0;
+
+    double worst = 0.0;
+
+    for (long t = half; t < ticks; t++)
+    {
+        system->Step(tick, g.substeps);
+
+        const double* pos = &straight[(t - half)*n];
+
+        for (int i = 0; i < n; i++)
+        {
+            double d = std::abs((double) system->pos.At(i) - pos[i]);
+            if (std::isnan(d)) d = std::numeric_limits<double>::infinity();
+
+            worst = std::max(worst, d);
+        }
+    }
+
+    delete system;
+
+    return worst;
+}
+
+static double Restore(const GoldenScene& g)
+{
+    if (g.dimensions == 3) return g.single ? Restore<float, 3>(g) : Restore<double, 3>(g);
+    return g.single ? Restore<float, 2>(g) : Restore<double, 2>(g);
+}
+
+// mass scales of the GOLDEN_ENSEMBLE members
+static const double ensembleMasses[] = { 1.0, 0.5, 2.0, 3.0 };
+
+// GOLDEN_ENSEMBLE, the largest position difference of the Ensemble and of
+// the BatchedEnsemble from the members stepped on their own, false if the
+// members cannot be batched
+static bool Ensembles(const GoldenScene& g, double& ensemble, double& batched)
+{
+    ensemble = batched = 0.0;
+
+    if (g.dimensions != 2 || g.single) return false;
+
+    // the members share the elements of one scene, like a sweep would
+    Scene scene;
+    delete Build(g, scene);
+
+    std::vector<System*> alone, together, lanes;
+
+    for (double scale : ensembleMasses)
+    {
+        std::vector<Particle> particles = scene.particles;
+        for (Particle& p : particles) p.m *= scale;
+
+        for (std::vector<System*>* members : { &alone, &together, &lanes })
+        {
+            System* system = new System(particles, scene.elements.forces, scene.elements.constraints);
+            system->solver = g.solver;
+            system->sleeping = false;
+
+            members->push_back(system);
+        }
+    }
+
+    bool compatible = BatchedEnsemble::Compatible(lanes);
+
+    long ticks = Ticks(g);
+
+    std::vector<double> reference, positions;
+
+    for (System* system : alone)
+    {
+        for (long t = 0; t < ticks; t++)
+            system->Step(tick, g.substeps);
+
+        reference.insert(reference.end(), system->pos.buf.begin(), system->pos.buf.end());
+    }
+
+    {
+        Ensemble run(together);
+        run.Run(ticks*tick, tick, g.substeps);
+        run.Positions(positions);
+    }
+
+    for (int i = 0; i < reference.size(); i++)
+        ensemble = std::max(ensemble, std::isnan(positions[i]) ? std::numeric_limits<double>::infinity() : std::abs(positions[i] - reference[i]));
+
+    if (compatible)
+    {
+        BatchedEnsemble run(lanes);
+        run.Run(ticks*tick, tick, g.substeps);
+        run.Positions(positions);
+
+        for (int i = 0; i < reference.size(); i++)
+            batched = std::max(batched, std::isnan(positions[i]) ? std::numeric_limits<double>::infinity() : std::abs(positions[i] - reference[i]));
+    }
+
+    for (std::vector<System*>* members : { &alone, &together, &lanes })
+        for (System* system : *members) delete system;
+
+    return compatible;
+}
+
+// view of the editor and of the render command
+static constexpr int rasterWidth = 1300;
+static constexpr int rasterHeight = 800;
+
+// GOLDEN_RASTER, pixels that differ between a culled batch and one that
+// keeps everything, with the center of the scene on each corner of the view
+// in turn so it hangs off every edge. culled counts the dropped elements.
+template<typename T, int D>
+static long Raster(const GoldenScene& g, long& culled)
+{
+    SceneT<T, D> scene;
+    SystemT<T, D>* system = Build(g, scene);
+
+    Snapshot snapshot;
+    system->Publish(snapshot);
+
+    delete system;
+
+    const std::vector<double> pos = snapshot.pos;
+    const int DF = snapshot.DF;
+
+    double minX = std::numeric_limits<double>::infinity(), maxX = -minX;
+    double minY = minX, maxY = maxX;
+
+    for (int i = 0; i < snapshot.N; i++)
+    {
+        minX = std::min(minX, pos[i*DF]); maxX = std::max(maxX, pos[i*DF]);
+        minY = std::min(minY, pos[i*DF+1]); maxY = std::max(maxY, pos[i*DF+1]);
+    }
+
+    RenderBatch batch, all;
+    std::vector<unsigned char> image, reference;
+
+    long differ = 0;
+    culled = 0;
+
+    for (int corner = 0; corner < 4; corner++)
+    {
+        double dx = (corner & 1 ? rasterWidth : 0) - (minX + maxX)/2;
+        double dy = (corner & 2 ? rasterHeight : 0) - (minY + maxY)/2;
+
+        for (int i = 0; i < snapshot.N; i++)
+        {
+            snapshot.pos[i*DF] = pos[i*DF] + dx;
+            snapshot.pos[i*DF+1] = pos[i*DF+1] + dy;
+        }
+
+        BuildBatch(snapshot, rasterWidth, rasterHeight, RENDER_FULL, batch);
+        BuildBatch(snapshot, rasterWidth, rasterHeight, RENDER_FULL, all, false);
+
+        RasterizeBatch(batch, rasterWidth, rasterHeight, image);
+        RasterizeBatch(all, rasterWidth, rasterHeight, reference);
+
+        for (std::size_t p = 0; p < image.size(); p += 3)
+            if (std::memcmp(&image[p], &reference[p], 3) != 0) differ++;
+
+        culled += batch.culled;
+    }
+
+    return differ;
+}
+
+static long Raster(const GoldenScene& g, long& culled)
+{
+    if (g.dimensions == 3) return g.single ? Raster<float, 3>(g, culled) : Raster<double, 3>(g, culled);
+    return g.single ? Raster<float, 2>(g, culled) : Raster<double, 2>(g, culled);
+}
+
+struct Budget
+{
+    char name[64];
+    double throughput; // substeps per second when recorded
+    double noise;      // spread of the timed runs, relative to throughput
+};
+
+static std::vector<Budget> ReadBudgets(const char* dir)
+{
+    std::vector<Budget> budgets;
+
+    char path[1024];
+    std::snprintf(path, sizeof(path), "%s/%s", dir, budgetsName);
+
+    std::FILE* file = std::fopen(path, "r");
+    if (!file) return budgets;
+
+    char line[256];
+
+    while (std::fgets(line, sizeof(line), file))
+    {
+        // budgets recorded without a noise margin have none
+        Budget b;
+        b.noise = 0.0;
+
+        if (std::sscanf(line, "%63s %lf %lf", b.name, &b.throughput, &b.noise) >= 2) budgets.push_back(b);
+    }
+
+    std::fclose(file);
+
+    return budgets;
+}
+
+static bool WriteBudgets(const char* dir, const std::vector<Budget>& budgets)
+{
+    char path[1024];
+    std::snprintf(path, sizeof(path), "%s/%s", dir, budgetsName);
+
+    std::FILE* file = std::fopen(path, "w");
+    if (!file) return false;
+
+    for (const Budget& b : budgets)
+        std::fprintf(file, "%s %0.0f %0.4f\n", b.name, b.throughput, b.noise);
+
+    return std::fclose(file) == 0;
+}
+
+static Budget* FindBudget(std::vector<Budget>& budgets, const char* name)
+{
+    for (Budget& b : budgets)
+        if (std::strcmp(b.name, name) == 0) return &b;
+
+    return NULL;
+}
+
+static bool Selected(const GoldenScene& g, const char* filter)
+{
+    return !filter || std::strstr(g.name, filter) != NULL;
+}
+
+int RecordGolden(const char* dir, const char* filter)
+{
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) { std::printf("ERROR: could not create %s\n", dir); return 1; }
+
+    // other scenes keep the budgets they were recorded with
+    std::vector<Budget> budgets = ReadBudgets(dir);
+
+    char path[1024];
+    int failed = 0;
+
+    for (const GoldenScene& g : library)
+    {
+        if (!Selected(g, filter)) continue;
+
+        std::snprintf(path, sizeof(path), "%s/%s.sptr", dir, g.name);
+
+        GoldenRun run;
+
+        if (!Run(g, path, NULL, run))
+        {
+            std::printf("ERROR: could not write %s\n", path);
+            failed++;
+            continue;
+        }
+
+        double noise;
+        double throughput = Throughput(g, noise);
+
+        std::printf("%-18s %5ld frames %12.0f substeps/s (noise %0.1f%%)\n", g.name, run.ticks, throughput, 100.0*noise);
+
+        Budget* budget = FindBudget(budgets, g.name);
+
+        if (!budget)
+        {
+            budgets.push_back(Budget());
+            budget = &budgets.back();
+            std::snprintf(budget->name, sizeof(budget->name), "%s", g.name);
+        }
+
+        budget->throughput = throughput;
+        budget->noise = noise;
+    }
+
+    if (!WriteBudgets(dir, budgets))
+    {
+        std::printf("ERROR: could not write %s/%s\n", dir, budgetsName);
+        failed++;
+    }
+
+    return failed;
+}
+
+int CheckGolden(const char* dir, const char* filter, double slack)
+{
+    std::vector<Budget> budgets = ReadBudgets(dir);
+
+    char path[1024];
+
+    int failed = 0;
+
+    for (const GoldenScene& g : library)
+    {
+        if (!Selected(g, filter)) continue;
+
+        std::snprintf(path, sizeof(path), "%s/%s.sptr", dir, g.name);
+
+        Trace golden;
+
+        if (!golden.Open(path))
+        {
+            std::printf("%-18s FAIL no golden trace %s\n", g.name, path);
+            failed++;
+            continue;
+        }
+
+        GoldenRun run;
+        Run(g, NULL, &golden, run);
+
+        double noise;
+        double throughput = Throughput(g, noise);
+
+        // the noise of the recording widens the slack, a recording so noisy
+        // that nothing is left of the budget can not catch a slowdown
+        Budget* recorded = FindBudget(budgets, g.name);
+        double margin = recorded ? 1.0 - slack - recorded->noise : 1.0;
+        double budget = recorded && margin > 0.0 ? recorded->throughput*margin : 0.0;
+
+        bool accurate = run.complete && run.worst <= g.tolerance;
+        bool collapsed = recorded && margin <= 0.0;
+        bool fast = budget == 0.0 || throughput >= budget;
+
+        std::printf("%-18s max |dx| %9.3g (tolerance %g)", g.name, run.worst, g.tolerance);
+
+        if (budget > 0.0) std::printf(" %12.0f substeps/s (budget %0.0f)", throughput, budget);
+        else std::printf(" %12.0f substeps/s (no budget)", throughput);
+
+        if (!run.complete) std::printf(" FAIL golden trace does not match the scene\n");
+        else if (!accurate) std::printf(" FAIL diverged at t = %0.3f s\n", run.diverged);
+        else if (collapsed) std::printf(" FAIL recorded noise %0.1f%% leaves no budget, record again\n", 100.0*recorded->noise);
+        else if (!fast) std::printf(" FAIL too slow\n");
+        else std::printf(" ok\n");
+
+        if (!accurate || collapsed || !fast) failed++;
+
+        if (g.checks & GOLDEN_RESTORE)
+        {
+            double worst = Restore(g);
+
+            std::printf("%-18s restored at t = %0.3f s, max |dx| %9.3g", g.name, Ticks(g)/2*tick, worst);
+
+            if (worst < 0.0) std::printf(" FAIL checkpoint did not restore\n");
+            else if (worst > 0.0) std::printf(" FAIL not bit exact\n");
+            else std::printf(" ok\n");
+
+            if (worst != 0.0) failed++;
+        }
+
+        if (g.checks & GOLDEN_ENSEMBLE)
+        {
+            double ensemble, batched;
+            bool compatible = Ensembles(g, ensemble, batched);
+
+            std::printf("%-18s ensemble max |dx| %9.3g, batched %9.3g", g.name, ensemble, batched);
+
+            if (ensemble != 0.0) std::printf(" FAIL ensemble is not bit exact\n");
+            else if (!compatible) std::printf(" FAIL scene cannot be batched\n");
+            else if (!(batched <= g.tolerance)) std::printf(" FAIL batched is off\n");
+            else std::printf(" ok\n");
+
+            if (ensemble != 0.0 || !compatible || !(batched <= g.tolerance)) failed++;
+        }
+
+        if (g.checks & GOLDEN_RASTER)
+        {
+            long culled;
+            long differ = Raster(g, culled);
+
+            std::printf("%-18s raster %ld elements culled, %ld pixels differ", g.name, culled, differ);
+
+            if (differ != 0) std::printf(" FAIL culling changed the image\n");
+            else if (culled == 0) std::printf(" FAIL nothing was culled\n");
+            else std::printf(" ok\n");
+
+            if (differ != 0 || culled == 0) failed++;
+        }
+    }
+
+    return failed;
+}
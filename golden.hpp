@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+
+#include "generators.hpp"
+#include "system.hpp"
+
+// Regression harness for the physics. A library of reference scenes, built
+// by the generators so no data files are needed, is run headless for a
+// fixed time and substep count. RecordGolden writes a golden trace of every
+// scene (a frame per tick, see trace.hpp) and its substeps per second, the
+// median of several timed runs with their noise, into a directory.
+// CheckGolden runs the scenes again and fails when a position leaves the
+// tolerance of its scene at any tick, or when a scene runs slower than its
+// budget allows.
+//
+// Scenes can ask for extra checks that need no recorded data, see
+// GoldenCheck. CheckGolden runs them after the trace comparison.
+
+enum GoldenCheck
+{
+    // stepped again with a checkpoint taken halfway and restored into a
+    // System built from the checkpoint alone, has to match bit for bit
+    GOLDEN_RESTORE = 1,
+
+    // copies with scaled masses stepped on their own, as an Ensemble (has
+    // to match bit for bit) and as a BatchedEnsemble (has to stay within
+    // the tolerance), only for double 2D scenes
+    GOLDEN_ENSEMBLE = 2,
+
+    // drawn panned partly off the view with and without culling by the
+    // software renderer, the images have to be identical
+    GOLDEN_RASTER = 4,
+};
+
+struct GoldenScene
+{
+    const char* name;
+    Generator generator;
+    int size;
+    int dimensions;
+    bool single; // float state
+    Solver solver;
+    bool project;
+    double seconds;
+    int substeps;     // per tick
+    double tolerance; // largest position difference from the golden trace
+    unsigned checks;  // GoldenCheck flags
+};
+
+// only the scenes whose name contains filter, all of them for NULL
+int RecordGolden(const char* dir, const char* filter);
+
+// slack is the fraction of the recorded throughput a scene may lose on top
+// of the recorded noise, returns the number of failed scenes
+int CheckGolden(const char* dir, const char* filter, double slack);
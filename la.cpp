@@ -1,15 +1,66 @@
 #include "la.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstdlib>
 #include <cassert>
 #include <iostream>
 
-Vec::Vec(int len)
+#include "blas.hpp"
+#include "profile.hpp"
+
+static std::atomic<bool> singularWarned(false);
+
+#ifdef SIMPLEPHYSICS_BLAS
+static Backend backend = BACKEND_BLAS;
+#else
+static Backend backend = BACKEND_BUILTIN;
+#endif
+
+bool BackendAvailable(Backend b)
+{
+#ifdef SIMPLEPHYSICS_BLAS
+    return b == BACKEND_BUILTIN || b == BACKEND_BLAS;
+#else
+    return b == BACKEND_BUILTIN;
+#endif
+}
+
+bool SetBackend(Backend b)
+{
+    if (!BackendAvailable(b)) return false;
+
+    backend = b;
+    return true;
+}
+
+Backend GetBackend()
+{
+    return backend;
+}
+
+const char* BackendName(Backend b)
+{
+    return b == BACKEND_BLAS ? "blas" : "builtin";
+}
+
+#ifdef SIMPLEPHYSICS_BLAS
+static bool UseBlas(int n)
+{
+    return backend == BACKEND_BLAS && n >= blasMinSize;
+}
+#endif
+
+template<typename T>
+VecT<T>::VecT(int len)
     : buf(len)
 {
+    PROFILE_COUNT(COUNTER_ALLOCATIONS, 1);
 }
 
-void Vec::Debug(const char* name)
+template<typename T>
+void VecT<T>::Debug(const char* name)
 {
     std::printf("%s (%ld)\n", name, Size());
 
@@ -19,17 +70,20 @@ void Vec::Debug(const char* name)
     std::printf("\n\n");
 }
 
-double Vec::At(int i) const
+template<typename T>
+T VecT<T>::At(int i) const
 {
     return buf[i];
 }
 
-double& Vec::At(int i)
+template<typename T>
+T& VecT<T>::At(int i)
 {
     return buf[i];
 }
 
-Vec& Vec::operator+=(const Vec& rhs)
+template<typename T>
+VecT<T>& VecT<T>::operator+=(const VecT& rhs)
 {
     assert(Size() == rhs.Size());
 
@@ -40,7 +94,8 @@ Vec& Vec::operator+=(const Vec& rhs)
     return *this;
 }
 
-Vec operator+(Vec lhs, const Vec& rhs)
+template<typename T>
+VecT<T> operator+(VecT<T> lhs, const VecT<T>& rhs)
 {
     assert(lhs.Size() == rhs.Size());
 
@@ -51,16 +106,18 @@ Vec operator+(Vec lhs, const Vec& rhs)
     return lhs;
 }
 
-Vec& Vec::operator*=(const double c)
+template<typename T>
+VecT<T>& VecT<T>::operator*=(const T c)
 {
     #pragma omp simd
     for (int i = 0; i < Size(); i++)
-        buf[i] += c;
+        buf[i] *= c;
 
     return *this;
 }
 
-Vec operator*(Vec lhs, const double c)
+template<typename T>
+VecT<T> operator*(VecT<T> lhs, const T c)
 {
     #pragma omp simd
     for (int i = 0; i < lhs.Size(); i++)
@@ -69,7 +126,8 @@ Vec operator*(Vec lhs, const double c)
     return lhs;
 }
 
-Vec operator*(const double c, Vec rhs)
+template<typename T>
+VecT<T> operator*(const T c, VecT<T> rhs)
 {
     #pragma omp simd
     for (int i = 0; i < rhs.Size(); i++)
@@ -78,7 +136,8 @@ Vec operator*(const double c, Vec rhs)
     return rhs;
 }
 
-Vec& Vec::operator*=(const Vec& rhs)
+template<typename T>
+VecT<T>& VecT<T>::operator*=(const VecT& rhs)
 {
     assert(Size() == rhs.Size());
 
@@ -90,7 +149,8 @@ Vec& Vec::operator*=(const Vec& rhs)
 
 }
 
-Vec operator*(Vec lhs, const Vec& rhs)
+template<typename T>
+VecT<T> operator*(VecT<T> lhs, const VecT<T>& rhs)
 {
     assert(lhs.Size() == rhs.Size());
 
@@ -102,19 +162,29 @@ Vec operator*(Vec lhs, const Vec& rhs)
 
 }
 
-void Vec::Zero()
+template<typename T>
+void VecT<T>::Zero()
 {
     #pragma omp simd
     for (int i = 0; i < Size(); i++)
         At(i) = 0.0;
 }
 
-Mat::Mat(int r_, int c_)
+template<typename T>
+void VecT<T>::Resize(int len)
+{
+    buf.resize(len);
+}
+
+template<typename T>
+MatT<T>::MatT(int r_, int c_)
     : r(r_), c(c_), buf(r_*c_)
 {
+    PROFILE_COUNT(COUNTER_ALLOCATIONS, 1);
 }
 
-void Mat::Debug(const char* name)
+template<typename T>
+void MatT<T>::Debug(const char* name)
 {
     std::printf("%s (%ld x %ld)\n", name, Rows(), Cols());
 
@@ -129,25 +199,36 @@ void Mat::Debug(const char* name)
 }
 
 
-double Mat::At(int row, int col) const
+template<typename T>
+T MatT<T>::At(int row, int col) const
 {
     return buf[col + c * row];
 }
 
-double& Mat::At(int row, int col)
+template<typename T>
+T& MatT<T>::At(int row, int col)
 {
     return buf[col + c * row];
 }
 
-Vec operator*(Mat mat, const Vec& vec)
+template<typename T>
+VecT<T> operator*(const MatT<T>& mat, const VecT<T>& vec)
 {
     assert(mat.c == vec.Size());
 
-    Vec res(mat.r);
+    VecT<T> res(mat.r);
+
+#ifdef SIMPLEPHYSICS_BLAS
+    if (UseBlas(mat.r))
+    {
+        Blas::Gemv(mat.r, mat.c, mat.buf.data(), vec.buf.data(), res.buf.data());
+        return res;
+    }
+#endif
 
     for (int i = 0; i < mat.r; i++) // y
     {
-        double sum = 0.0;
+        T sum = T(0);
         for (int j = 0; j < mat.c; j++) // x
         {
             sum += mat.At(i, j) * vec.At(j);
@@ -160,11 +241,20 @@ Vec operator*(Mat mat, const Vec& vec)
 }
 
 // TODO: parallel and rhs by ref
-Mat operator*(const Mat& lhs, Mat rhs)
+template<typename T>
+MatT<T> operator*(const MatT<T>& lhs, MatT<T> rhs)
 {
     assert(lhs.c == rhs.r);
 
-    Mat mat(lhs.r, rhs.c);
+    MatT<T> mat(lhs.r, rhs.c);
+
+#ifdef SIMPLEPHYSICS_BLAS
+    if (UseBlas(lhs.r))
+    {
+        Blas::Gemm(lhs.r, rhs.c, lhs.c, lhs.buf.data(), rhs.buf.data(), mat.buf.data());
+        return mat;
+    }
+#endif
 
     rhs.Transpose();
 
@@ -174,7 +264,7 @@ Mat operator*(const Mat& lhs, Mat rhs)
     {
         for (int j = 0; j < mat.c; j++) // x
         {
-            double sum = 0.0;
+            T sum = T(0);
 
             for (int k = 0; k < inner; k++)
                 sum += lhs.At(i, k) * rhs.At(j, k); // rhs is transposed
@@ -186,9 +276,10 @@ Mat operator*(const Mat& lhs, Mat rhs)
     return mat;
 }
 
-void Mat::Transpose()
+template<typename T>
+void MatT<T>::Transpose()
 {
-    Mat mat(c, r);
+    MatT mat(c, r);
 
     for (int i = 0; i < r; i++) // y
         for (int j = 0; j < c; j++) // x
@@ -199,103 +290,432 @@ void Mat::Transpose()
     c = mat.c;
 }
 
-void Mat::Zero()
+template<typename T>
+void MatT<T>::Zero()
 {
     for (int i = 0; i < Rows()*Cols(); i++)
         buf[i] = 0.0;
 }
 
-static void SwapRows(std::vector<double>& A, int n, int i, int j)
+template<typename T>
+static void SwapRows(std::vector<T>& A, int n, int i, int j)
 {
     for (int k = 0; k < n; k++)
     {
-        double tmp = A[k + n * i];
+        T tmp = A[k + n * i];
         A[k + n * i] = A[k + n * j];
         A[k + n * j] = tmp;
     }
 }
 
-// TODO: optimize, use the bufs directly instread of copyies
-Vec Mat::Solve(Mat mat, Vec bvec)
+template<typename T>
+bool MatT<T>::Factor(std::vector<int>& pivots)
 {
-    assert(mat.Rows() == mat.Cols());
-    assert(mat.Rows() == bvec.Size());
+    assert(Rows() == Cols());
 
-    std::vector<double>& A = mat.buf;
-    std::vector<double>& b = bvec.buf;
+    std::vector<T>& A = buf;
 
-    int n = mat.Rows();
+    int n = Rows();
 
-    std::vector<std::pair<int, int>> swaps;
+    pivots.resize(n);
+
+#ifdef SIMPLEPHYSICS_BLAS
+    // LAPACK sees the transpose of the row major matrix, which has the same
+    // determinant, SolveFactored solves with its transpose again
+    if (UseBlas(n))
+    {
+        if (Blas::Getrf(n, A.data(), pivots.data()) != 0)
+        {
+            if (!singularWarned.exchange(true)) std::printf("WARNING: Matrix is singular\n");
+            PROFILE_COUNT(COUNTER_SINGULAR, 1);
+
+            return false;
+        }
+
+        PROFILE_COUNT(COUNTER_ITERATIONS, n);
+
+        return true;
+    }
+#endif
 
     for (int row = 0; row < n; row++)
     {
-#if 1
+        // pick the largest magnitude, the pivot keeps the precision of T
         int bestRow = row;
-        float value = A[row + n * bestRow];
+        T value = std::abs(A[row + n * bestRow]);
         for (int r = row + 1; r < n; r++)
         {
             if (std::abs(A[row + n * r]) > value)
             {
                 bestRow = r;
-                value = A[row + n * r];
+                value = std::abs(A[row + n * r]);
             }
         }
 
-        // if (A[row + n * bestRow] == 0) assert(false && "Matrix is singular");
-        // Just solve as 0 if non singular
+        // System regularizes its matrices so this is a last resort, warn
+        // once instead of on every substep
         if (A[row + n * bestRow] == 0)
         {
-            Vec xvec(n);
-            // TODO: I think it is already zeroed
-            xvec.Zero();
-            std::printf("WARNING: Matrix is singular\n");
+            if (!singularWarned.exchange(true)) std::printf("WARNING: Matrix is singular\n");
+            PROFILE_COUNT(COUNTER_SINGULAR, 1);
 
-            return xvec;
+            return false;
         }
 
-        if (bestRow != row)
-        {
-            SwapRows(A, n, row, bestRow);
-            SwapRows(b, 1, row, bestRow);
-            swaps.push_back(std::make_pair(row, bestRow));
-        }
-#endif
+        pivots[row] = bestRow;
+        if (bestRow != row) SwapRows(A, n, row, bestRow);
 
+        // the multipliers are kept below the diagonal
         for (int r = row + 1; r < n; r++)
         {
-            float factor = A[row + n * r] / A[row + n * row];
+            T factor = A[row + n * r] / A[row + n * row];
 
-            for (int c = 0; c < n; c++)
+            for (int c = row + 1; c < n; c++)
             {
                 A[c + n * r] -= A[c + n * row] * factor;
             }
 
-            b[r] -= b[row] * factor;
+            A[row + n * r] = factor;
         }
     }
 
-    std::vector<double> x(n);
+    PROFILE_COUNT(COUNTER_ITERATIONS, n);
+
+    return true;
+}
+
+template<typename T>
+VecT<T> MatT<T>::SolveFactored(const std::vector<int>& pivots, VecT<T> bvec) const
+{
+    assert(Rows() == bvec.Size());
+
+    const std::vector<T>& A = buf;
+    std::vector<T>& b = bvec.buf;
+
+    int n = Rows();
+
+#ifdef SIMPLEPHYSICS_BLAS
+    if (UseBlas(n))
+    {
+        Blas::GetrsTransposed(n, A.data(), pivots.data(), b.data());
+        return bvec;
+    }
+#endif
+
+    // same order of operations as eliminating b together with the matrix
+    for (int row = 0; row < n; row++)
+    {
+        if (pivots[row] != row) SwapRows(b, 1, row, pivots[row]);
 
+        for (int r = row + 1; r < n; r++)
+            b[r] -= b[row] * A[row + n * r];
+    }
+
+    // swapping equations does not reorder the unknowns, x needs no unswap
     for (int r = n - 1; r >= 0; r--)
     {
-        float v = b[r];
+        T v = b[r];
         for (int i = r + 1; i < n; i++)
         {
-            v -= A[i + n * r] * x[i];
+            v -= A[i + n * r] * b[i];
         }
 
-        x[r] = v / A[r * n + r];
+        b[r] = v / A[r * n + r];
+    }
+
+    return bvec;
+}
+
+template<typename T>
+bool MatT<T>::FactorCholesky()
+{
+    assert(Rows() == Cols());
+
+    std::vector<T>& A = buf;
+
+    int n = Rows();
+
+#ifdef SIMPLEPHYSICS_BLAS
+    // symmetric, so the transpose LAPACK sees is the same matrix
+    if (UseBlas(n))
+    {
+        if (Blas::Potrf(n, A.data()) != 0) return false;
+
+        PROFILE_COUNT(COUNTER_ITERATIONS, n);
+
+        return true;
     }
+#endif
 
-    for (int i = swaps.size() - 1; i >= 0; i--)
+    for (int j = 0; j < n; j++)
     {
-        SwapRows(x, 1, swaps[i].first, swaps[i].second);
+        T diag = A[j + n * j];
+        for (int k = 0; k < j; k++)
+            diag -= A[k + n * j] * A[k + n * j];
+
+        if (!(diag > 0)) return false;
+
+        T ljj = std::sqrt(diag);
+        A[j + n * j] = ljj;
+
+        for (int r = j + 1; r < n; r++)
+        {
+            T v = A[j + n * r];
+            for (int k = 0; k < j; k++)
+                v -= A[k + n * r] * A[k + n * j];
+
+            A[j + n * r] = v / ljj;
+        }
     }
 
-    Vec xvec(n);
+    PROFILE_COUNT(COUNTER_ITERATIONS, n);
+
+    return true;
+}
+
+template<typename T>
+VecT<T> MatT<T>::SolveCholesky(VecT<T> bvec) const
+{
+    assert(Rows() == bvec.Size());
+
+    const std::vector<T>& A = buf;
+    std::vector<T>& b = bvec.buf;
+
+    int n = Rows();
+
+#ifdef SIMPLEPHYSICS_BLAS
+    if (UseBlas(n))
+    {
+        Blas::Potrs(n, A.data(), b.data());
+        return bvec;
+    }
+#endif
+
+    // L*y = b, then Lt*x = y
+    for (int r = 0; r < n; r++)
+    {
+        T v = b[r];
+        for (int k = 0; k < r; k++)
+            v -= A[k + n * r] * b[k];
+
+        b[r] = v / A[r + n * r];
+    }
+
+    for (int r = n - 1; r >= 0; r--)
+    {
+        T v = b[r];
+        for (int k = r + 1; k < n; k++)
+            v -= A[r + n * k] * b[k];
+
+        b[r] = v / A[r + n * r];
+    }
+
+    return bvec;
+}
+
+template<typename T>
+int MatT<T>::SolveIterative(const VecT<T>& bvec, VecT<T>& xvec, T tolerance, int maxIterations) const
+{
+    assert(Rows() == Cols() && Rows() == bvec.Size() && Rows() == xvec.Size());
+
+    const std::vector<T>& b = bvec.buf;
+    std::vector<T>& x = xvec.buf;
+
+    int n = Rows();
+
+    std::vector<T> r(n), z(n), p(n), Ap(n);
+
+    // y = A*v, on the backend like Mat*Vec but without allocating
+    auto product = [&](const std::vector<T>& v, std::vector<T>& y)
+    {
+#ifdef SIMPLEPHYSICS_BLAS
+        if (UseBlas(n))
+        {
+            Blas::Gemv(n, n, buf.data(), v.data(), y.data());
+            return;
+        }
+#endif
+        for (int i = 0; i < n; i++)
+        {
+            T sum = T(0);
+            for (int j = 0; j < n; j++)
+                sum += buf[j + n * i] * v[j];
+
+            y[i] = sum;
+        }
+    };
+
+    T bb = T(0);
+    for (int i = 0; i < n; i++)
+        bb += b[i] * b[i];
+
+    if (bb == T(0))
+    {
+        std::fill(x.begin(), x.end(), T(0));
+        return 0;
+    }
+
+    T limit = tolerance * tolerance * bb;
+
+    product(x, Ap);
+
+    T rz = T(0), rr = T(0);
     for (int i = 0; i < n; i++)
-        xvec.At(i) = x[i];
+    {
+        r[i] = b[i] - Ap[i];
+        z[i] = buf[i + n * i] > T(0) ? r[i] / buf[i + n * i] : r[i];
+        p[i] = z[i];
+        rz += r[i] * z[i];
+        rr += r[i] * r[i];
+    }
+
+    int it = 0;
+
+    for (; it < maxIterations && rr > limit; it++)
+    {
+        product(p, Ap);
+
+        T pAp = T(0);
+        for (int i = 0; i < n; i++)
+            pAp += p[i] * Ap[i];
 
-    return xvec;
+        if (!(pAp > T(0))) break;
+
+        T alpha = rz / pAp;
+
+        T next = T(0);
+        rr = T(0);
+
+        for (int i = 0; i < n; i++)
+        {
+            x[i] += alpha * p[i];
+            r[i] -= alpha * Ap[i];
+            z[i] = buf[i + n * i] > T(0) ? r[i] / buf[i + n * i] : r[i];
+            next += r[i] * z[i];
+            rr += r[i] * r[i];
+        }
+
+        T beta = next / rz;
+        rz = next;
+
+        for (int i = 0; i < n; i++)
+            p[i] = z[i] + beta * p[i];
+    }
+
+    PROFILE_COUNT(COUNTER_ITERATIONS, it);
+
+    return rr > limit ? maxIterations : it;
 }
+
+// Just solve as 0 if singular
+template<typename T>
+VecT<T> MatT<T>::Solve(MatT mat, VecT<T> bvec)
+{
+    std::vector<int> pivots;
+
+    if (!mat.Factor(pivots))
+    {
+        VecT<T> xvec(mat.Rows());
+        xvec.Zero();
+        return xvec;
+    }
+
+    return mat.SolveFactored(pivots, bvec);
+}
+
+template<typename T>
+SparseMatT<T>::SparseMatT(int r_, int c_)
+    : r(r_), c(c_), rows(r_)
+{
+}
+
+template<typename T>
+void SparseMatT<T>::Debug(const char* name)
+{
+    std::printf("%s (%ld x %ld)\n", name, Rows(), Cols());
+
+    for (int i = 0; i < Rows(); i++)
+    {
+        for (const std::pair<int, T>& e : rows[i])
+            std::printf("(%d) %0.2f ", e.first, e.second);
+        std::printf("\n");
+    }
+
+    std::printf("\n");
+}
+
+template<typename T>
+T SparseMatT<T>::At(int row, int col) const
+{
+    for (const std::pair<int, T>& e : rows[row])
+        if (e.first == col) return e.second;
+
+    return 0.0;
+}
+
+template<typename T>
+T& SparseMatT<T>::At(int row, int col)
+{
+    assert(col < c);
+
+    for (std::pair<int, T>& e : rows[row])
+        if (e.first == col) return e.second;
+
+    rows[row].push_back(std::make_pair(col, T(0)));
+    return rows[row].back().second;
+}
+
+template<typename T>
+void SparseMatT<T>::Zero()
+{
+    for (std::vector<std::pair<int, T>>& row : rows)
+        for (std::pair<int, T>& e : row)
+            e.second = 0.0;
+}
+
+template<typename T>
+int SparseMatT<T>::AddRow()
+{
+    rows.emplace_back();
+    return r++;
+}
+
+template<typename T>
+void SparseMatT<T>::SwapRemoveRow(int row)
+{
+    std::swap(rows[row], rows.back());
+    rows.pop_back();
+    r--;
+}
+
+template<typename T>
+void SparseMatT<T>::ClearRow(int row)
+{
+    rows[row].clear();
+}
+
+template<typename T>
+void SparseMatT<T>::SetCols(int c_)
+{
+    c = c_;
+}
+
+template struct VecT<float>;
+template struct VecT<double>;
+template struct MatT<float>;
+template struct MatT<double>;
+template struct SparseMatT<float>;
+template struct SparseMatT<double>;
+
+template VecT<float> operator+(VecT<float>, const VecT<float>&);
+template VecT<double> operator+(VecT<double>, const VecT<double>&);
+template VecT<float> operator*(VecT<float>, const float);
+template VecT<double> operator*(VecT<double>, const double);
+template VecT<float> operator*(const float, VecT<float>);
+template VecT<double> operator*(const double, VecT<double>);
+template VecT<float> operator*(VecT<float>, const VecT<float>&);
+template VecT<double> operator*(VecT<double>, const VecT<double>&);
+template VecT<float> operator*(const MatT<float>&, const VecT<float>&);
+template VecT<double> operator*(const MatT<double>&, const VecT<double>&);
+template MatT<float> operator*(const MatT<float>&, MatT<float>);
+template MatT<double> operator*(const MatT<double>&, MatT<double>);
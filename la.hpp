@@ -1,48 +1,72 @@
 #pragma once
 
+#include <utility>
 #include <vector>
 
-struct Vec
+// The linear algebra types are templated on the scalar, Vec, Mat and
+// SparseMat are the double versions. Implementations live in la.cpp and are
+// instantiated for float and double.
+
+// Where the dense kernels (Mat*Vec, Mat*Mat, Factor, FactorCholesky and their
+// solves) run. BACKEND_BLAS is only available in builds with
+// -DSIMPLEPHYSICS_BLAS (make BLAS=1) and is their default, it calls the
+// linked BLAS/LAPACK for matrices of at least blasMinSize rows and the
+// builtin loops below that, where the call overhead dominates.
+enum Backend
 {
-    std::vector<double> buf;
+    BACKEND_BUILTIN = 0,
+    BACKEND_BLAS,
+};
 
-    explicit Vec(int len);
+constexpr int blasMinSize = 16;
 
-    void Debug(const char* name);
+// Process wide. Factorizations are backend specific, switch only while no
+// factored matrix is kept around (between runs). Returns false and keeps
+// the current backend if the requested one is not compiled in.
+bool SetBackend(Backend backend);
+Backend GetBackend();
+bool BackendAvailable(Backend backend);
+const char* BackendName(Backend backend);
 
-    double At(int i) const;
-    double& At(int i);
+template<typename T>
+struct VecT
+{
+    std::vector<T> buf;
 
-    Vec& operator+=(const Vec& rhs);
-    friend Vec operator+(Vec lhs, const Vec& rhs);
+    explicit VecT(int len);
 
-    Vec& operator*=(const double c);
-    friend Vec operator*(Vec lhs, const double c);
-    friend Vec operator*(const double c, Vec rhs);
+    void Debug(const char* name);
+
+    T At(int i) const;
+    T& At(int i);
 
-    Vec& operator*=(const Vec& rhs);
-    friend Vec operator*(Vec lhs, const Vec& rhs);
+    VecT& operator+=(const VecT& rhs);
+    VecT& operator*=(const T c);
+    VecT& operator*=(const VecT& rhs);
 
     void Zero();
+    void Resize(int len);
 
     inline std::size_t Size() const { return buf.size(); }
 };
 
-struct Mat
+template<typename T> VecT<T> operator+(VecT<T> lhs, const VecT<T>& rhs);
+template<typename T> VecT<T> operator*(VecT<T> lhs, const T c);
+template<typename T> VecT<T> operator*(const T c, VecT<T> rhs);
+template<typename T> VecT<T> operator*(VecT<T> lhs, const VecT<T>& rhs);
+
+template<typename T>
+struct MatT
 {
     int r, c;
-    std::vector<double> buf;
+    std::vector<T> buf;
 
-    explicit Mat(int r_, int c_);
+    explicit MatT(int r_, int c_);
 
     void Debug(const char* name);
 
-    double At(int row, int col) const;
-    double& At(int row, int col);
-
-    friend Vec operator*(Mat mat, const Vec& vec);
-
-    friend Mat operator*(const Mat& lhs, Mat rhs);
+    T At(int row, int col) const;
+    T& At(int row, int col);
 
     void Transpose();
     void Zero();
@@ -50,5 +74,59 @@ struct Mat
     inline std::size_t Rows() const { return r; }
     inline std::size_t Cols() const { return c; }
 
-    static Vec Solve(Mat mat, Vec bvec);
+    // LU with partial pivoting in place, all arithmetic in T. pivots[i] is
+    // the row swapped with row i at step i for the builtin backend and the
+    // LAPACK ipiv otherwise. Returns false if singular.
+    bool Factor(std::vector<int>& pivots);
+    VecT<T> SolveFactored(const std::vector<int>& pivots, VecT<T> bvec) const;
+
+    // Cholesky in place for symmetric positive definite matrices, the factor
+    // L is written to the lower triangle. Returns false, without a warning,
+    // if the matrix is not positive definite.
+    bool FactorCholesky();
+    VecT<T> SolveCholesky(VecT<T> bvec) const;
+
+    // Jacobi preconditioned conjugate gradient for symmetric positive
+    // definite matrices, improves the guess in x until |b - A*x| is at most
+    // tolerance*|b|. Returns the iterations taken, maxIterations if it did
+    // not get there.
+    int SolveIterative(const VecT<T>& bvec, VecT<T>& xvec, T tolerance, int maxIterations) const;
+
+    // Factor and SolveFactored on a copy, zeros if singular
+    static VecT<T> Solve(MatT mat, VecT<T> bvec);
 };
+
+template<typename T> VecT<T> operator*(const MatT<T>& mat, const VecT<T>& vec);
+template<typename T> MatT<T> operator*(const MatT<T>& lhs, MatT<T> rhs);
+
+// Row major sparse matrix for Jacobians, every row stores only the columns
+// that have been written. The pattern of a row is created on first write
+// and kept until ClearRow, so rows can be added, removed and swapped
+// without touching the rest of the matrix.
+template<typename T>
+struct SparseMatT
+{
+    int r, c;
+    std::vector<std::vector<std::pair<int, T>>> rows;
+
+    explicit SparseMatT(int r_, int c_);
+
+    void Debug(const char* name);
+
+    T At(int row, int col) const;
+    T& At(int row, int col);
+
+    void Zero();
+
+    int AddRow();
+    void SwapRemoveRow(int row);
+    void ClearRow(int row);
+    void SetCols(int c_);
+
+    inline std::size_t Rows() const { return r; }
+    inline std::size_t Cols() const { return c; }
+};
+
+typedef VecT<double> Vec;
+typedef MatT<double> Mat;
+typedef SparseMatT<double> SparseMat;
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include <vector>
@@ -8,10 +9,19 @@
 #include <glm/glm.hpp>
 #include <raylib.h>
 
+#include "cli.hpp"
 #include "constraints.hpp"
+#include "elements.hpp"
 #include "forces.hpp"
+#include "generators.hpp"
 #include "la.hpp"
+#include "render.hpp"
+#include "scene.hpp"
+#include "simthread.hpp"
+#include "spatial.hpp"
 #include "system.hpp"
+#include "tune.hpp"
+#include "viewer.hpp"
 
 typedef std::chrono::high_resolution_clock Clock;
 
@@ -49,10 +59,18 @@ enum Tool
     SPRING1000 = 1000,
     ROD = 2000,
     HOLD = 3000,
+    GENERATOR = 4000, // GENERATOR + Generator places that structure
 };
 
-int main()
+// sizes of the structures the generator tools place, see generators.hpp
+static const int generatorSizes[GENERATE_COUNT] = { 40, 5, 30, 40, 1500 };
+
+int main(int argc, char** argv)
 {
+    if (argc > 2 && std::strcmp(argv[1], "replay") == 0) return RunReplay(argv[2]);
+    if (argc > 2 && std::strcmp(argv[1], "watch") == 0) return RunWatch(argv[2]);
+    if (argc > 1) return RunCommand(argc, argv);
+
     SetTraceLogLevel(LOG_NONE);
     InitWindow(width, height, "Simple Physics");
     // SetWindowMonitor(0);
@@ -65,19 +83,26 @@ int main()
 
     std::vector<Particle> particles;
 
-    std::vector<Force*> forces = {
-        new Gravity(200.0f),
-    };
+    // owns every force and constraint, systems built from it only borrow them
+    Elements elements;
+    elements.Add<Gravity>(200.0f);
 
-    std::vector<Constraint*> constraints;
+    // picking in BUILD, kept in sync with particles
+    SpatialGrid grid(20.0);
+    int generated = 0;
 
     System* system = NULL;
+    SimThread* sim = NULL;
 
     State state = BUILD;
     Tool tool = MASS1;
     int a = -1;
     int b = -1;
 
+    // mouse drag during SIM, right button pulls a particle towards the cursor
+    PositionConstraint drag(0, 0.0, 0.0);
+    bool dragging = false;
+
     while (!WindowShouldClose())
     {
         std::chrono::high_resolution_clock::time_point current = std::chrono::high_resolution_clock::now();
@@ -88,14 +113,24 @@ int main()
         lastTime = current;
         timeAcc += dt;
 
-        constexpr int steps = 1000;
+        if (timeAcc >= 1.0)
+        {
+            std::printf("fps: %0.2f\n", fps);
 
-        if (timeAcc >= 1.0) { std::printf("fps: %0.2f\n", fps); timeAcc = 0.0; }
+            if (sim)
+            {
+                const Snapshot& s = sim->Acquire();
+                std::printf("substeps: %d (%0.2f us each), dropped: %0.2f s\n", s.substeps, s.cost*1e6, s.dropped);
+            }
+
+            timeAcc = 0.0;
+        }
 
         switch (state)
         {
             case State::BUILD:
                 {
+                    if (sim) { delete sim; sim = NULL; }
                     if (system) { delete system; system = NULL; }
 
                     double x = GetMouseX();
@@ -109,6 +144,7 @@ int main()
                             case MASS5:
                             case MASS10:
                                 particles.push_back({ .x = x, .y = y, .m = (double) tool });
+                                grid.Insert(particles.size() - 1, x, y);
                                 break;
                             case SPRING15:
                             case SPRING100:
@@ -116,17 +152,15 @@ int main()
                             case SPRING1000:
                                 if (a == -1)
                                 {
-                                    for (int i = 0; i < particles.size(); i++)
-                                        if (InCircle(x, y, particles[i].x, particles[i].y, 20)) a = i;
+                                    a = grid.Nearest(x, y, 20);
                                 }
                                 else
                                 {
-                                    for (int i = 0; i < particles.size(); i++)
-                                        if (InCircle(x, y, particles[i].x, particles[i].y, 20)) b = i;
+                                    b = grid.Nearest(x, y, 20);
 
                                     if (b != -1)
                                     {
-                                        forces.push_back(new Spring(a, b, Dist(particles[a].x, particles[a].y, particles[b].x, particles[b].y), -1.0 * (double) tool));
+                                        elements.Add<Spring>(a, b, Dist(particles[a].x, particles[a].y, particles[b].x, particles[b].y), -1.0 * (double) tool);
                                         a = b = -1;
                                     }
                                 }
@@ -134,29 +168,37 @@ int main()
                             case ROD:
                                 if (a == -1)
                                 {
-                                    for (int i = 0; i < particles.size(); i++)
-                                        if (InCircle(x, y, particles[i].x, particles[i].y, 20)) a = i;
+                                    a = grid.Nearest(x, y, 20);
                                 }
                                 else
                                 {
-                                    for (int i = 0; i < particles.size(); i++)
-                                        if (InCircle(x, y, particles[i].x, particles[i].y, 20)) b = i;
+                                    b = grid.Nearest(x, y, 20);
 
                                     if (b != -1)
                                     {
-                                        constraints.push_back(new DistanceConstraint(a, b, Dist(particles[a].x, particles[a].y, particles[b].x, particles[b].y)));
+                                        elements.Add<DistanceConstraint>(a, b, Dist(particles[a].x, particles[a].y, particles[b].x, particles[b].y));
                                         a = b = -1;
                                     }
                                 }
                                 break;
                             case HOLD:
                                 {
-                                    int p = -1;
-                                    for (int i = 0; i < particles.size(); i++)
-                                        if (InCircle(x, y, particles[i].x, particles[i].y, 20)) p = i;
+                                    int p = grid.Nearest(x, y, 20);
 
                                     if (p != -1)
-                                        constraints.push_back(new PositionConstraint(p, particles[p].x, particles[p].y));
+                                        elements.Add<PositionConstraint>(p, particles[p].x, particles[p].y);
+                                }
+                                break;
+                            default:
+                                if (tool >= GENERATOR && tool < GENERATOR + GENERATE_COUNT)
+                                {
+                                    Generator g = (Generator) (tool - GENERATOR);
+                                    int first = particles.size();
+
+                                    Generate(g, particles, elements, x, y, generatorSizes[g], ++generated);
+
+                                    for (int i = first; i < particles.size(); i++)
+                                        grid.Insert(i, particles[i].x, particles[i].y);
                                 }
                                 break;
                         }
@@ -172,9 +214,40 @@ int main()
                     if (IsKeyPressed(KEY_EIGHT)) tool = SPRING1000;
                     if (IsKeyPressed(KEY_NINE)) tool = ROD;
                     if (IsKeyPressed(KEY_ZERO)) tool = HOLD;
+                    if (IsKeyPressed(KEY_F1)) tool = (Tool) (GENERATOR + GENERATE_CHAIN);
+                    if (IsKeyPressed(KEY_F2)) tool = (Tool) (GENERATOR + GENERATE_PENDULUM);
+                    if (IsKeyPressed(KEY_F3)) tool = (Tool) (GENERATOR + GENERATE_BRIDGE);
+                    if (IsKeyPressed(KEY_F4)) tool = (Tool) (GENERATOR + GENERATE_CLOTH);
+                    if (IsKeyPressed(KEY_F5)) tool = (Tool) (GENERATOR + GENERATE_NETWORK);
+
+                    if (IsKeyPressed(KEY_N))
+                    {
+                        particles.clear();
+                        elements.Clear();
+                        elements.Add<Gravity>(200.0f);
+                        grid.Clear();
+                        a = b = -1;
+                    }
 
                     if (IsKeyPressed(KEY_C)) a = b = -1;
 
+                    if (IsKeyPressed(KEY_S) && !SaveScene("scene.sps", particles, elements.forces, elements.constraints))
+                        std::printf("WARNING: could not save scene.sps\n");
+
+                    if (IsKeyPressed(KEY_L))
+                    {
+                        std::vector<Particle> loadedParticles;
+                        Elements loaded;
+
+                        if (LoadScene("scene.sps", loadedParticles, loaded))
+                        {
+                            particles.swap(loadedParticles);
+                            elements.Swap(loaded);
+                            grid.Build(particles);
+                            a = b = -1;
+                        }
+                    }
+
                     if (IsKeyPressed(KEY_SPACE)) state = SIM;
 
                     BeginDrawing();
@@ -193,28 +266,33 @@ int main()
                             "7 = SPRING 500\n"
                             "8 = SPRING 1000\n"
                             "9 = ROD\n"
-                            "0 = HOLD\n";
+                            "0 = HOLD\n"
+                            "F1 = CHAIN\n"
+                            "F2 = PENDULUM\n"
+                            "F3 = BRIDGE\n"
+                            "F4 = CLOTH\n"
+                            "F5 = NETWORK\n"
+                            "N = NEW\n"
+                            "S = SAVE scene.sps\n"
+                            "L = LOAD scene.sps\n";
                         DrawText(text, 10, 10, 20, WHITE);
 
                         for (int i = 0; i < particles.size(); i++) DrawCircle(particles[i].x, particles[i].y, 20, RED);
 
-                        for (int i = 0; i < forces.size(); i++)
+                        elements.Of<Spring>().ForEach([&](const Spring& s)
                         {
-                            Spring* s;
-                            if ((s = dynamic_cast<Spring*>(forces[i])))
-                                DrawLine(particles[s->a].x, particles[s->a].y, particles[s->b].x, particles[s->b].y, YELLOW);
-                        }
+                            DrawLine(particles[s.a].x, particles[s.a].y, particles[s.b].x, particles[s.b].y, YELLOW);
+                        });
 
-                        for (int i = 0; i < constraints.size(); i++)
+                        elements.Of<PositionConstraint>().ForEach([&](const PositionConstraint& p)
                         {
-                            PositionConstraint* p;
-                            if ((p = dynamic_cast<PositionConstraint*>(constraints[i])))
-                                DrawCircle(particles[p->a].x, particles[p->a].y, 20, ORANGE);
+                            DrawCircle(particles[p.a].x, particles[p.a].y, 20, ORANGE);
+                        });
 
-                            DistanceConstraint* d;
-                            if ((d = dynamic_cast<DistanceConstraint*>(constraints[i])))
-                                DrawLine(particles[d->a].x, particles[d->a].y, particles[d->b].x, particles[d->b].y, BLUE);
-                        }
+                        elements.Of<DistanceConstraint>().ForEach([&](const DistanceConstraint& d)
+                        {
+                            DrawLine(particles[d.a].x, particles[d.a].y, particles[d.b].x, particles[d.b].y, BLUE);
+                        });
 
                     }
                     EndDrawing();
@@ -222,17 +300,109 @@ int main()
                 break;
             case State::SIM:
                 {
-                    if (!system) system = new System(particles, forces, constraints);
+                    if (!system)
+                    {
+                        system = new System(particles, elements.forces, elements.constraints);
+                        PrintTune(Tune(*system));
+                        // physics may use 80% of a 60 Hz tick, between 100 and 10000 substeps
+                        sim = new SimThread(system, 1.0/60.0, Scheduler(SCHEDULE_BUDGET, 0.8/60.0, 100, 10000));
+                        sim->Start();
+                    }
 
-                    if (IsKeyPressed(KEY_SPACE)) state = BUILD;
+                    if (IsKeyPressed(KEY_SPACE)) { state = BUILD; dragging = false; }
 
-                    system->Step(dt, 10000);
+                    const Snapshot& snapshot = sim->Acquire();
+
+                    // edits during SIM go to the running system and are dropped
+                    // when going back to BUILD, they are applied on the sim
+                    // thread between ticks
+                    double x = GetMouseX();
+                    double y = GetMouseY();
+
+                    // particles move every frame, scan only when a click needs one
+                    int p = -1;
+                    if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT) || IsMouseButtonPressed(MOUSE_BUTTON_RIGHT))
+                    {
+                        for (int i = 0; i < snapshot.N; i++)
+                            if (InCircle(x, y, snapshot.pos[i*snapshot.DF], snapshot.pos[i*snapshot.DF+1], 20)) p = i;
+                    }
+
+                    if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT))
+                    {
+                        switch (tool)
+                        {
+                            case MASS1:
+                            case MASS3:
+                            case MASS5:
+                            case MASS10:
+                                {
+                                    Particle particle = { .x = x, .y = y, .m = (double) tool };
+                                    sim->Post([particle](System& s) { s.AddParticle(particle); });
+                                }
+                                break;
+                            case ROD:
+                                // break every rod attached to the clicked particle
+                                // every rod of the system comes from elements
+                                if (p != -1)
+                                {
+                                    std::vector<Constraint*> rods;
+                                    elements.Of<DistanceConstraint>().ForEach([&](DistanceConstraint& d)
+                                    {
+                                        if (d.a == p || d.b == p) rods.push_back(&d);
+                                    });
+
+                                    sim->Post([rods](System& s)
+                                    {
+                                        for (int i = s.NC - 1; i >= 0; i--)
+                                            if (std::find(rods.begin(), rods.end(), s.constraints[i]) != rods.end())
+                                                s.RemoveConstraint(i);
+                                    });
+                                }
+                                break;
+                            default:
+                                break;
+                        }
+                    }
+
+                    if (IsMouseButtonPressed(MOUSE_BUTTON_RIGHT) && p != -1 && !dragging)
+                    {
+                        PositionConstraint* c = &drag;
+                        sim->Post([c, p, x, y](System& s)
+                        {
+                            c->a = p; c->x = x; c->y = y;
+                            s.AddConstraint(c);
+                        });
+                        dragging = true;
+                    }
+
+                    if (dragging)
+                    {
+                        PositionConstraint* c = &drag;
+
+                        if (IsMouseButtonDown(MOUSE_BUTTON_RIGHT))
+                        {
+                            sim->Post([c, x, y](System& s)
+                            {
+                                c->x = x; c->y = y;
+                                s.Wake(c->a);
+                            });
+                        }
+                        else
+                        {
+                            sim->Post([c](System& s)
+                            {
+                                for (int i = s.NC - 1; i >= 0; i--)
+                                    if (s.constraints[i] == c) { s.RemoveConstraint(i); break; }
+                            });
+                            dragging = false;
+                        }
+                    }
 
                     BeginDrawing();
                     {
                         ClearBackground(BLACK);
 
-                        system->Draw();
+                        DrawSnapshot(snapshot);
                     }
                     EndDrawing();
                 }
@@ -242,11 +412,9 @@ int main()
         // std::this_thread::sleep_for(std::chrono::milliseconds(3));
     }
 
+    if (sim) delete sim;
     if (system) delete system;
 
-    for (int i = 0; i < forces.size(); i++) delete forces[i];
-    for (int i = 0; i < constraints.size(); i++) delete constraints[i];
-
     CloseWindow();
 
     return 0;
@@ -0,0 +1,211 @@
+#include "profile.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+
+static const char* phaseNames[PHASE_COUNT] = { "step", "forces", "constraints", "assembly", "solve", "integrate", "project" };
+static const char* counterNames[COUNTER_COUNT] = { "substeps", "solves", "iterations", "singular", "allocations", "projections" };
+
+// samples kept per phase and thread for the percentiles
+static constexpr std::size_t maxSamples = 1 << 16;
+// trace events kept per thread, later ones are only counted
+static constexpr std::size_t maxEvents = 1 << 20;
+
+struct TraceEvent
+{
+    ProfilePhase phase;
+    double start; // microseconds since the first record
+    double duration;
+};
+
+struct ThreadLog
+{
+    int tid;
+
+    long count[PHASE_COUNT];
+    double total[PHASE_COUNT];
+    double max[PHASE_COUNT];
+    std::vector<double> samples[PHASE_COUNT]; // ring buffer of durations
+
+    long counters[COUNTER_COUNT];
+
+    std::vector<TraceEvent> events;
+    long droppedEvents;
+
+    void Clear()
+    {
+        for (int i = 0; i < PHASE_COUNT; i++)
+        {
+            count[i] = 0;
+            total[i] = 0.0;
+            max[i] = 0.0;
+            samples[i].clear();
+        }
+
+        for (int i = 0; i < COUNTER_COUNT; i++) counters[i] = 0;
+
+        events.clear();
+        droppedEvents = 0;
+    }
+};
+
+static std::mutex registryLock;
+static std::vector<std::unique_ptr<ThreadLog>> registry;
+static const Profile::Clock::time_point epoch = Profile::Clock::now();
+
+static ThreadLog& Log()
+{
+    thread_local ThreadLog* log = NULL;
+
+    if (!log)
+    {
+        std::lock_guard<std::mutex> lock(registryLock);
+
+        registry.emplace_back(new ThreadLog());
+        log = registry.back().get();
+        log->tid = registry.size();
+        log->Clear();
+    }
+
+    return *log;
+}
+
+void Profile::Record(ProfilePhase phase, Clock::time_point start, Clock::time_point end)
+{
+    ThreadLog& log = Log();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+
+    long n = log.count[phase]++;
+    log.total[phase] += seconds;
+    log.max[phase] = std::max(log.max[phase], seconds);
+
+    std::vector<double>& samples = log.samples[phase];
+    if (samples.size() < maxSamples) samples.push_back(seconds);
+    else samples[n % maxSamples] = seconds;
+
+    if (log.events.size() < maxEvents)
+        log.events.push_back({ phase, std::chrono::duration<double, std::micro>(start - epoch).count(), seconds*1e6 });
+    else
+        log.droppedEvents++;
+}
+
+void Profile::Count(ProfileCounter counter, long n)
+{
+    Log().counters[counter] += n;
+}
+
+void Profile::Reset()
+{
+    std::lock_guard<std::mutex> lock(registryLock);
+
+    for (std::unique_ptr<ThreadLog>& log : registry)
+        log->Clear();
+}
+
+static double Percentile(std::vector<double>& v, double q)
+{
+    if (v.empty()) return 0.0;
+
+    std::size_t i = std::min(v.size() - 1, (std::size_t) (q*v.size()));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+
+    return v[i];
+}
+
+void Profile::Stats(std::vector<PhaseStats>& out)
+{
+    std::lock_guard<std::mutex> lock(registryLock);
+
+    out.clear();
+
+    for (int p = 0; p < PHASE_COUNT; p++)
+    {
+        PhaseStats stats = { phaseNames[p], 0, 0.0, 0.0, 0.0, 0.0 };
+        std::vector<double> samples;
+
+        for (std::unique_ptr<ThreadLog>& log : registry)
+        {
+            stats.count += log->count[p];
+            stats.total += log->total[p];
+            stats.max = std::max(stats.max, log->max[p]);
+            samples.insert(samples.end(), log->samples[p].begin(), log->samples[p].end());
+        }
+
+        stats.p50 = Percentile(samples, 0.5);
+        stats.p99 = Percentile(samples, 0.99);
+
+        out.push_back(stats);
+    }
+}
+
+long Profile::Counter(ProfileCounter counter)
+{
+    std::lock_guard<std::mutex> lock(registryLock);
+
+    long n = 0;
+    for (std::unique_ptr<ThreadLog>& log : registry)
+        n += log->counters[counter];
+
+    return n;
+}
+
+void Profile::Print()
+{
+    std::vector<PhaseStats> stats;
+    Stats(stats);
+
+    std::printf("%-12s %10s %12s %10s %10s %10s\n", "phase", "count", "total ms", "p50 us", "p99 us", "max us");
+
+    for (const PhaseStats& s : stats)
+        std::printf("%-12s %10ld %12.3f %10.3f %10.3f %10.3f\n", s.name, s.count, s.total*1e3, s.p50*1e6, s.p99*1e6, s.max*1e6);
+
+    for (int c = 0; c < COUNTER_COUNT; c++)
+        std::printf("%-12s %10ld\n", counterNames[c], Counter((ProfileCounter) c));
+}
+
+bool Profile::WriteChromeTrace(const char* path)
+{
+    std::FILE* file = std::fopen(path, "w");
+    if (!file) return false;
+
+    std::lock_guard<std::mutex> lock(registryLock);
+
+    std::fprintf(file, "{\"traceEvents\":[\n");
+
+    bool first = true;
+    double last = 0.0;
+
+    for (std::unique_ptr<ThreadLog>& log : registry)
+    {
+        for (const TraceEvent& e : log->events)
+        {
+            std::fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%0.3f,\"dur\":%0.3f,\"pid\":1,\"tid\":%d}",
+                first ? "" : ",\n", phaseNames[e.phase], e.start, e.duration, log->tid);
+            first = false;
+            last = std::max(last, e.start + e.duration);
+        }
+    }
+
+    // counter totals at the end of the trace
+    long dropped = 0;
+    for (std::unique_ptr<ThreadLog>& log : registry)
+        dropped += log->droppedEvents;
+
+    for (int c = 0; c <= COUNTER_COUNT; c++)
+    {
+        long n = 0;
+        for (std::unique_ptr<ThreadLog>& log : registry)
+            n += c < COUNTER_COUNT ? log->counters[c] : 0;
+
+        std::fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%0.3f,\"pid\":1,\"args\":{\"value\":%ld}}",
+            first ? "" : ",\n", c < COUNTER_COUNT ? counterNames[c] : "dropped events", last, c < COUNTER_COUNT ? n : dropped);
+        first = false;
+    }
+
+    std::fprintf(file, "\n]}\n");
+
+    return std::fclose(file) == 0;
+}
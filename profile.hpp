@@ -0,0 +1,82 @@
+#pragma once
+
+#include <chrono>
+#include <vector>
+
+// Hot path instrumentation. Build with -DSIMPLEPHYSICS_PROFILE (make
+// PROFILE=1) to enable it, otherwise PROFILE_SCOPE and PROFILE_COUNT compile
+// to nothing and the queries below report zeros.
+//
+// Every thread records into its own log, query the results only while no
+// System is stepping.
+
+enum ProfilePhase
+{
+    PHASE_STEP = 0,    // one whole substep
+    PHASE_FORCES,      // Force::Apply
+    PHASE_CONSTRAINTS, // C, Cd, J and Jd evaluation
+    PHASE_ASSEMBLY,    // J*W*Jt and the right hand side
+    PHASE_SOLVE,       // factorization and solve of J*W*Jt
+    PHASE_INTEGRATE,   // integration and sleep bookkeeping
+    PHASE_PROJECT,     // post step projection onto C=0 and J*v=0
+    PHASE_COUNT,
+};
+
+enum ProfileCounter
+{
+    COUNTER_SUBSTEPS = 0,
+    COUNTER_SOLVES,     // island solves
+    COUNTER_ITERATIONS, // solver iterations, eliminated rows for direct solves
+    COUNTER_SINGULAR,   // singular J*W*Jt matrices
+    COUNTER_ALLOCATIONS, // Vec and Mat constructions
+    COUNTER_PROJECTIONS, // Newton iterations of the position projection
+    COUNTER_COUNT,
+};
+
+struct PhaseStats
+{
+    const char* name;
+    long count;
+    double total; // all in seconds
+    double p50;
+    double p99;
+    double max;
+};
+
+struct Profile
+{
+    typedef std::chrono::steady_clock Clock;
+
+    static void Reset();
+
+    static void Stats(std::vector<PhaseStats>& out);
+    static long Counter(ProfileCounter counter);
+    static void Print();
+
+    // chrome://tracing or https://ui.perfetto.dev
+    static bool WriteChromeTrace(const char* path);
+
+    static void Record(ProfilePhase phase, Clock::time_point start, Clock::time_point end);
+    static void Count(ProfileCounter counter, long n);
+};
+
+class ProfileScope
+{
+public:
+    explicit ProfileScope(ProfilePhase phase_) : phase(phase_), start(Profile::Clock::now()) {  }
+    ~ProfileScope() { Profile::Record(phase, start, Profile::Clock::now()); }
+
+private:
+    ProfilePhase phase;
+    Profile::Clock::time_point start;
+};
+
+#ifdef SIMPLEPHYSICS_PROFILE
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(phase) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(phase)
+#define PROFILE_COUNT(counter, n) Profile::Count(counter, n)
+#else
+#define PROFILE_SCOPE(phase) ((void) 0)
+#define PROFILE_COUNT(counter, n) ((void) 0)
+#endif
@@ -0,0 +1,291 @@
+#include "render.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include <raylib.h>
+#include <rlgl.h>
+
+static constexpr float circleRadius = 20.0f;
+
+// DrawCircle uses 36 triangles
+static constexpr int fullSides = 36;
+static constexpr int reducedSides = 8;
+
+// at reduced detail a particle is dropped when one was already drawn in its
+// mergeCell x mergeCell pixel cell, its circle would barely show
+static constexpr float mergeCell = circleRadius/4;
+
+// vertices per rlBegin, well below what fits into a raylib render batch
+static constexpr int chunkVertices = 4096;
+
+enum
+{
+    OUT_LEFT = 1,
+    OUT_RIGHT = 2,
+    OUT_TOP = 4,
+    OUT_BOTTOM = 8,
+    OUT_NAN = 16,
+};
+
+RenderBatch::RenderBatch()
+    : radius(circleRadius), sides(fullSides), reduced(false), culled(0), merged(0)
+{
+}
+
+int RenderBatch::Vertices() const
+{
+    return (particles.size() + holds.size())*3*sides + lines.size();
+}
+
+static BatchVertex Vertex(float x, float y, Color c)
+{
+    return { x, y, c.r, c.g, c.b, c.a };
+}
+
+// where (x, y) is relative to the view grown by margin, 0 when inside
+static unsigned char Outcode(float x, float y, float margin, int width, int height)
+{
+    if (std::isnan(x) || std::isnan(y)) return OUT_NAN;
+
+    unsigned char code = 0;
+
+    if (x < -margin) code |= OUT_LEFT;
+    if (x > width + margin) code |= OUT_RIGHT;
+    if (y < -margin) code |= OUT_TOP;
+    if (y > height + margin) code |= OUT_BOTTOM;
+
+    return code;
+}
+
+void BuildBatch(const Snapshot& snapshot, int width, int height, RenderDetail detail, RenderBatch& batch, bool cull)
+{
+    const double* pos = snapshot.pos.data();
+    const int DF = snapshot.DF;
+    const int N = snapshot.N;
+
+    batch.particles.clear();
+    batch.lines.clear();
+    batch.holds.clear();
+
+    batch.culled = 0;
+    batch.merged = 0;
+
+    // merging indexes cells of the view, so it needs the culling
+    batch.reduced = cull && (detail == RENDER_REDUCED || (detail == RENDER_AUTO && N + (int) snapshot.segments.size() > renderDenseElements));
+    batch.sides = batch.reduced ? reducedSides : fullSides;
+
+    const float r = batch.radius;
+
+    // covers the view grown by the radius, like the culling
+    int cellsX = (int) ((width + 2*r)/mergeCell) + 1;
+    int cellsY = (int) ((height + 2*r)/mergeCell) + 1;
+
+    if (batch.reduced) batch.covered.assign(cellsX*cellsY, 0);
+
+    batch.outcode.resize(N);
+
+    for (int i = 0; i < N; i++)
+    {
+        float x = pos[i*DF], y = pos[i*DF+1];
+
+        unsigned char code = Outcode(x, y, r, width, height);
+        if (!cull) code &= OUT_NAN;
+        batch.outcode[i] = code;
+
+        if (code) { batch.culled++; continue; }
+
+        if (batch.reduced)
+        {
+            unsigned char& covered = batch.covered[(int) ((y + r)/mergeCell)*cellsX + (int) ((x + r)/mergeCell)];
+            if (covered) { batch.merged++; continue; }
+            covered = 1;
+        }
+
+        batch.particles.push_back(Vertex(x, y, RED));
+    }
+
+    for (const Segment& s : snapshot.segments)
+    {
+        if (s.kind == SEGMENT_HOLD)
+        {
+            if (batch.outcode[s.a]) { batch.culled++; continue; }
+
+            batch.holds.push_back(Vertex(pos[s.a*DF], pos[s.a*DF+1], ORANGE));
+            continue;
+        }
+
+        // both ends on the same side outside the view, the circle margin
+        // makes this a little conservative for lines
+        unsigned char a = batch.outcode[s.a], b = batch.outcode[s.b];
+        if ((a & b) || ((a | b) & OUT_NAN)) { batch.culled++; continue; }
+
+        float x0 = pos[s.a*DF], y0 = pos[s.a*DF+1];
+        float x1 = pos[s.b*DF], y1 = pos[s.b*DF+1];
+
+        if (batch.reduced && std::fabs(x1 - x0) < 1.0f && std::fabs(y1 - y0) < 1.0f) { batch.merged++; continue; }
+
+        Color c = s.kind == SEGMENT_ROD ? BLUE : YELLOW;
+
+        batch.lines.push_back(Vertex(x0, y0, c));
+        batch.lines.push_back(Vertex(x1, y1, c));
+    }
+}
+
+static void DrawCircles(const std::vector<BatchVertex>& centers, float r, int sides)
+{
+    float dx[fullSides + 1], dy[fullSides + 1];
+
+    for (int k = 0; k <= sides; k++)
+    {
+        float angle = 2.0f*PI*k/sides;
+        dx[k] = std::cos(angle)*r;
+        dy[k] = std::sin(angle)*r;
+    }
+
+    // same triangles and winding as DrawCircle
+    int per = 3*sides;
+    int chunk = std::max(1, chunkVertices/per);
+
+    for (std::size_t i = 0; i < centers.size(); i += chunk)
+    {
+        std::size_t end = std::min(centers.size(), i + chunk);
+
+        rlCheckRenderBatchLimit((end - i)*per);
+        rlBegin(RL_TRIANGLES);
+
+        for (std::size_t j = i; j < end; j++)
+        {
+            const BatchVertex& c = centers[j];
+            rlColor4ub(c.r, c.g, c.b, c.a);
+
+            for (int k = 0; k < sides; k++)
+            {
+                rlVertex2f(c.x, c.y);
+                rlVertex2f(c.x + dx[k+1], c.y + dy[k+1]);
+                rlVertex2f(c.x + dx[k], c.y + dy[k]);
+            }
+        }
+
+        rlEnd();
+    }
+}
+
+static void DrawLines(const std::vector<BatchVertex>& lines)
+{
+    for (std::size_t i = 0; i < lines.size(); i += chunkVertices)
+    {
+        std::size_t end = std::min(lines.size(), i + chunkVertices);
+
+        rlCheckRenderBatchLimit(end - i);
+        rlBegin(RL_LINES);
+
+        for (std::size_t j = i; j < end; j++)
+        {
+            const BatchVertex& v = lines[j];
+            rlColor4ub(v.r, v.g, v.b, v.a);
+            rlVertex2f(v.x, v.y);
+        }
+
+        rlEnd();
+    }
+}
+
+void DrawBatch(const RenderBatch& batch)
+{
+    DrawCircles(batch.particles, batch.radius, batch.sides);
+    DrawLines(batch.lines);
+    DrawCircles(batch.holds, batch.radius, batch.sides);
+}
+
+static void Put(std::vector<unsigned char>& rgb, int width, int x, int y, const BatchVertex& c)
+{
+    unsigned char* p = &rgb[(y*width + x)*3];
+    p[0] = c.r; p[1] = c.g; p[2] = c.b;
+}
+
+static void RasterizeCircles(const std::vector<BatchVertex>& centers, float r, int width, int height, std::vector<unsigned char>& rgb)
+{
+    for (const BatchVertex& c : centers)
+    {
+        int x0 = std::max(0, (int) std::floor(c.x - r)), x1 = std::min(width - 1, (int) std::ceil(c.x + r));
+        int y0 = std::max(0, (int) std::floor(c.y - r)), y1 = std::min(height - 1, (int) std::ceil(c.y + r));
+
+        for (int y = y0; y <= y1; y++)
+        {
+            for (int x = x0; x <= x1; x++)
+            {
+                float dx = x + 0.5f - c.x, dy = y + 0.5f - c.y;
+                if (dx*dx + dy*dy <= r*r) Put(rgb, width, x, y, c);
+            }
+        }
+    }
+}
+
+// Liang-Barsky, false when the line misses the view
+static bool Clip(float& x0, float& y0, float& x1, float& y1, int width, int height)
+{
+    float dx = x1 - x0, dy = y1 - y0;
+    float p[4] = { -dx, dx, -dy, dy };
+    float q[4] = { x0, width - x0, y0, height - y0 };
+
+    float t0 = 0.0f, t1 = 1.0f;
+
+    for (int k = 0; k < 4; k++)
+    {
+        if (p[k] == 0.0f)
+        {
+            if (q[k] < 0.0f) return false;
+            continue;
+        }
+
+        float t = q[k]/p[k];
+
+        if (p[k] < 0.0f) t0 = std::max(t0, t);
+        else t1 = std::min(t1, t);
+    }
+
+    if (t0 > t1) return false;
+
+    x1 = x0 + t1*dx; y1 = y0 + t1*dy;
+    x0 = x0 + t0*dx; y0 = y0 + t0*dy;
+
+    return true;
+}
+
+static void RasterizeLines(const std::vector<BatchVertex>& lines, int width, int height, std::vector<unsigned char>& rgb)
+{
+    for (std::size_t i = 0; i + 1 < lines.size(); i += 2)
+    {
+        float x0 = lines[i].x, y0 = lines[i].y, x1 = lines[i+1].x, y1 = lines[i+1].y;
+        if (!Clip(x0, y0, x1, y1, width, height)) continue;
+
+        int steps = (int) std::ceil(std::max(std::fabs(x1 - x0), std::fabs(y1 - y0))) + 1;
+
+        for (int s = 0; s <= steps; s++)
+        {
+            int x = (int) std::floor(x0 + (x1 - x0)*s/steps);
+            int y = (int) std::floor(y0 + (y1 - y0)*s/steps);
+
+            if (x >= 0 && x < width && y >= 0 && y < height) Put(rgb, width, x, y, lines[i]);
+        }
+    }
+}
+
+void RasterizeBatch(const RenderBatch& batch, int width, int height, std::vector<unsigned char>& rgb)
+{
+    rgb.assign(width*height*3, 0);
+
+    RasterizeCircles(batch.particles, batch.radius, width, height, rgb);
+    RasterizeLines(batch.lines, width, height, rgb);
+    RasterizeCircles(batch.holds, batch.radius, width, height, rgb);
+}
+
+void DrawSnapshot(const Snapshot& snapshot, RenderDetail detail)
+{
+    // only ever called from the thread that owns the window
+    static RenderBatch batch;
+
+    BuildBatch(snapshot, GetScreenWidth(), GetScreenHeight(), detail, batch);
+    DrawBatch(batch);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <vector>
+
+#include "snapshot.hpp"
+
+enum RenderDetail
+{
+    RENDER_AUTO = 0, // reduced once a snapshot has more than renderDenseElements
+    RENDER_FULL,
+    RENDER_REDUCED,  // coarse circles, particles covering the same spot drawn once
+};
+
+// particles plus segments above which RENDER_AUTO draws at reduced detail
+constexpr int renderDenseElements = 20000;
+
+struct BatchVertex
+{
+    float x, y;
+    unsigned char r, g, b, a;
+};
+
+// Everything visible in a snapshot as flat vertex arrays, built in one pass
+// over the positions and drawn with a handful of batched calls. Particles
+// are drawn first, then the lines, then the holds on top.
+struct RenderBatch
+{
+    std::vector<BatchVertex> particles; // circle centers
+    std::vector<BatchVertex> lines;     // two vertices per spring or rod
+    std::vector<BatchVertex> holds;     // circle centers
+
+    float radius;
+    int sides;   // of the polygon a circle is drawn as
+    bool reduced;
+
+    int culled;  // elements entirely outside the view
+    int merged;  // particles dropped at reduced detail
+
+    std::vector<unsigned char> outcode; // per particle, scratch
+    std::vector<unsigned char> covered; // reduced detail occupancy, scratch
+
+    RenderBatch();
+
+    int Vertices() const; // sent to the GPU by DrawBatch
+};
+
+// culls against a width x height view in screen coordinates, the batch is
+// reused between frames so its arrays stop growing. cull false keeps all but
+// NaN positions at full detail, to check the culling against
+void BuildBatch(const Snapshot& snapshot, int width, int height, RenderDetail detail, RenderBatch& batch, bool cull = true);
+
+void DrawBatch(const RenderBatch& batch);
+
+// software version of DrawBatch into a width x height RGB image, for checks
+// and pictures without a window
+void RasterizeBatch(const RenderBatch& batch, int width, int height, std::vector<unsigned char>& rgb);
+
+// BuildBatch for the current screen and DrawBatch
+void DrawSnapshot(const Snapshot& snapshot, RenderDetail detail = RENDER_AUTO);
@@ -0,0 +1,309 @@
+#include "scene.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+static const char sceneMagic[4] = { 'S', 'P', 'S', 'C' };
+
+struct SceneHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t particles;
+    uint32_t forces;
+    uint32_t constraints;
+};
+
+template<typename T>
+static void Put(std::vector<char>& out, T value)
+{
+    const char* p = reinterpret_cast<const char*>(&value);
+    out.insert(out.end(), p, p + sizeof(T));
+}
+
+template<typename T>
+static bool Get(const char*& p, const char* end, T& value)
+{
+    if (end - p < (long) sizeof(T)) return false;
+
+    std::memcpy(&value, p, sizeof(T));
+    p += sizeof(T);
+
+    return true;
+}
+
+template<typename T, int D>
+void EncodeScene(std::vector<char>& out, const std::vector<Particle>& particles, const std::vector<ForceT<T, D>*>& forces, const std::vector<ConstraintT<T, D>*>& constraints)
+{
+    std::vector<char> records;
+    uint32_t nf = 0, nc = 0;
+
+    for (ForceT<T, D>* force : forces)
+    {
+        if (GravityT<T, D>* g = dynamic_cast<GravityT<T, D>*>(force))
+        {
+            Put<uint8_t>(records, RECORD_GRAVITY);
+            Put<double>(records, g->a);
+        }
+        else if (SpringT<T, D>* s = dynamic_cast<SpringT<T, D>*>(force))
+        {
+            Put<uint8_t>(records, RECORD_SPRING);
+            Put<int32_t>(records, s->a); Put<int32_t>(records, s->b);
+            Put<double>(records, s->len); Put<double>(records, s->k);
+        }
+        else if (NBodyT<T, D>* n = dynamic_cast<NBodyT<T, D>*>(force))
+        {
+            Put<uint8_t>(records, RECORD_NBODY);
+            Put<double>(records, n->G); Put<double>(records, n->theta); Put<double>(records, n->softening);
+        }
+        else
+        {
+            std::printf("WARNING: skipping force the scene format does not know\n");
+            continue;
+        }
+
+        nf++;
+    }
+
+    for (ConstraintT<T, D>* constraint : constraints)
+    {
+        if (PositionConstraintT<T, D>* p = dynamic_cast<PositionConstraintT<T, D>*>(constraint))
+        {
+            Put<uint8_t>(records, RECORD_POSITION);
+            Put<int32_t>(records, p->a);
+            Put<double>(records, p->x); Put<double>(records, p->y);
+            if (D > 2) Put<double>(records, p->z);
+        }
+        else if (DistanceConstraintT<T, D>* d = dynamic_cast<DistanceConstraintT<T, D>*>(constraint))
+        {
+            Put<uint8_t>(records, RECORD_DISTANCE);
+            Put<int32_t>(records, d->a); Put<int32_t>(records, d->b);
+            Put<double>(records, d->dist);
+        }
+        else
+        {
+            std::printf("WARNING: skipping constraint the scene format does not know\n");
+            continue;
+        }
+
+        nc++;
+    }
+
+    SceneHeader header;
+    std::memcpy(header.magic, sceneMagic, 4);
+    header.version = sceneVersion;
+    header.particles = particles.size();
+    header.forces = nf;
+    header.constraints = nc;
+
+    Put(out, header);
+    Put<uint32_t>(out, D);
+
+    for (const Particle& p : particles)
+    {
+        Put(out, p.x); Put(out, p.y); Put(out, p.m);
+        if (D > 2) Put(out, p.z);
+    }
+
+    out.insert(out.end(), records.begin(), records.end());
+}
+
+template<typename T, int D>
+bool SaveScene(const char* path, const std::vector<Particle>& particles, const std::vector<ForceT<T, D>*>& forces, const std::vector<ConstraintT<T, D>*>& constraints)
+{
+    std::vector<char> data;
+    EncodeScene<T>(data, particles, forces, constraints);
+
+    std::FILE* file = std::fopen(path, "wb");
+    if (!file) return false;
+
+    bool ok = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+
+    return std::fclose(file) == 0 && ok;
+}
+
+template<typename T, int D>
+bool LoadScene(const char* path, std::vector<Particle>& particles, ElementsT<T, D>& elements)
+{
+    std::FILE* file = std::fopen(path, "rb");
+    if (!file) return false;
+
+    // read the whole file in one go and parse from memory
+    std::vector<char> data;
+    char chunk[1 << 16];
+    std::size_t n;
+    while ((n = std::fread(chunk, 1, sizeof(chunk), file)) > 0)
+        data.insert(data.end(), chunk, chunk + n);
+    std::fclose(file);
+
+    if (!DecodeScene<T>(data.data(), data.size(), particles, elements))
+    {
+        std::printf("WARNING: could not load scene %s\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+template<typename T, int D>
+bool DecodeScene(const char* data, std::size_t size, std::vector<Particle>& particles, ElementsT<T, D>& elements)
+{
+    const char* p = data;
+    const char* end = p + size;
+
+    SceneHeader header;
+    if (!Get(p, end, header) || std::memcmp(header.magic, sceneMagic, 4) != 0)
+    {
+        std::printf("WARNING: not a scene\n");
+        return false;
+    }
+
+    if (header.version > sceneVersion)
+    {
+        std::printf("WARNING: scene version %u, newest known is %u\n", header.version, sceneVersion);
+        return false;
+    }
+
+    // version 1 scenes are always 2D
+    uint32_t dimensions = 2;
+    if (header.version >= 2 && !Get(p, end, dimensions)) return false;
+
+    if (dimensions != D)
+    {
+        std::printf("WARNING: %uD scene loaded into a %dD system\n", dimensions, D);
+        return false;
+    }
+
+    if ((std::size_t) (end - p) < header.particles*(D + 1)*sizeof(double)) return false;
+
+    int base = particles.size();
+    particles.resize(base + header.particles);
+
+    for (uint32_t i = 0; i < header.particles; i++)
+    {
+        double v[4] = {  };
+        Get(p, end, v[0]); Get(p, end, v[1]); Get(p, end, v[2]);
+        if (D > 2) Get(p, end, v[3]);
+        particles[base + i] = { .x = v[0], .y = v[1], .m = v[2], .z = v[3] };
+    }
+
+    // particle indices in the file are relative to the file, a record that
+    // points past its particles is rejected like a truncated one
+    auto valid = [&](int32_t i) { return i >= 0 && (uint32_t) i < header.particles; };
+
+    bool ok = true;
+
+    for (uint32_t i = 0; ok && i < header.forces; i++)
+    {
+        uint8_t type = 0;
+        ok = Get(p, end, type);
+
+        if (ok && type == RECORD_GRAVITY)
+        {
+            double a;
+            if ((ok = Get(p, end, a))) elements.template Add<GravityT<T, D>>(a);
+        }
+        else if (ok && type == RECORD_SPRING)
+        {
+            int32_t a, b; double len, k;
+            if ((ok = Get(p, end, a) && Get(p, end, b) && Get(p, end, len) && Get(p, end, k) && valid(a) && valid(b)))
+                elements.template Add<SpringT<T, D>>(base + a, base + b, len, k);
+        }
+        else if (ok && type == RECORD_NBODY)
+        {
+            double G, theta, softening;
+            if ((ok = Get(p, end, G) && Get(p, end, theta) && Get(p, end, softening)))
+                elements.template Add<NBodyT<T, D>>(G, theta, softening);
+        }
+        else
+        {
+            ok = false;
+        }
+    }
+
+    for (uint32_t i = 0; ok && i < header.constraints; i++)
+    {
+        uint8_t type = 0;
+        ok = Get(p, end, type);
+
+        if (ok && type == RECORD_POSITION)
+        {
+            int32_t a; double x, y, z = 0.0;
+            if ((ok = Get(p, end, a) && Get(p, end, x) && Get(p, end, y) && (D == 2 || Get(p, end, z)) && valid(a)))
+                elements.template Add<PositionConstraintT<T, D>>(base + a, x, y, z);
+        }
+        else if (ok && type == RECORD_DISTANCE)
+        {
+            int32_t a, b; double dist;
+            if ((ok = Get(p, end, a) && Get(p, end, b) && Get(p, end, dist) && valid(a) && valid(b)))
+                elements.template Add<DistanceConstraintT<T, D>>(base + a, base + b, dist);
+        }
+        else
+        {
+            ok = false;
+        }
+    }
+
+    if (!ok) std::printf("WARNING: scene is truncated or has an unknown or invalid record\n");
+
+    return ok;
+}
+
+template<typename T, int D>
+bool SceneT<T, D>::Load(const char* path)
+{
+    return LoadScene<T>(path, particles, elements);
+}
+
+template<typename T, int D>
+bool SceneT<T, D>::Save(const char* path) const
+{
+    return SaveScene<T>(path, particles, elements.forces, elements.constraints);
+}
+
+template<typename T, int D>
+SystemT<T, D>* SceneT<T, D>::MakeSystem() const
+{
+    return new SystemT<T, D>(particles, elements.forces, elements.constraints);
+}
+
+int SceneDimensions(const char* path)
+{
+    std::FILE* file = std::fopen(path, "rb");
+    if (!file) return 0;
+
+    SceneHeader header;
+    uint32_t dimensions = 2;
+
+    bool ok = std::fread(&header, sizeof(header), 1, file) == 1 && std::memcmp(header.magic, sceneMagic, 4) == 0;
+    if (ok && header.version >= 2) ok = std::fread(&dimensions, sizeof(dimensions), 1, file) == 1;
+
+    std::fclose(file);
+
+    return ok ? dimensions : 0;
+}
+
+template void EncodeScene(std::vector<char>&, const std::vector<Particle>&, const std::vector<ForceT<float, 2>*>&, const std::vector<ConstraintT<float, 2>*>&);
+template bool DecodeScene(const char*, std::size_t, std::vector<Particle>&, ElementsT<float, 2>&);
+template bool SaveScene(const char*, const std::vector<Particle>&, const std::vector<ForceT<float, 2>*>&, const std::vector<ConstraintT<float, 2>*>&);
+template bool LoadScene(const char*, std::vector<Particle>&, ElementsT<float, 2>&);
+
+template void EncodeScene(std::vector<char>&, const std::vector<Particle>&, const std::vector<ForceT<float, 3>*>&, const std::vector<ConstraintT<float, 3>*>&);
+template bool DecodeScene(const char*, std::size_t, std::vector<Particle>&, ElementsT<float, 3>&);
+template bool SaveScene(const char*, const std::vector<Particle>&, const std::vector<ForceT<float, 3>*>&, const std::vector<ConstraintT<float, 3>*>&);
+template bool LoadScene(const char*, std::vector<Particle>&, ElementsT<float, 3>&);
+
+template void EncodeScene(std::vector<char>&, const std::vector<Particle>&, const std::vector<ForceT<double, 2>*>&, const std::vector<ConstraintT<double, 2>*>&);
+template bool DecodeScene(const char*, std::size_t, std::vector<Particle>&, ElementsT<double, 2>&);
+template bool SaveScene(const char*, const std::vector<Particle>&, const std::vector<ForceT<double, 2>*>&, const std::vector<ConstraintT<double, 2>*>&);
+template bool LoadScene(const char*, std::vector<Particle>&, ElementsT<double, 2>&);
+
+template void EncodeScene(std::vector<char>&, const std::vector<Particle>&, const std::vector<ForceT<double, 3>*>&, const std::vector<ConstraintT<double, 3>*>&);
+template bool DecodeScene(const char*, std::size_t, std::vector<Particle>&, ElementsT<double, 3>&);
+template bool SaveScene(const char*, const std::vector<Particle>&, const std::vector<ForceT<double, 3>*>&, const std::vector<ConstraintT<double, 3>*>&);
+template bool LoadScene(const char*, std::vector<Particle>&, ElementsT<double, 3>&);
+template struct SceneT<float, 2>;
+template struct SceneT<double, 2>;
+template struct SceneT<float, 3>;
+template struct SceneT<double, 3>;
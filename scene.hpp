@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vector>
+
+#include "elements.hpp"
+#include "system.hpp"
+
+// Binary scene files (.sps), host byte order:
+//
+//   char     magic[4]    "SPSC"
+//   uint32   version
+//   uint32   particles, forces, constraints
+//   uint32   dimensions  2 or 3, absent in version 1 (always 2D)
+//   Particle particles[] (x, y, m and z in 3D as doubles)
+//   records  forces[]      uint8 type followed by the fields of that type
+//   records  constraints[] uint8 type followed by the fields of that type
+//
+// A scene only loads into elements and systems of its own dimension.
+
+constexpr unsigned sceneVersion = 2;
+
+enum SceneRecord
+{
+    RECORD_GRAVITY = 1,
+    RECORD_SPRING,
+    RECORD_NBODY,
+    RECORD_POSITION = 64,
+    RECORD_DISTANCE,
+};
+
+// Writes particles, forces and constraints to path. Elements of a type the
+// format does not know are skipped with a warning.
+template<typename T, int D>
+bool SaveScene(const char* path, const std::vector<Particle>& particles, const std::vector<ForceT<T, D>*>& forces, const std::vector<ConstraintT<T, D>*>& constraints);
+
+// Appends the contents of path, forces and constraints are added to elements
+// in file order.
+template<typename T, int D>
+bool LoadScene(const char* path, std::vector<Particle>& particles, ElementsT<T, D>& elements);
+
+// Same as above on an in memory copy of a scene file
+template<typename T, int D>
+void EncodeScene(std::vector<char>& out, const std::vector<Particle>& particles, const std::vector<ForceT<T, D>*>& forces, const std::vector<ConstraintT<T, D>*>& constraints);
+template<typename T, int D>
+bool DecodeScene(const char* data, std::size_t size, std::vector<Particle>& particles, ElementsT<T, D>& elements);
+
+// dimension of the scene at path, 0 if it is not a scene
+int SceneDimensions(const char* path);
+
+// A loaded scene that owns its forces and constraints through elements, it
+// has to outlive the systems MakeSystem returns. The file always
+// holds doubles and T is the scalar of the elements and of MakeSystem, D
+// must match the dimension of the file
+template<typename T, int D>
+struct SceneT
+{
+    std::vector<Particle> particles;
+    ElementsT<T, D> elements;
+
+    bool Load(const char* path);
+    bool Save(const char* path) const;
+
+    SystemT<T, D>* MakeSystem() const;
+};
+
+typedef SceneT<double, 2> Scene;
+typedef SceneT<double, 3> Scene3;
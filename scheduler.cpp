@@ -0,0 +1,48 @@
+#include "scheduler.hpp"
+
+#include <algorithm>
+
+Scheduler::Scheduler(SchedulePolicy policy_, double budget_, int minSubsteps_, int maxSubsteps_)
+    : policy(policy_)
+    , budget(budget_)
+    , maxCatchUp(0.25)
+    , minSubsteps(minSubsteps_)
+    , maxSubsteps(maxSubsteps_)
+    , cost(0.0)
+    , smoothing(0.2)
+    , dropped(0.0)
+{
+}
+
+int Scheduler::Substeps() const
+{
+    // nothing measured yet, start low and let Measure find the real cost
+    if (policy == SCHEDULE_FIXED) return maxSubsteps;
+    if (cost <= 0.0) return minSubsteps;
+
+    int floor = minSubsteps;
+    if (policy == SCHEDULE_ACCURACY) floor = std::max(minSubsteps, maxSubsteps/4);
+
+    double fit = budget/cost;
+    if (fit > maxSubsteps) return maxSubsteps;
+
+    return std::max(floor, (int) fit);
+}
+
+void Scheduler::Measure(int substeps, double seconds)
+{
+    if (substeps <= 0) return;
+
+    double sample = seconds/substeps;
+
+    if (cost <= 0.0) cost = sample;
+    else cost += smoothing*(sample - cost);
+}
+
+double Scheduler::CatchUp(double acc)
+{
+    if (acc <= maxCatchUp) return acc;
+
+    dropped += acc - maxCatchUp;
+    return maxCatchUp;
+}
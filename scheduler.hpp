@@ -0,0 +1,37 @@
+#pragma once
+
+enum SchedulePolicy
+{
+    // always run maxSubsteps, the simulation slows down when it cannot keep up
+    SCHEDULE_FIXED = 0,
+    // fit the substeps into the budget, accuracy drops before the frame rate does
+    SCHEDULE_BUDGET,
+    // like BUDGET but never go below maxSubsteps/4, time slows down instead
+    SCHEDULE_ACCURACY,
+};
+
+// Picks the number of substeps per tick so the physics of one tick fits
+// into a wall time budget. The cost of a substep is measured online and
+// smoothed, so the choice follows the scene as it grows or shrinks.
+struct Scheduler
+{
+    SchedulePolicy policy;
+
+    double budget;     // wall time per tick the physics may use, in seconds
+    double maxCatchUp; // simulated time that may pile up before it is dropped
+
+    int minSubsteps;
+    int maxSubsteps;
+
+    double cost;       // smoothed seconds per substep
+    double smoothing;  // weight of the newest measurement
+    double dropped;    // simulated time thrown away because we fell behind
+
+    Scheduler(SchedulePolicy policy_, double budget_, int minSubsteps_, int maxSubsteps_);
+
+    int Substeps() const;
+    void Measure(int substeps, double seconds);
+
+    // bound the accumulated time, anything over maxCatchUp is dropped
+    double CatchUp(double acc);
+};
@@ -0,0 +1,100 @@
+#include "simthread.hpp"
+
+#include <chrono>
+
+typedef std::chrono::steady_clock Clock;
+
+SimThread::SimThread(System* system_, double h_, const Scheduler& scheduler_)
+    : system(system_), h(h_), scheduler(scheduler_), running(false)
+{
+    system->Publish(buffer.Back());
+    buffer.Publish();
+}
+
+SimThread::~SimThread()
+{
+    Stop();
+}
+
+void SimThread::Start()
+{
+    if (running) return;
+
+    running = true;
+    thread = std::thread(&SimThread::Run, this);
+}
+
+void SimThread::Stop()
+{
+    running = false;
+
+    if (thread.joinable()) thread.join();
+}
+
+void SimThread::Post(std::function<void(System&)> command)
+{
+    std::lock_guard<std::mutex> lock(commandsLock);
+    commands.push_back(std::move(command));
+}
+
+const Snapshot& SimThread::Acquire()
+{
+    return buffer.Acquire();
+}
+
+void SimThread::Run()
+{
+    std::vector<std::function<void(System&)>> pending;
+
+    Clock::time_point last = Clock::now();
+    double acc = 0.0;
+    int lastSubsteps = 0;
+
+    while (running)
+    {
+        Clock::time_point now = Clock::now();
+        acc += std::chrono::duration<double>(now - last).count();
+        last = now;
+
+        // a scene that cannot keep up runs slower instead of falling further behind
+        acc = scheduler.CatchUp(acc);
+
+        {
+            std::lock_guard<std::mutex> lock(commandsLock);
+            pending.swap(commands);
+        }
+
+        for (std::function<void(System&)>& command : pending)
+            command(*system);
+
+        bool stepped = !pending.empty();
+        pending.clear();
+
+        while (acc >= h && running)
+        {
+            int substeps = scheduler.Substeps();
+
+            Clock::time_point start = Clock::now();
+            system->Step(h, substeps);
+            scheduler.Measure(substeps, std::chrono::duration<double>(Clock::now() - start).count());
+
+            acc -= h;
+            stepped = true;
+            lastSubsteps = substeps;
+        }
+
+        if (stepped)
+        {
+            Snapshot& back = buffer.Back();
+            system->Publish(back);
+            back.substeps = lastSubsteps;
+            back.cost = scheduler.cost;
+            back.dropped = scheduler.dropped;
+            buffer.Publish();
+        }
+        else
+        {
+            std::this_thread::sleep_for(std::chrono::duration<double>(h - acc));
+        }
+    }
+}
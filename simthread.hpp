@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "scheduler.hpp"
+#include "snapshot.hpp"
+#include "system.hpp"
+
+// Runs a System on its own thread with a fixed timestep and publishes a
+// Snapshot after every tick. The substeps per tick come from a Scheduler.
+// The render thread never touches the System directly: it reads snapshots
+// through Acquire() and sends edits with Post(), which are applied between
+// ticks.
+class SimThread
+{
+public:
+    SimThread(System* system_, double h_, const Scheduler& scheduler_);
+    ~SimThread();
+
+    void Start();
+    void Stop();
+
+    void Post(std::function<void(System&)> command);
+
+    const Snapshot& Acquire();
+
+private:
+    void Run();
+
+    System* system;
+    double h; // simulated time per tick
+    Scheduler scheduler;
+
+    std::thread thread;
+    std::atomic<bool> running;
+
+    std::mutex commandsLock;
+    std::vector<std::function<void(System&)>> commands;
+
+    SnapshotBuffer buffer;
+};
@@ -0,0 +1,29 @@
+#include "snapshot.hpp"
+
+Snapshot::Snapshot()
+    : N(0), DF(2), topology(-1), steps(0), time(0.0), substeps(0), cost(0.0), dropped(0.0)
+{
+}
+
+SnapshotBuffer::SnapshotBuffer()
+    : back(0), front(1), middle(2)
+{
+}
+
+Snapshot& SnapshotBuffer::Back()
+{
+    return slots[back];
+}
+
+void SnapshotBuffer::Publish()
+{
+    back = middle.exchange(back | fresh, std::memory_order_acq_rel) & ~fresh;
+}
+
+const Snapshot& SnapshotBuffer::Acquire()
+{
+    if (middle.load(std::memory_order_relaxed) & fresh)
+        front = middle.exchange(front, std::memory_order_acq_rel) & ~fresh;
+
+    return slots[front];
+}
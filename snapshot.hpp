@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+enum SegmentKind
+{
+    SEGMENT_SPRING = 0,
+    SEGMENT_ROD,
+    SEGMENT_HOLD,
+};
+
+// A drawable element between two particles, b is -1 for elements that only
+// mark a single particle.
+struct Segment
+{
+    int a, b;
+    SegmentKind kind;
+};
+
+// Immutable copy of everything needed to draw one state of a System.
+struct Snapshot
+{
+    int N;
+    int DF;
+
+    std::vector<double> pos;
+    std::vector<Segment> segments;
+
+    long topology; // version of segments, only recopied when it changes
+    long steps;    // substeps simulated so far
+    double time;   // simulated time in seconds
+
+    // filled in by SimThread
+    int substeps;   // substeps of the last tick
+    double cost;    // wall seconds per substep
+    double dropped; // simulated seconds dropped to stay real time
+
+    Snapshot();
+};
+
+// Single producer / single consumer triple buffer. The producer fills Back()
+// and Publish()es it, the consumer calls Acquire() to get the most recent
+// complete snapshot. Neither side ever waits on the other.
+class SnapshotBuffer
+{
+public:
+    SnapshotBuffer();
+
+    Snapshot& Back();
+    void Publish();
+
+    const Snapshot& Acquire();
+
+private:
+    static constexpr int fresh = 4;
+
+    Snapshot slots[3];
+
+    int back;
+    int front;
+    std::atomic<int> middle; // slot index, or'ed with fresh when unread
+};
@@ -0,0 +1,89 @@
+#include "spatial.hpp"
+
+#include <cmath>
+
+SpatialGrid::SpatialGrid(double cell_)
+    : cell(cell_ > 0.0 ? cell_ : 1.0), count(0)
+{
+}
+
+int SpatialGrid::Cell(double v) const
+{
+    return (int) std::floor(v/cell);
+}
+
+int64_t SpatialGrid::Key(int cx, int cy)
+{
+    return ((int64_t) cx << 32) ^ (uint32_t) cy;
+}
+
+void SpatialGrid::Clear()
+{
+    cells.clear();
+    count = 0;
+}
+
+void SpatialGrid::Insert(int i, double x, double y)
+{
+    cells[Key(Cell(x), Cell(y))].push_back({ i, x, y });
+    count++;
+}
+
+void SpatialGrid::Build(const std::vector<Particle>& particles)
+{
+    Clear();
+
+    for (int i = 0; i < particles.size(); i++)
+        Insert(i, particles[i].x, particles[i].y);
+}
+
+void SpatialGrid::Build(const double* pos, int n, int stride)
+{
+    Clear();
+
+    for (int i = 0; i < n; i++)
+        Insert(i, pos[i*stride], pos[i*stride+1]);
+}
+
+int SpatialGrid::Nearest(double x, double y, double r) const
+{
+    int best = -1;
+    double bestSq = r*r;
+
+    for (int cx = Cell(x - r); cx <= Cell(x + r); cx++)
+    {
+        for (int cy = Cell(y - r); cy <= Cell(y + r); cy++)
+        {
+            auto it = cells.find(Key(cx, cy));
+            if (it == cells.end()) continue;
+
+            for (const Entry& e : it->second)
+            {
+                double dx = e.x - x, dy = e.y - y;
+                double dsq = dx*dx + dy*dy;
+
+                if (dsq < bestSq) { best = e.i; bestSq = dsq; }
+            }
+        }
+    }
+
+    return best;
+}
+
+void SpatialGrid::Query(double x, double y, double r, std::vector<int>& out) const
+{
+    for (int cx = Cell(x - r); cx <= Cell(x + r); cx++)
+    {
+        for (int cy = Cell(y - r); cy <= Cell(y + r); cy++)
+        {
+            auto it = cells.find(Key(cx, cy));
+            if (it == cells.end()) continue;
+
+            for (const Entry& e : it->second)
+            {
+                double dx = e.x - x, dy = e.y - y;
+                if (dx*dx + dy*dy < r*r) out.push_back(e.i);
+            }
+        }
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "system.hpp"
+
+// Uniform hash grid over 2D points for picking and neighbour queries, the
+// cost of a query depends on the points near it instead of on all of them.
+// Points keep the index they were inserted with. Queries are exact for any
+// radius, cells of about the usual query radius keep them cheap.
+class SpatialGrid
+{
+public:
+    explicit SpatialGrid(double cell_);
+
+    void Clear();
+    void Insert(int i, double x, double y);
+
+    // clears and inserts particle i (x, y) or point i (pos[i*stride], pos[i*stride+1])
+    void Build(const std::vector<Particle>& particles);
+    void Build(const double* pos, int n, int stride);
+
+    // closest point within r of (x, y), -1 if there is none
+    int Nearest(double x, double y, double r) const;
+
+    // every point within r of (x, y), in no particular order
+    void Query(double x, double y, double r, std::vector<int>& out) const;
+
+    int Size() const { return count; }
+
+private:
+    struct Entry
+    {
+        int i;
+        double x, y;
+    };
+
+    int Cell(double v) const;
+    static int64_t Key(int cx, int cy);
+
+    double cell;
+    std::unordered_map<int64_t, std::vector<Entry>> cells;
+    int count;
+};
@@ -0,0 +1,342 @@
+#include "stream.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char streamMagic[4] = { 'S', 'P', 'S', 'T' };
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the stream needs address free 64 bit atomics");
+
+// header and slots start on their own cache lines
+static constexpr std::size_t line = 64;
+
+static std::size_t Round(std::size_t size)
+{
+    return (size + line - 1) & ~(line - 1);
+}
+
+static std::size_t SlotSize(uint32_t capacity, uint32_t segmentCapacity)
+{
+    return Round(sizeof(StreamFrame) + capacity*3*sizeof(double) + segmentCapacity*sizeof(Segment));
+}
+
+static std::vector<char> ShmName(const char* name)
+{
+    if (name[0] == '/') name++;
+
+    std::size_t n = std::strlen(name);
+
+    std::vector<char> out(n + 2, 0);
+    out[0] = '/';
+    std::memcpy(out.data() + 1, name, n);
+
+    return out;
+}
+
+StreamWriter::StreamWriter(const char* name_, int capacity_, int segmentCapacity_, int slots_)
+    : name(ShmName(name_))
+    , data(NULL)
+    , size(0)
+    , header(NULL)
+    , slotTopology(slots_ > 2 ? slots_ : 2, -1)
+    , warned(false)
+{
+    uint32_t slots = slotTopology.size();
+    uint32_t capacity = capacity_ > 0 ? capacity_ : 0;
+    uint32_t segmentCapacity = segmentCapacity_ > 0 ? segmentCapacity_ : 0;
+
+    size = Round(sizeof(StreamHeader)) + slots*SlotSize(capacity, segmentCapacity);
+
+    // replaces a stream of the same name, usually left behind by a crash
+    shm_unlink(name.data());
+
+    int fd = shm_open(name.data(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) return;
+
+    if (ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        shm_unlink(name.data());
+        return;
+    }
+
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        shm_unlink(name.data());
+        return;
+    }
+
+    data = static_cast<char*>(map);
+
+    // the memory is zero filled, every slot starts without a frame
+    header = new (data) StreamHeader;
+    header->version = streamVersion;
+    header->slots = slots;
+    header->capacity = capacity;
+    header->segmentCapacity = segmentCapacity;
+    header->pad = 0;
+    header->slotSize = SlotSize(capacity, segmentCapacity);
+    header->writer = ((uint64_t) getpid() << 32 ^ std::chrono::steady_clock::now().time_since_epoch().count()) | 1;
+    header->published.store(0, std::memory_order_relaxed);
+    header->closed.store(0, std::memory_order_relaxed);
+
+    for (uint32_t i = 0; i < slots; i++)
+    {
+        StreamFrame* slot = new (data + Round(sizeof(StreamHeader)) + i*header->slotSize) StreamFrame;
+        slot->seq.store(0, std::memory_order_relaxed);
+    }
+
+    // readers check the magic first, it goes in last
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(header->magic, streamMagic, 4);
+}
+
+StreamWriter::~StreamWriter()
+{
+    Close();
+}
+
+bool StreamWriter::Ok() const
+{
+    return header != NULL;
+}
+
+StreamFrame* StreamWriter::Slot(uint64_t frame)
+{
+    return reinterpret_cast<StreamFrame*>(data + Round(sizeof(StreamHeader)) + (frame % header->slots)*header->slotSize);
+}
+
+bool StreamWriter::Publish(const Snapshot& snapshot)
+{
+    if (!header) return false;
+
+    uint32_t segments = snapshot.segments.size();
+
+    if ((uint32_t) snapshot.N > header->capacity || segments > header->segmentCapacity || snapshot.DF > 3)
+    {
+        if (!warned)
+            std::printf("WARNING: %d particles and %u segments do not fit the stream (%u, %u), frames are dropped\n",
+                snapshot.N, segments, header->capacity, header->segmentCapacity);
+
+        warned = true;
+        return false;
+    }
+
+    uint64_t frame = header->published.load(std::memory_order_relaxed);
+    int i = frame % header->slots;
+
+    StreamFrame* slot = Slot(frame);
+    double* pos = reinterpret_cast<double*>(slot + 1);
+    Segment* segs = reinterpret_cast<Segment*>(pos + header->capacity*3);
+
+    slot->seq.store(2*frame + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->N = snapshot.N;
+    slot->DF = snapshot.DF;
+    slot->segments = segments;
+    slot->topology = snapshot.topology;
+    slot->steps = snapshot.steps;
+    slot->time = snapshot.time;
+
+    std::memcpy(pos, snapshot.pos.data(), snapshot.N*snapshot.DF*sizeof(double));
+
+    if (slotTopology[i] != snapshot.topology)
+    {
+        std::memcpy(segs, snapshot.segments.data(), segments*sizeof(Segment));
+        slotTopology[i] = snapshot.topology;
+    }
+
+    slot->seq.store(2*frame + 2, std::memory_order_release);
+    header->published.store(frame + 1, std::memory_order_release);
+
+    return true;
+}
+
+void StreamWriter::Close()
+{
+    if (!header) return;
+
+    header->closed.store(1, std::memory_order_release);
+
+    munmap(data, size);
+    shm_unlink(name.data());
+
+    data = NULL;
+    size = 0;
+    header = NULL;
+}
+
+StreamReader::StreamReader()
+    : data(NULL), size(0), header(NULL), filled(0)
+{
+}
+
+StreamReader::~StreamReader()
+{
+    Close();
+}
+
+bool StreamReader::Open(const char* name)
+{
+    Close();
+
+    std::vector<char> path = ShmName(name);
+
+    int fd = shm_open(path.data(), O_RDONLY, 0);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (std::size_t) st.st_size < sizeof(StreamHeader)) { close(fd); return false; }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) return false;
+
+    data = static_cast<const char*>(map);
+    size = st.st_size;
+
+    const StreamHeader* h = reinterpret_cast<const StreamHeader*>(data);
+
+    bool ok = std::memcmp(h->magic, streamMagic, 4) == 0;
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    ok = ok && h->version == streamVersion && h->slots > 0
+        && h->slotSize == SlotSize(h->capacity, h->segmentCapacity)
+        && size >= Round(sizeof(StreamHeader)) + h->slots*h->slotSize;
+
+    if (!ok)
+    {
+        Close();
+        return false;
+    }
+
+    header = h;
+
+    return true;
+}
+
+void StreamReader::Close()
+{
+    if (data) munmap(const_cast<char*>(data), size);
+
+    data = NULL;
+    size = 0;
+    header = NULL;
+}
+
+uint64_t StreamReader::Published() const
+{
+    return header ? header->published.load(std::memory_order_acquire) : 0;
+}
+
+bool StreamReader::Closed() const
+{
+    return !header || header->closed.load(std::memory_order_acquire) != 0;
+}
+
+const StreamFrame* StreamReader::Slot(uint64_t frame) const
+{
+    return reinterpret_cast<const StreamFrame*>(data + Round(sizeof(StreamHeader)) + (frame % header->slots)*header->slotSize);
+}
+
+bool StreamReader::Get(uint64_t frame, StreamView& view) const
+{
+    if (!header || frame >= Published()) return false;
+
+    const StreamFrame* slot = Slot(frame);
+
+    view.seq = slot->seq.load(std::memory_order_acquire);
+    if (view.seq != 2*frame + 2) return false;
+
+    view.frame = frame;
+    view.writer = header->writer;
+    view.N = slot->N;
+    view.DF = slot->DF;
+    view.segmentCount = slot->segments;
+    view.topology = slot->topology;
+    view.steps = slot->steps;
+    view.time = slot->time;
+
+    view.pos = reinterpret_cast<const double*>(slot + 1);
+    view.segments = reinterpret_cast<const Segment*>(view.pos + header->capacity*3);
+
+    return Valid(view) && (uint32_t) view.N <= header->capacity && (uint32_t) view.segmentCount <= header->segmentCapacity;
+}
+
+bool StreamReader::Latest(StreamView& view) const
+{
+    // the newest slot can be overwritten while it is looked at when the
+    // writer laps the reader, try again with the then newest frame
+    for (int attempt = 0; attempt < 100; attempt++)
+    {
+        uint64_t published = Published();
+        if (published == 0) return false;
+
+        if (Get(published - 1, view)) return true;
+    }
+
+    return false;
+}
+
+bool StreamReader::Valid(const StreamView& view) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return Slot(view.frame)->seq.load(std::memory_order_relaxed) == view.seq;
+}
+
+bool StreamReader::Fill(Snapshot& out)
+{
+    for (int attempt = 0; attempt < 100; attempt++)
+    {
+        StreamView view;
+        if (!Latest(view)) return false;
+
+        out.pos.assign(view.pos, view.pos + view.N*view.DF);
+
+        // a new writer starts counting topologies again
+        bool segments = out.topology != view.topology || filled != view.writer;
+        if (segments) out.segments.assign(view.segments, view.segments + view.segmentCount);
+
+        if (!Valid(view))
+        {
+            out.topology = -1;
+            continue;
+        }
+
+        filled = view.writer;
+
+        out.N = view.N;
+        out.DF = view.DF;
+        out.topology = view.topology;
+        out.steps = view.steps;
+        out.time = view.time;
+
+        for (int i = 0; segments && i < out.segments.size(); i++)
+        {
+            const Segment& s = out.segments[i];
+
+            // drawn as pos[a] and pos[b], never trust them
+            if (s.a < 0 || s.a >= view.N || s.b < -1 || s.b >= view.N)
+            {
+                out.segments.clear();
+                out.topology = -1;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "snapshot.hpp"
+
+// Live state shared with other processes through POSIX shared memory
+// (shm_open, /dev/shm/<name> on Linux), host byte order:
+//
+//   StreamHeader
+//   slots[header.slots], each header.slotSize bytes:
+//     StreamFrame, double pos[capacity*3], Segment segments[segmentCapacity]
+//
+// The writer fills the slots round robin and never waits. Readers map the
+// memory read only, so any number of them can attach and detach without the
+// writer noticing. Every slot is a seqlock: its seq is odd while the slot is
+// being written, readers compare it before and after using the data.
+
+constexpr unsigned streamVersion = 2;
+
+struct StreamHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t slots;
+    uint32_t capacity;        // particles per slot
+    uint32_t segmentCapacity; // segments per slot
+    uint32_t pad;
+    uint64_t slotSize;        // bytes
+    uint64_t writer;          // random per writer, topologies of two writers are unrelated
+
+    std::atomic<uint64_t> published; // frames published so far
+    std::atomic<uint32_t> closed;    // set once the writer is gone
+};
+
+struct StreamFrame
+{
+    std::atomic<uint64_t> seq; // 2*frame + 1 while writing, 2*frame + 2 when complete
+
+    uint32_t N, DF;
+    uint32_t segments;
+    uint32_t pad;
+    int64_t topology;
+    int64_t steps;
+    double time;
+};
+
+// Creates the shared memory and publishes snapshots into it. A name without
+// a leading '/' gets one. Removes the name again when destroyed, attached
+// readers keep their mapping and see the stream as closed.
+class StreamWriter
+{
+public:
+    StreamWriter(const char* name, int capacity_, int segmentCapacity_, int slots_ = 8);
+    ~StreamWriter();
+
+    bool Ok() const;
+
+    // copies the snapshot into the next slot, segments only when the slot
+    // holds an older topology. Snapshots beyond the capacity are dropped
+    // with a warning.
+    bool Publish(const Snapshot& snapshot);
+
+    void Close();
+
+private:
+    StreamFrame* Slot(uint64_t frame);
+
+    std::vector<char> name;
+    char* data;
+    std::size_t size;
+    StreamHeader* header;
+    std::vector<int64_t> slotTopology; // topology of the segments in every slot
+    bool warned;
+};
+
+// A published frame, pos and segments point into the shared memory. The
+// slot may be reused by the writer at any time, use the data and then
+// confirm it with StreamReader::Valid.
+struct StreamView
+{
+    uint64_t frame;
+    uint64_t seq;
+
+    uint64_t writer;
+
+    int N, DF;
+    int segmentCount;
+    long topology;
+    long steps;
+    double time;
+
+    const double* pos;
+    const Segment* segments;
+};
+
+class StreamReader
+{
+public:
+    StreamReader();
+    ~StreamReader();
+
+    bool Open(const char* name);
+    void Close();
+
+    uint64_t Published() const;
+    bool Closed() const;
+
+    // the newest complete frame, false if there is none yet
+    bool Latest(StreamView& view) const;
+
+    // frame number frame, false if it is not published yet or was overwritten
+    bool Get(uint64_t frame, StreamView& view) const;
+
+    // true if the frame of view was not overwritten since Latest or Get
+    bool Valid(const StreamView& view) const;
+
+    // the newest frame copied into out, retried until the copy is consistent.
+    // Segments are copied again when the topology or the writer changed since
+    // the last Fill, false for a frame with segments outside its particles.
+    bool Fill(Snapshot& out);
+
+private:
+    const StreamFrame* Slot(uint64_t frame) const;
+
+    const char* data;
+    std::size_t size;
+    const StreamHeader* header;
+
+    uint64_t filled; // writer of the segments the last Fill copied, 0 for none
+};
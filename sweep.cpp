@@ -0,0 +1,305 @@
+#include "sweep.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <new>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock Clock;
+
+static constexpr double tick = 1.0/60.0;
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "the sweep needs address free 32 bit atomics");
+
+// every entry on its own cache line, workers finishing at the same time do
+// not write to the same line
+struct alignas(64) SweepQueue
+{
+    std::atomic<uint32_t> next; // first variant never handed out
+};
+
+struct alignas(64) SweepEntry
+{
+    std::atomic<uint32_t> status; // SweepStatus, SWEEP_RUNNING + worker slot while running
+    uint32_t attempts;
+    double maxError;
+    double wall;
+    double time;
+};
+
+// CPUs of every NUMA node from sysfs, empty when it is not there
+static std::vector<cpu_set_t> Nodes()
+{
+    std::vector<cpu_set_t> nodes;
+
+    DIR* dir = opendir("/sys/devices/system/node");
+    if (!dir) return nodes;
+
+    std::vector<int> ids;
+
+    while (dirent* e = readdir(dir))
+    {
+        int id;
+        char rest;
+        if (std::sscanf(e->d_name, "node%d%c", &id, &rest) == 1) ids.push_back(id);
+    }
+
+    closedir(dir);
+
+    std::sort(ids.begin(), ids.end());
+
+    for (int id : ids)
+    {
+        char path[64];
+        std::snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+
+        std::FILE* file = std::fopen(path, "r");
+        if (!file) continue;
+
+        char line[1024] = "";
+        bool read = std::fgets(line, sizeof(line), file) != NULL;
+        std::fclose(file);
+
+        if (!read) continue;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+
+        int count = 0;
+
+        // ranges like 0-7,16-23
+        for (char* range = std::strtok(line, ",\n"); range; range = std::strtok(NULL, ",\n"))
+        {
+            int from, to;
+            int n = std::sscanf(range, "%d-%d", &from, &to);
+
+            if (n < 1) continue;
+            if (n == 1) to = from;
+
+            for (int cpu = from; cpu <= to && cpu < CPU_SETSIZE; cpu++, count++)
+                CPU_SET(cpu, &set);
+        }
+
+        // memory only nodes have no CPUs
+        if (count > 0) nodes.push_back(set);
+    }
+
+    return nodes;
+}
+
+// next variant for the worker in slot, -1 when there is none left
+static int Claim(SweepQueue& queue, SweepEntry* entries, int count, int slot)
+{
+    uint32_t running = SWEEP_RUNNING + slot;
+
+    for (uint32_t i = queue.next.fetch_add(1); i < (uint32_t) count; i = queue.next.fetch_add(1))
+    {
+        uint32_t pending = SWEEP_PENDING;
+        if (entries[i].status.compare_exchange_strong(pending, running)) return i;
+    }
+
+    // the queue is drained, pick up variants put back after a crash
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t pending = SWEEP_PENDING;
+        if (entries[i].status.compare_exchange_strong(pending, running)) return i;
+    }
+
+    return -1;
+}
+
+template<typename T, int D>
+static void RunVariant(SceneT<T, D>& scene, const std::vector<T>& springK, const SweepVariant& variant, double seconds, int substeps, SweepEntry& entry, double* state)
+{
+    constexpr int DF = D;
+
+    // the worker owns its copy of the scene, the springs are changed in place
+    int s = 0;
+    scene.elements.template Of<SpringT<T, D>>().ForEach([&](SpringT<T, D>& spring) { spring.k = springK[s++]*variant.k; });
+
+    std::vector<Particle> particles = scene.particles;
+    for (Particle& p : particles) p.m *= variant.mass;
+
+    Clock::time_point start = Clock::now();
+
+    SystemT<T, D> system(particles, scene.elements.forces, scene.elements.constraints);
+
+    int ticks = (int) (seconds/tick + 0.5);
+    double maxError = 0.0;
+
+    for (int t = 0; t < ticks; t++)
+    {
+        system.Step(tick, substeps);
+
+        // a NaN sticks
+        if (std::isnan(system.totalError) || system.totalError > maxError) maxError = system.totalError;
+    }
+
+    entry.wall = std::chrono::duration<double>(Clock::now() - start).count();
+    entry.maxError = maxError;
+    entry.time = system.time;
+
+    for (int i = 0; i < system.N*DF; i++)
+    {
+        state[i] = system.pos.At(i);
+        state[system.N*DF + i] = system.vel.At(i);
+    }
+}
+
+template<typename T, int D>
+bool Sweep(SceneT<T, D>& scene, const std::vector<SweepVariant>& variants, double seconds, int substeps, int workers, std::vector<SweepRun>& out)
+{
+    constexpr int DF = D;
+
+    int count = variants.size();
+    int stateSize = 2*scene.particles.size()*DF;
+
+    workers = std::max(1, std::min(workers, count));
+
+    std::size_t size = sizeof(SweepQueue) + count*sizeof(SweepEntry) + (std::size_t) count*stateSize*sizeof(double);
+
+    // inherited by the workers, zero filled
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return false;
+
+    char* data = static_cast<char*>(map);
+
+    SweepQueue* queue = new (data) SweepQueue;
+    queue->next.store(0, std::memory_order_relaxed);
+
+    SweepEntry* entries = reinterpret_cast<SweepEntry*>(data + sizeof(SweepQueue));
+    for (int i = 0; i < count; i++)
+    {
+        new (&entries[i]) SweepEntry;
+        entries[i].status.store(SWEEP_PENDING, std::memory_order_relaxed);
+        entries[i].attempts = 0;
+    }
+
+    double* states = reinterpret_cast<double*>(entries + count);
+
+    std::vector<T> springK;
+    scene.elements.template Of<SpringT<T, D>>().ForEach([&](const SpringT<T, D>& spring) { springK.push_back(spring.k); });
+
+    std::vector<cpu_set_t> nodes = Nodes();
+
+    std::printf("sweep: %d variants on %d workers over %zu NUMA node%s\n", count, workers, nodes.size(), nodes.size() == 1 ? "" : "s");
+
+    auto spawn = [&](int slot) -> pid_t
+    {
+        // or the child prints whatever the parent had buffered again
+        std::fflush(stdout);
+
+        pid_t pid = fork();
+        if (pid != 0) return pid;
+
+        // the System is built after pinning, so first touch puts it on the node
+        if (!nodes.empty()) sched_setaffinity(0, sizeof(cpu_set_t), &nodes[slot % nodes.size()]);
+
+        int i;
+
+        while ((i = Claim(*queue, entries, count, slot)) >= 0)
+        {
+            entries[i].attempts++;
+
+            RunVariant(scene, springK, variants[i], seconds, substeps, entries[i], states + (std::size_t) i*stateSize);
+
+            entries[i].status.store(SWEEP_DONE, std::memory_order_release);
+        }
+
+        std::fflush(stdout);
+        _exit(0);
+    };
+
+    std::vector<pid_t> pids(workers, -1);
+    int alive = 0;
+
+    for (int w = 0; w < workers; w++)
+    {
+        pids[w] = spawn(w);
+
+        if (pids[w] > 0) alive++;
+        else std::printf("ERROR: could not start worker %d\n", w);
+    }
+
+    while (alive > 0)
+    {
+        int wstatus;
+        pid_t pid = waitpid(-1, &wstatus, 0);
+
+        if (pid < 0) break;
+
+        int slot = std::find(pids.begin(), pids.end(), pid) - pids.begin();
+        if (slot == workers) continue;
+
+        pids[slot] = -1;
+        alive--;
+
+        if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+        {
+            if (WIFSIGNALED(wstatus)) std::printf("WARNING: worker %d (pid %d) died on signal %d\n", slot, (int) pid, WTERMSIG(wstatus));
+            else std::printf("WARNING: worker %d (pid %d) exited with %d\n", slot, (int) pid, WEXITSTATUS(wstatus));
+        }
+
+        // put back what it was running, the others may already be done
+        bool pending = false;
+
+        for (int i = 0; i < count; i++)
+        {
+            uint32_t status = entries[i].status.load(std::memory_order_acquire);
+
+            if (status == SWEEP_RUNNING + (uint32_t) slot)
+            {
+                status = entries[i].attempts < (uint32_t) sweepAttempts ? SWEEP_PENDING : SWEEP_FAILED;
+                entries[i].status.store(status, std::memory_order_release);
+
+                if (status == SWEEP_FAILED) std::printf("WARNING: giving up on variant %d after %u attempts\n", i, entries[i].attempts);
+            }
+
+            if (status == SWEEP_PENDING) pending = true;
+        }
+
+        if (pending)
+        {
+            pids[slot] = spawn(slot);
+
+            if (pids[slot] > 0) alive++;
+            else std::printf("ERROR: could not restart worker %d\n", slot);
+        }
+    }
+
+    out.resize(count);
+
+    for (int i = 0; i < count; i++)
+    {
+        SweepRun& run = out[i];
+        uint32_t status = entries[i].status.load(std::memory_order_acquire);
+
+        run.variant = variants[i];
+        run.status = status == SWEEP_DONE ? SWEEP_DONE : SWEEP_FAILED;
+        run.attempts = entries[i].attempts;
+        run.maxError = entries[i].maxError;
+        run.wall = entries[i].wall;
+        run.time = entries[i].time;
+
+        if (run.status == SWEEP_DONE) run.state.assign(states + (std::size_t) i*stateSize, states + (std::size_t) (i + 1)*stateSize);
+        else run.state.clear();
+    }
+
+    munmap(map, size);
+
+    return true;
+}
+
+template bool Sweep(SceneT<float, 2>&, const std::vector<SweepVariant>&, double, int, int, std::vector<SweepRun>&);
+template bool Sweep(SceneT<double, 2>&, const std::vector<SweepVariant>&, double, int, int, std::vector<SweepRun>&);
+template bool Sweep(SceneT<float, 3>&, const std::vector<SweepVariant>&, double, int, int, std::vector<SweepRun>&);
+template bool Sweep(SceneT<double, 3>&, const std::vector<SweepVariant>&, double, int, int, std::vector<SweepRun>&);
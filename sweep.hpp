@@ -0,0 +1,49 @@
+#pragma once
+
+#include <vector>
+
+#include "scene.hpp"
+
+// Parameter sweep over forked worker processes. Each worker is pinned to
+// the CPUs of one NUMA node (round robin) and builds its Systems after
+// that, so their memory is local to the node. Variants are handed out
+// through a work queue in shared memory and every worker writes the
+// metrics of its runs into a shared result table. A worker that dies is
+// restarted, the variant it was running goes back into the queue and is
+// given up after sweepAttempts tries.
+
+constexpr int sweepAttempts = 3;
+
+// scales applied to the scene as loaded
+struct SweepVariant
+{
+    double k;    // every Spring::k
+    double mass; // every particle mass
+};
+
+enum SweepStatus
+{
+    SWEEP_PENDING = 0,
+    SWEEP_DONE,
+    SWEEP_FAILED,  // its worker died sweepAttempts times
+    SWEEP_RUNNING, // plus the worker slot
+};
+
+struct SweepRun
+{
+    SweepVariant variant;
+    SweepStatus status;
+    int attempts;
+
+    double maxError; // largest totalError after any tick
+    double wall;     // seconds
+    double time;     // simulated
+
+    std::vector<double> state; // N*DF positions, then N*DF velocities
+};
+
+// Steps every variant for the given time at 60 ticks per second with the
+// given substeps. Returns false if the shared memory could not be set up,
+// runs that never finished are reported as SWEEP_FAILED.
+template<typename T, int D>
+bool Sweep(SceneT<T, D>& scene, const std::vector<SweepVariant>& variants, double seconds, int substeps, int workers, std::vector<SweepRun>& out);
@@ -1,107 +1,1032 @@
 #include "system.hpp"
 
+#include <algorithm>
 #include <cmath>
-#include <raylib.h>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <utility>
 
-System::System(const std::vector<Particle>& particles, std::vector<Force*> forces_, std::vector<Constraint*> constraints_)
+#include "profile.hpp"
+
+static const char* solverNames[SOLVER_COUNT] = { "lu", "cholesky", "cg" };
+
+const char* SolverName(Solver solver)
+{
+    return solver >= 0 && solver < SOLVER_COUNT ? solverNames[solver] : "unknown";
+}
+
+Solver SolverByName(const char* name)
+{
+    for (int s = 0; s < SOLVER_COUNT; s++)
+        if (std::strcmp(name, solverNames[s]) == 0) return (Solver) s;
+
+    return SOLVER_COUNT;
+}
+
+// conjugate gradient iterations before an island falls back to LU
+static int IterationLimit(int n)
+{
+    return 2*n + 20;
+}
+
+static double Coord(const Particle& particle, int d)
+{
+    return d == 0 ? particle.x : d == 1 ? particle.y : particle.z;
+}
+
+template<typename T, int D>
+SystemT<T, D>::SystemT(const std::vector<Particle>& particles, std::vector<ForceT<T, D>*> forces_, std::vector<ConstraintT<T, D>*> constraints_)
     : N(particles.size())
-    , DF(2)
     , NC(constraints_.size())
     , NF(forces_.size())
     , pos(N*DF)
     , vel(N*DF)
     , force(N*DF)
     , massInv(N*DF)
-    , W(N*DF, N*DF)
+    , posCarry(compensated ? N*DF : 0)
+    , velCarry(compensated ? N*DF : 0)
     , C(NC)
     , Cd(NC)
+    , l(NC)
     , J(NC, N*DF)
     , Jd(NC, N*DF)
     , ks(0.1)
     , kd(0.1)
+    , regularization(1e-9)
     , forces(forces_)
     , constraints(constraints_)
     , totalError(0.0)
+    , time(0.0)
+    , substeps(0)
+    , topology(0)
+    , recorder(NULL)
+    , redundant(NC, 0)
+    , redundantTolerance(1e-9)
+    , solver(SOLVER_LU)
+    , iterativeTolerance(1e-12)
+    , threads(1)
+    , projection(false)
+    , projectIterations(4)
+    , projectTolerance(1e-6)
+    , projectSolves(0)
+    , projectSteps(0)
+    , sleeping(true)
+    , sleepEnergy(0.5)
+    , sleepError(0.05)
+    , sleepTime(1.0)
+    , wakeAccel(1.0)
 {
     for (int i = 0; i < N; i++)
     {
-        pos.At(i*DF) = particles[i].x;
-        pos.At(i*DF+1) = particles[i].y;
+        for (int d = 0; d < DF; d++)
+        {
+            pos.At(i*DF+d) = Coord(particles[i], d);
+            vel.At(i*DF+d) = 0.0;
+            massInv.At(i*DF+d) = 1.0/particles[i].m;
+        }
+    }
 
-        vel.At(i*DF) = 0.0;
-        vel.At(i*DF+1) = 0.0;
+    ResetConstraints();
+    BuildIslands();
+
+    int dropped = FindRedundant();
+    if (dropped > 0) std::printf("WARNING: %d redundant constraints left out of the solve\n", dropped);
+}
 
-        massInv.At(i*DF) = massInv.At(i*DF+1) = 1.0/particles[i].m;
+template<typename T, int D>
+void SystemT<T, D>::ResetConstraints()
+{
+    C.Zero(); Cd.Zero(); J.Zero(); Jd.Zero();
+}
 
-        W.At(i*DF, i*DF) = W.At(i*DF+1, i*DF+1) = 1.0/particles[i].m;
+static int FindRoot(std::vector<int>& parent, int i)
+{
+    while (parent[i] != i)
+    {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
     }
 
-    ResetConstraints();
+    return i;
+}
+
+template<typename T, int D>
+void SystemT<T, D>::BuildRows(Island& island)
+{
+    island.rows.assign(island.particles.size(), std::vector<int>());
+
+    for (int r = 0; r < island.constraints.size(); r++)
+        for (int p : constraintParticles[island.constraints[r]])
+            island.rows[localOf[p]].push_back(r);
 }
 
-System::~System()
+template<typename T, int D>
+void SystemT<T, D>::BuildIslands()
 {
-    /*
+    constraintParticles.assign(NC, std::vector<int>());
+    for (int i = 0; i < NC; i++)
+        constraints[i]->Particles(constraintParticles[i]);
+
+    forceParticles.assign(NF, std::vector<int>());
     for (int i = 0; i < NF; i++)
-        delete forces[i];
+        forces[i]->Particles(forceParticles[i]);
+
+    islands.clear();
+    islandOf.assign(N, 0);
+    localOf.resize(N);
+
+    if (N == 0) return;
+
+    // start from a single island holding everything and let the split
+    // separate the connected components
+    Island all;
+
+    for (int i = 0; i < N; i++)
+    {
+        localOf[i] = i;
+        all.particles.push_back(i);
+    }
 
     for (int i = 0; i < NC; i++)
-        delete constraints[i];
-        */
+        if (!constraintParticles[i].empty()) all.constraints.push_back(i);
+
+    for (int i = 0; i < NF; i++)
+        if (!forceParticles[i].empty()) all.forces.push_back(i);
+
+    islands.push_back(all);
+    SplitIsland(0);
 }
 
-void System::ResetConstraints()
+template<typename T, int D>
+void SystemT<T, D>::SplitIsland(int i)
 {
-    C.Zero(); Cd.Zero(); J.Zero(); Jd.Zero();
+    Island old = std::move(islands[i]);
+
+    int n = old.particles.size();
+
+    std::vector<int> parent(n);
+    std::iota(parent.begin(), parent.end(), 0);
+
+    auto link = [&](const std::vector<int>& ps)
+    {
+        for (int k = 1; k < ps.size(); k++)
+        {
+            int a = FindRoot(parent, localOf[ps[0]]);
+            int b = FindRoot(parent, localOf[ps[k]]);
+            if (a != b) parent[b] = a;
+        }
+    };
+
+    for (int c : old.constraints) link(constraintParticles[c]);
+    for (int f : old.forces) link(forceParticles[f]);
+
+    // the first component reuses slot i, the others are appended
+    std::vector<int> target(n, -1);
+
+    islands[i] = Island();
+
+    for (int k = 0; k < n; k++)
+    {
+        int root = FindRoot(parent, k);
+
+        if (target[root] == -1)
+        {
+            if (root == FindRoot(parent, 0))
+            {
+                target[root] = i;
+            }
+            else
+            {
+                target[root] = islands.size();
+                islands.push_back(Island());
+            }
+        }
+
+        int p = old.particles[k];
+        Island& island = islands[target[root]];
+
+        islandOf[p] = target[root];
+        localOf[p] = island.particles.size();
+        island.particles.push_back(p);
+    }
+
+    for (int c : old.constraints)
+        islands[islandOf[constraintParticles[c][0]]].constraints.push_back(c);
+
+    for (int f : old.forces)
+        islands[islandOf[forceParticles[f][0]]].forces.push_back(f);
+
+    for (int k = 0; k < n; k++)
+        if (FindRoot(parent, k) == k) BuildRows(islands[target[k]]);
 }
 
-void System::Step(double dt, int steps)
+template<typename T, int D>
+int SystemT<T, D>::MergeIslands(int a, int b)
 {
-    for (int step = 0; step < steps; step++)
+    if (a == b) return a;
+
+    // move the smaller island into the larger one
+    if (islands[a].particles.size() < islands[b].particles.size()) std::swap(a, b);
+
+    Island& dst = islands[a];
+    Island& src = islands[b];
+
+    for (int p : src.particles)
     {
-        force.Zero();
+        islandOf[p] = a;
+        localOf[p] = dst.particles.size();
+        dst.particles.push_back(p);
+    }
 
-        for (int i = 0; i < NF; i++)
-            forces[i]->Apply(*this);
+    dst.constraints.insert(dst.constraints.end(), src.constraints.begin(), src.constraints.end());
+    dst.forces.insert(dst.forces.end(), src.forces.begin(), src.forces.end());
+
+    BuildRows(dst);
 
-        // Constraints
+    dst.asleep = false;
+    dst.idle = 0.0;
+
+    RemoveIsland(b);
+
+    // a was the last island and got moved into b
+    return a == islands.size() ? b : a;
+}
+
+template<typename T, int D>
+void SystemT<T, D>::RemoveIsland(int i)
+{
+    int last = islands.size() - 1;
+
+    if (i != last)
+    {
+        islands[i] = std::move(islands[last]);
+
+        for (int p : islands[i].particles)
+            islandOf[p] = i;
+    }
+
+    islands.pop_back();
+}
+
+static void Replace(std::vector<int>& v, int from, int to)
+{
+    for (int& x : v)
+        if (x == from) x = to;
+}
+
+static void Erase(std::vector<int>& v, int x)
+{
+    for (int k = 0; k < v.size(); k++)
+    {
+        if (v[k] == x)
         {
-            ResetConstraints();
+            v.erase(v.begin() + k);
+            return;
+        }
+    }
+}
 
-            for (int i = 0; i < NC; i++)
+template<typename T, int D>
+int SystemT<T, D>::AddParticle(const Particle& particle)
+{
+    topology++;
+
+    int p = N++;
+
+    pos.Resize(N*DF);
+    vel.Resize(N*DF);
+    force.Resize(N*DF);
+    massInv.Resize(N*DF);
+
+    if (compensated)
+    {
+        posCarry.Resize(N*DF);
+        velCarry.Resize(N*DF);
+    }
+
+    J.SetCols(N*DF);
+    Jd.SetCols(N*DF);
+
+    for (int d = 0; d < DF; d++)
+    {
+        pos.At(p*DF+d) = Coord(particle, d);
+        vel.At(p*DF+d) = 0.0;
+        massInv.At(p*DF+d) = 1.0/particle.m;
+    }
+
+    islandOf.push_back(islands.size());
+    localOf.push_back(0);
+
+    Island island;
+    island.particles.push_back(p);
+    island.rows.emplace_back();
+    islands.push_back(island);
+
+    return p;
+}
+
+template<typename T, int D>
+int SystemT<T, D>::AddForce(ForceT<T, D>* f)
+{
+    topology++;
+
+    int i = NF++;
+
+    forces.push_back(f);
+    forceParticles.emplace_back();
+    f->Particles(forceParticles[i]);
+
+    const std::vector<int>& ps = forceParticles[i];
+
+    if (!ps.empty())
+    {
+        int island = islandOf[ps[0]];
+        for (int p : ps)
+            island = MergeIslands(island, islandOf[p]);
+
+        islands[island].forces.push_back(i);
+        Wake(ps[0]);
+    }
+
+    return i;
+}
+
+template<typename T, int D>
+int SystemT<T, D>::AddConstraint(ConstraintT<T, D>* c)
+{
+    topology++;
+
+    int i = NC++;
+
+    constraints.push_back(c);
+    constraintParticles.emplace_back();
+    c->Particles(constraintParticles[i]);
+
+    C.Resize(NC);
+    Cd.Resize(NC);
+    l.Resize(NC);
+    J.AddRow();
+    Jd.AddRow();
+    redundant.push_back(0);
+
+    const std::vector<int>& ps = constraintParticles[i];
+
+    if (!ps.empty())
+    {
+        int island = islandOf[ps[0]];
+        for (int p : ps)
+            island = MergeIslands(island, islandOf[p]);
+
+        Island& dst = islands[island];
+
+        int r = dst.constraints.size();
+        dst.constraints.push_back(i);
+
+        for (int p : ps)
+            dst.rows[localOf[p]].push_back(r);
+
+        Wake(ps[0]);
+    }
+
+    return i;
+}
+
+template<typename T, int D>
+ForceT<T, D>* SystemT<T, D>::RemoveForce(int i)
+{
+    topology++;
+
+    ForceT<T, D>* f = forces[i];
+
+    int island = forceParticles[i].empty() ? -1 : islandOf[forceParticles[i][0]];
+    if (island != -1) Erase(islands[island].forces, i);
+
+    int last = NF - 1;
+
+    if (i != last)
+    {
+        forces[i] = forces[last];
+        forceParticles[i] = std::move(forceParticles[last]);
+
+        if (!forceParticles[i].empty())
+            Replace(islands[islandOf[forceParticles[i][0]]].forces, last, i);
+    }
+
+    forces.pop_back();
+    forceParticles.pop_back();
+    NF--;
+
+    if (island != -1) SplitIsland(island);
+
+    return f;
+}
+
+template<typename T, int D>
+ConstraintT<T, D>* SystemT<T, D>::RemoveConstraint(int i)
+{
+    topology++;
+
+    ConstraintT<T, D>* c = constraints[i];
+
+    int island = constraintParticles[i].empty() ? -1 : islandOf[constraintParticles[i][0]];
+    if (island != -1) Erase(islands[island].constraints, i);
+
+    int last = NC - 1;
+
+    if (i != last)
+    {
+        constraints[i] = constraints[last];
+        constraintParticles[i] = std::move(constraintParticles[last]);
+
+        C.At(i) = C.At(last);
+        Cd.At(i) = Cd.At(last);
+        l.At(i) = l.At(last);
+        redundant[i] = redundant[last];
+
+        if (!constraintParticles[i].empty())
+            Replace(islands[islandOf[constraintParticles[i][0]]].constraints, last, i);
+    }
+
+    J.SwapRemoveRow(i);
+    Jd.SwapRemoveRow(i);
+
+    constraints.pop_back();
+    constraintParticles.pop_back();
+    redundant.pop_back();
+    NC--;
+
+    C.Resize(NC);
+    Cd.Resize(NC);
+    l.Resize(NC);
+
+    if (island != -1) SplitIsland(island);
+
+    return c;
+}
+
+static bool Contains(const std::vector<int>& v, int x)
+{
+    for (int y : v)
+        if (y == x) return true;
+
+    return false;
+}
+
+template<typename T, int D>
+void SystemT<T, D>::RemoveParticle(int p, std::vector<ForceT<T, D>*>& removedForces, std::vector<ConstraintT<T, D>*>& removedConstraints)
+{
+    topology++;
+
+    // detach everything that references p, this leaves p in an island of its own
+    for (bool found = true; found;)
+    {
+        found = false;
+
+        for (int c : islands[islandOf[p]].constraints)
+        {
+            if (Contains(constraintParticles[c], p))
+            {
+                removedConstraints.push_back(RemoveConstraint(c));
+                found = true;
+                break;
+            }
+        }
+
+        for (int f : islands[islandOf[p]].forces)
+        {
+            if (Contains(forceParticles[f], p))
             {
-                constraints[i]->C(*this, i);
-                constraints[i]->Cd(*this, i);
-                constraints[i]->J(*this, i);
-                constraints[i]->Jd(*this, i);
+                removedForces.push_back(RemoveForce(f));
+                found = true;
+                break;
             }
+        }
+    }
 
-            // (J*W*Jt) * l = -Jd*qd - J*W*Q - ks*C - kd * Cd
+    RemoveIsland(islandOf[p]);
 
-            // J*W*Jt
-            Mat Jt(J); Jt.Transpose();
-            Mat A = J*W*Jt;
+    // move the last particle into the free slot
+    int last = N - 1;
 
-            // Jd*qd
-            Vec Jdqd = Jd*vel;
+    if (p != last)
+    {
+        for (int d = 0; d < DF; d++)
+        {
+            pos.At(p*DF + d) = pos.At(last*DF + d);
+            vel.At(p*DF + d) = vel.At(last*DF + d);
+            force.At(p*DF + d) = force.At(last*DF + d);
+            massInv.At(p*DF + d) = massInv.At(last*DF + d);
+
+            if (compensated)
+            {
+                posCarry.At(p*DF + d) = posCarry.At(last*DF + d);
+                velCarry.At(p*DF + d) = velCarry.At(last*DF + d);
+            }
+        }
 
-            // J*W*Q
-            Vec JWQ = J*W*force;
+        islandOf[p] = islandOf[last];
+        localOf[p] = localOf[last];
 
-            // -Jdqd - JWQ - ks*C - kd*Cd
-            Vec b = -1.0*Jdqd + -1.0*JWQ + -1.0*(ks*C) + -1.0*(kd*Cd);
+        Island& island = islands[islandOf[p]];
+        island.particles[localOf[p]] = p;
 
-            // Solve A*l=b
-            Vec l = Mat::Solve(A, b);
+        for (int c : island.constraints)
+        {
+            if (!Contains(constraintParticles[c], last)) continue;
 
-            // Qh = Jt*l
-            Vec Qh = Jt*l;
+            constraints[c]->Remap(last, p);
+            Replace(constraintParticles[c], last, p);
 
-            // force + Qh
-            force += Qh;
+            // the old columns are gone, the pattern is rebuilt on the next evaluation
+            J.ClearRow(c);
+            Jd.ClearRow(c);
         }
 
-        Vec acl = force*massInv;
+        for (int f : island.forces)
+        {
+            if (!Contains(forceParticles[f], last)) continue;
+
+            forces[f]->Remap(last, p);
+            Replace(forceParticles[f], last, p);
+        }
+    }
+
+    N--;
+
+    pos.Resize(N*DF);
+    vel.Resize(N*DF);
+    force.Resize(N*DF);
+    massInv.Resize(N*DF);
+
+    if (compensated)
+    {
+        posCarry.Resize(N*DF);
+        velCarry.Resize(N*DF);
+    }
+
+    J.SetCols(N*DF);
+    Jd.SetCols(N*DF);
+
+    islandOf.pop_back();
+    localOf.pop_back();
+}
+
+template<typename T, int D>
+void SystemT<T, D>::Wake(int particle)
+{
+    Island& island = islands[islandOf[particle]];
+
+    island.asleep = false;
+    island.idle = 0.0;
+}
+
+template<typename T, int D>
+void SystemT<T, D>::WakeAll()
+{
+    for (Island& island : islands)
+    {
+        island.asleep = false;
+        island.idle = 0.0;
+    }
+}
+
+template<typename T, int D>
+int SystemT<T, D>::AwakeIslands() const
+{
+    int count = 0;
+    for (const Island& island : islands)
+        if (!island.asleep) count++;
+
+    return count;
+}
+
+template<typename T, int D>
+bool SystemT<T, D>::Disturbed(const Island& island) const
+{
+    for (int i = 0; i < island.particles.size(); i++)
+    {
+        for (int d = 0; d < DF; d++)
+        {
+            int k = island.particles[i]*DF + d;
+            if (std::abs(force.At(k) - island.restForce[i*DF + d])*massInv.At(k) > wakeAccel)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+template<typename T, int D>
+void SystemT<T, D>::Sleep(Island& island)
+{
+    island.asleep = true;
+    island.energy = 0.0;
+
+    for (int p : island.particles)
+        for (int d = 0; d < DF; d++)
+        {
+            vel.At(p*DF + d) = 0.0;
+            if (compensated) velCarry.At(p*DF + d) = 0.0;
+        }
+
+    // captured at the start of the next step, once only applied forces are in force
+    island.restForce.clear();
+}
+
+template<typename T, int D>
+void SystemT<T, D>::AssembleJWJt(const Island& island, Mat& A) const
+{
+    for (int i = 0; i < island.particles.size(); i++)
+    {
+        const std::vector<int>& rows = island.rows[i];
+
+        for (int d = 0; d < DF; d++)
+        {
+            int k = island.particles[i]*DF + d;
+            double w = massInv.At(k);
+
+            for (int r : rows)
+                for (int s : rows)
+                    A.At(r, s) += J.At(island.constraints[r], k)*w*J.At(island.constraints[s], k);
+        }
+    }
+}
+
+template<typename T, int D>
+void SystemT<T, D>::Assemble(Island& island, Mat& A, Vec& b)
+{
+    int n = island.constraints.size();
+
+    for (int r = 0; r < n; r++)
+    {
+        int c = island.constraints[r];
+
+        double Jdqd = 0.0;
+        double JWQ = 0.0;
+
+        for (int p : constraintParticles[c])
+        {
+            for (int d = 0; d < DF; d++)
+            {
+                int k = p*DF + d;
+                Jdqd += Jd.At(c, k)*vel.At(k);
+                JWQ += J.At(c, k)*massInv.At(k)*force.At(k);
+            }
+        }
+
+        b.At(r) = -Jdqd - JWQ - ks*C.At(c) - kd*Cd.At(c);
+
+        island.error += std::abs(C.At(c));
+        island.drift += std::abs(Cd.At(c));
+    }
+
+    AssembleJWJt(island, A);
+
+    double largest = 0.0;
+
+    for (int r = 0; r < n; r++)
+    {
+        // decouple redundant rows, their multiplier solves to 0
+        if (redundant[island.constraints[r]])
+        {
+            for (int s = 0; s < n; s++)
+                A.At(r, s) = A.At(s, r) = 0.0;
+
+            A.At(r, r) = 1.0;
+            b.At(r) = 0.0;
+        }
+
+        largest = std::max(largest, A.At(r, r));
+    }
+
+    // all zero when every constraint is a hold exactly at its target, the
+    // multipliers then solve to 0
+    if (largest == 0.0) largest = 1.0;
+
+    for (int r = 0; r < n; r++)
+        A.At(r, r) += regularization*largest;
+}
+
+// Cholesky of J*W*Jt in constraint order, a row whose pivot is a tiny
+// fraction of its diagonal lies in the span of the rows before it. Rows that
+// are all zero (degenerate, not dependent) are skipped.
+template<typename T, int D>
+int SystemT<T, D>::FindRedundant(Island& island)
+{
+    int n = island.constraints.size();
+
+    for (int c : island.constraints)
+    {
+        constraints[c]->J(*this, c);
+        redundant[c] = 0;
+    }
+
+    Mat A(n, n);
+    AssembleJWJt(island, A);
+
+    // lower triangle of the factor, only columns of kept rows are filled
+    Mat L(n, n);
+    std::vector<int> kept;
+
+    int count = 0;
+
+    for (int r = 0; r < n; r++)
+    {
+        double diag = A.At(r, r);
+        if (diag == 0.0) continue;
+
+        for (int j : kept)
+        {
+            double sum = A.At(r, j);
+            for (int k : kept)
+            {
+                if (k == j) break;
+                sum -= L.At(r, k)*L.At(j, k);
+            }
+
+            L.At(r, j) = sum/L.At(j, j);
+        }
+
+        double pivot = diag;
+        for (int k : kept)
+            pivot -= L.At(r, k)*L.At(r, k);
+
+        if (pivot <= redundantTolerance*diag)
+        {
+            redundant[island.constraints[r]] = 1;
+            count++;
+            continue;
+        }
+
+        L.At(r, r) = std::sqrt(pivot);
+        kept.push_back(r);
+    }
+
+    return count;
+}
+
+template<typename T, int D>
+int SystemT<T, D>::FindRedundant()
+{
+    int count = 0;
+
+    for (Island& island : islands)
+        count += FindRedundant(island);
+
+    return count;
+}
+
+template<typename T, int D>
+void SystemT<T, D>::SolveIsland(Island& island)
+{
+    int n = island.constraints.size();
+
+    island.error = island.drift = 0.0;
+
+    if (n == 0) return;
+
+    PROFILE_COUNT(COUNTER_SOLVES, 1);
+
+    {
+        PROFILE_SCOPE(PHASE_CONSTRAINTS);
+
+        for (int c : island.constraints)
+        {
+            constraints[c]->C(*this, c);
+            constraints[c]->Cd(*this, c);
+            constraints[c]->J(*this, c);
+            constraints[c]->Jd(*this, c);
+        }
+    }
+
+    // (J*W*Jt) * l = -Jd*qd - J*W*Q - ks*C - kd*Cd
+    // restricted to the island, W is diagonal so only constraints sharing a
+    // particle produce a non zero entry in J*W*Jt
+
+    island.lu = Mat(n, n);
+    Vec b(n);
+
+    {
+        PROFILE_SCOPE(PHASE_ASSEMBLY);
+        Assemble(island, island.lu, b);
+    }
+
+    // Solve A*l=b, zeros if singular
+    Vec x(n);
+    {
+        PROFILE_SCOPE(PHASE_SOLVE);
+
+        island.method = solver;
+
+        if (solver == SOLVER_CG)
+        {
+            for (int r = 0; r < n; r++)
+                x.At(r) = l.At(island.constraints[r]);
+
+            island.factored = island.lu.SolveIterative(b, x, iterativeTolerance, IterationLimit(n)) < IterationLimit(n);
+
+            // too ill conditioned for the iteration, A is still intact
+            if (!island.factored) island.method = SOLVER_LU;
+        }
+
+        if (island.method == SOLVER_CHOLESKY)
+        {
+            island.factored = island.lu.FactorCholesky();
+            if (island.factored) x = island.lu.SolveCholesky(b);
+
+            // not positive definite after all, the factorization overwrote
+            // part of A so assemble it again for LU
+            if (!island.factored)
+            {
+                island.error = island.drift = 0.0;
+                island.lu = Mat(n, n);
+                Assemble(island, island.lu, b);
+                island.method = SOLVER_LU;
+            }
+        }
+
+        if (island.method == SOLVER_LU)
+        {
+            x.Zero();
+            island.factored = island.lu.Factor(island.pivots);
+            if (island.factored) x = island.lu.SolveFactored(island.pivots, b);
+        }
+    }
+
+    // force + Jt*l
+    for (int r = 0; r < n; r++)
+    {
+        int c = island.constraints[r];
+        l.At(c) = x.At(r);
+
+        for (int p : constraintParticles[c])
+            for (int d = 0; d < DF; d++)
+                force.At(p*DF + d) += J.At(c, p*DF + d)*l.At(c);
+    }
+}
+
+// solves with the matrix of the last SolveIsland of the island
+template<typename T, int D>
+Vec SystemT<T, D>::SolveFactored(const Island& island, const Vec& rhs) const
+{
+    int n = island.constraints.size();
+
+    switch (island.method)
+    {
+        case SOLVER_CHOLESKY:
+            return island.lu.SolveCholesky(rhs);
+
+        case SOLVER_CG:
+        {
+            Vec x(n);
+            x.Zero();
+            island.lu.SolveIterative(rhs, x, iterativeTolerance, IterationLimit(n));
+            return x;
+        }
+
+        default:
+            return island.lu.SolveFactored(island.pivots, rhs);
+    }
+}
+
+// q -= W*Jt*dl over the constraints of the island
+template<typename T, int D>
+void SystemT<T, D>::Correct(const Island& island, const Vec& dl, VecT<T>& q)
+{
+    for (int r = 0; r < island.constraints.size(); r++)
+    {
+        int c = island.constraints[r];
+
+        for (int p : constraintParticles[c])
+        {
+            for (int d = 0; d < DF; d++)
+            {
+                int k = p*DF + d;
+                q.At(k) -= massInv.At(k)*J.At(c, k)*dl.At(r);
+            }
+        }
+    }
+}
+
+// Chord Newton on C(q) = 0 with the J and the factorization of J*W*Jt from
+// the solve of this substep, then one exact projection of the velocities
+// onto J*v = 0 for that J. Refreshing J without refactoring diverges once a
+// direction flips (a hold crossing its target). Zero and redundant rows have
+// no usable pivot and are left alone.
+template<typename T, int D>
+void SystemT<T, D>::Project(Island& island)
+{
+    int n = island.constraints.size();
+
+    if (n == 0 || !island.factored) return;
+
+    PROFILE_SCOPE(PHASE_PROJECT);
+
+    projectSolves++;
+
+    std::vector<char> skip(n);
+
+    for (int r = 0; r < n; r++)
+    {
+        int c = island.constraints[r];
+        skip[r] = redundant[c];
+
+        bool zero = true;
+        for (const std::pair<int, T>& e : J.rows[c])
+            if (e.second != 0.0) zero = false;
+
+        if (zero) skip[r] = 1;
+    }
+
+    Vec rhs(n);
+    double last = 0.0;
+
+    for (int it = 0; it < projectIterations; it++)
+    {
+        double worst = 0.0;
+
+        for (int r = 0; r < n; r++)
+        {
+            int c = island.constraints[r];
+            constraints[c]->C(*this, c);
+
+            rhs.At(r) = skip[r] ? 0.0 : (double) C.At(c);
+            worst = std::max(worst, std::abs(rhs.At(r)));
+        }
+
+        // done, or stalled on the part of C the old J cannot see
+        if (worst <= projectTolerance || (it > 0 && worst > 0.5*last)) break;
+        last = worst;
+
+        Correct(island, SolveFactored(island, rhs), pos);
+
+        projectSteps++;
+        PROFILE_COUNT(COUNTER_PROJECTIONS, 1);
+    }
+
+    for (int r = 0; r < n; r++)
+    {
+        int c = island.constraints[r];
+        double Jv = 0.0;
+
+        if (!skip[r])
+        {
+            for (int p : constraintParticles[c])
+                for (int d = 0; d < DF; d++)
+                    Jv += J.At(c, p*DF + d)*vel.At(p*DF + d);
+        }
+
+        rhs.At(r) = Jv;
+    }
+
+    Correct(island, SolveFactored(island, rhs), vel);
+}
+
+template<typename T, int D>
+void SystemT<T, D>::Step(double dt, int steps)
+{
+    double h = dt/steps;
+
+    for (int step = 0; step < steps; step++)
+    {
+        PROFILE_SCOPE(PHASE_STEP);
+        PROFILE_COUNT(COUNTER_SUBSTEPS, 1);
+
+        force.Zero();
+
+        {
+            PROFILE_SCOPE(PHASE_FORCES);
+
+            for (int i = 0; i < NF; i++)
+                forces[i]->Apply(*this);
+        }
+
+        if (sleeping)
+        {
+            for (int i = 0; i < islands.size(); i++)
+            {
+                Island& island = islands[i];
+
+                if (!island.asleep) continue;
+
+                if (island.restForce.empty())
+                {
+                    for (int p : island.particles)
+                        for (int d = 0; d < DF; d++)
+                            island.restForce.push_back(force.At(p*DF + d));
+                }
+                else if (Disturbed(island))
+                {
+                    Wake(island.particles[0]);
+                }
+            }
+        }
+
+        // Constraints, islands share no rows or particles
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(threads) if(threads > 1)
+        for (int i = 0; i < (int) islands.size(); i++)
+            if (!islands[i].asleep) SolveIsland(islands[i]);
 
         // TODO: rk4 integrator
 
@@ -131,22 +1056,107 @@ void System::Step(double dt, int steps)
             }
         */
 
-        vel += acl*(dt/steps);
-        pos += vel*(dt/steps);
+        PROFILE_SCOPE(PHASE_INTEGRATE);
+
+        time += h;
+        substeps++;
 
         totalError = 0.0;
-        for (int i = 0; i < NC; i++)
-            totalError += std::abs(C.At(i));
+
+        for (Island& island : islands)
+        {
+            totalError += island.error;
+
+            if (island.asleep) continue;
+
+            double energy = 0.0;
+            double mass = 0.0;
+
+            for (int p : island.particles)
+            {
+                for (int d = 0; d < DF; d++)
+                {
+                    int k = p*DF + d;
+
+                    if (compensated)
+                    {
+                        T dv = force.At(k)*massInv.At(k)*h - velCarry.At(k);
+                        T v = vel.At(k) + dv;
+                        velCarry.At(k) = (v - vel.At(k)) - dv;
+                        vel.At(k) = v;
+
+                        T dx = vel.At(k)*h - posCarry.At(k);
+                        T x = pos.At(k) + dx;
+                        posCarry.At(k) = (x - pos.At(k)) - dx;
+                        pos.At(k) = x;
+                    }
+                    else
+                    {
+                        vel.At(k) += force.At(k)*massInv.At(k)*h;
+                        pos.At(k) += vel.At(k)*h;
+                    }
+                }
+            }
+
+            if (projection) Project(island);
+
+            for (int p : island.particles)
+            {
+                for (int d = 0; d < DF; d++)
+                {
+                    int k = p*DF + d;
+                    energy += 0.5*vel.At(k)*vel.At(k)/massInv.At(k);
+                }
+
+                mass += 1.0/massInv.At(p*DF);
+            }
+
+            island.energy = energy/mass;
+
+            if (!sleeping) continue;
+
+            double limit = sleepError*island.constraints.size();
+
+            if (island.energy < sleepEnergy && island.error <= limit && island.drift <= limit)
+            {
+                island.idle += h;
+                if (island.idle >= sleepTime) Sleep(island);
+            }
+            else
+            {
+                island.idle = 0.0;
+            }
+        }
+
+        if (recorder && substeps % recorder->interval == 0)
+            recorder->Capture(*this);
     }
 }
 
-void System::Draw()
+template<typename T, int D>
+void SystemT<T, D>::Publish(Snapshot& out) const
 {
-    for (int i = 0; i < N; i++) DrawCircle(pos.At(i*DF), pos.At(i*DF+1), 20, RED);
+    out.N = N;
+    out.DF = DF;
+    out.pos.assign(pos.buf.begin(), pos.buf.end());
+    out.steps = substeps;
+    out.time = time;
 
-    for (int i = 0; i < NF; i++)
-        forces[i]->Draw(*this);
+    if (out.topology != topology)
+    {
+        out.segments.clear();
 
-    for (int i = 0; i < NC; i++)
-        constraints[i]->Draw(*this);
+        for (int i = 0; i < NF; i++)
+            forces[i]->Segments(out.segments);
+
+        for (int i = 0; i < NC; i++)
+            constraints[i]->Segments(out.segments);
+
+        out.topology = topology;
+    }
 }
+
+template struct SystemT<float, 2>;
+template struct SystemT<double, 2>;
+template struct SystemT<float, 3>;
+template struct SystemT<double, 3>;
@@ -6,46 +6,200 @@
 
 #include "forces.hpp"
 #include "constraints.hpp"
+#include "snapshot.hpp"
+#include "trace.hpp"
 
 struct Particle
 {
     double x;
     double y;
     double m;
+    double z = 0.0; // only read by 3D systems
 };
 
-struct System
+// How the J*W*Jt system of every island is solved, Tune in tune.hpp picks
+// one per scene
+enum Solver
 {
-    const int N;
-    const int DF;
-    const int NC;
-    const int NF;
-
-    Vec pos;
-    Vec vel;
-    Vec force;
-    Vec massInv;
-    Mat W;
-
-    Vec C;
-    Vec Cd;
-    Mat J;
-    Mat Jd;
+    SOLVER_LU = 0,   // dense LU with partial pivoting
+    SOLVER_CHOLESKY, // dense Cholesky, J*W*Jt is positive definite once regularized
+    SOLVER_CG,       // conjugate gradient warm started from the last multipliers
+    SOLVER_COUNT,
+};
+
+const char* SolverName(Solver solver);
+
+// SOLVER_COUNT if name is not a solver
+Solver SolverByName(const char* name);
+
+// A group of particles connected through constraints or springs. Islands do
+// not interact through the solver, so each one is solved on its own and can
+// be put to sleep once it has come to rest.
+struct Island
+{
+    std::vector<int> particles;
+    std::vector<int> constraints;
+    std::vector<int> forces; // forces that link particles of this island
+
+    // for every entry of particles, the local rows (index into constraints)
+    // that touch it; only those pairs contribute to J*W*Jt
+    std::vector<std::vector<int>> rows;
+
+    double energy = 0.0; // kinetic energy per unit mass
+    double error = 0.0;  // sum of |C| over the island, same metric as totalError
+    double drift = 0.0;  // sum of |Cd| over the island
+
+    double idle = 0.0;   // time spent below the sleep thresholds
+    bool asleep = false;
+
+    // applied forces at the time the island fell asleep
+    std::vector<double> restForce;
+
+    // factorization of the last J*W*Jt (J*W*Jt itself for SOLVER_CG),
+    // reused by the projection of the same substep
+    Mat lu = Mat(0, 0);
+    std::vector<int> pivots;
+    bool factored = false;
+    Solver method = SOLVER_LU; // that lu is for, SOLVER_CG falls back to LU
+};
+
+// T is the scalar of the particle state, the Jacobians and the element
+// evaluation, D the dimension (2 or 3). DF is a compile time constant so the
+// per particle loops unroll.
+//
+// The per island J*W*Jt system is always assembled and solved in double, a
+// float System only stores and evaluates in float.
+template<typename T, int D>
+struct SystemT
+{
+    int N;
+    static constexpr int DF = D; // degrees of freedom per particle
+    int NC;
+    int NF;
+
+    VecT<T> pos;
+    VecT<T> vel;
+    VecT<T> force;
+    VecT<T> massInv;
+
+    // rounding error of the last pos and vel update, carried into the next
+    // one (Kahan summation). Tiny substeps vanish against float positions
+    // without it, only sized when T is narrower than double.
+    static constexpr bool compensated = sizeof(T) < sizeof(double);
+    VecT<T> posCarry;
+    VecT<T> velCarry;
+
+    VecT<T> C;
+    VecT<T> Cd;
+    VecT<T> l; // lagrange multipliers of the last solve
+    SparseMatT<T> J;
+    SparseMatT<T> Jd;
 
     const double ks;
     const double kd;
 
-    std::vector<Force*> forces;
-    std::vector<Constraint*> constraints;
+    // J*W*Jt + eps*I with eps = regularization times the largest diagonal
+    // entry of the island, keeps the solve well conditioned when constraints
+    // become dependent after construction or degenerate (a hold exactly at
+    // its target has a zero Jacobian row)
+    double regularization;
+
+    std::vector<ForceT<T, D>*> forces;
+    std::vector<ConstraintT<T, D>*> constraints;
 
     double totalError;
 
-    System(const std::vector<Particle>& particles, std::vector<Force*> forces_, std::vector<Constraint*> constraints_);
-    ~System();
+    double time;   // simulated time
+    long substeps; // substeps taken so far
+    long topology; // bumped on every add or remove
+
+    Recorder* recorder; // captures every recorder->interval substeps when set
+
+    std::vector<Island> islands;
+    std::vector<int> islandOf; // island index of every particle
+    std::vector<int> localOf;  // index of every particle inside its island
+    std::vector<std::vector<int>> constraintParticles;
+    std::vector<std::vector<int>> forceParticles;
+
+    // per constraint, set for constraints that are linearly dependent on
+    // earlier ones of their island; they keep a zero multiplier
+    std::vector<char> redundant;
+    double redundantTolerance; // relative, on the squared norm of a row of J*sqrt(W)
+
+    Solver solver;
+    double iterativeTolerance; // relative residual that ends SOLVER_CG
+
+    // islands solved at once with OpenMP, 1 solves them in order on the
+    // calling thread
+    int threads;
+
+    // After integrating, move every awake island back onto C=0 with a few
+    // Newton iterations and remove the velocity along J. The iterations use
+    // J and the factorization of the solve of the same substep, so they
+    // converge linearly but cost only a back substitution each.
+    bool projection;
+    int projectIterations;   // at most, per island and substep
+    double projectTolerance; // largest |C| that ends the iteration
+    long projectSolves;      // islands projected so far
+    long projectSteps;       // Newton iterations so far
+
+    bool sleeping;
+    double sleepEnergy; // kinetic energy per unit mass
+    double sleepError;  // mean |C| and |Cd| per constraint
+    double sleepTime;   // seconds below the thresholds before freezing
+    double wakeAccel;   // change in applied acceleration that wakes an island
+
+    // forces and constraints are borrowed, usually from an ElementsT that
+    // has to outlive the system
+    SystemT(const std::vector<Particle>& particles, std::vector<ForceT<T, D>*> forces_, std::vector<ConstraintT<T, D>*> constraints_);
 
     void ResetConstraints();
 
+    // Topology changes, the system does not take ownership of forces and
+    // constraints. Removal swaps the last element into the freed index, so
+    // indices of the last particle, force or constraint change.
+    int AddParticle(const Particle& particle);
+    int AddForce(ForceT<T, D>* f);
+    int AddConstraint(ConstraintT<T, D>* c);
+
+    ForceT<T, D>* RemoveForce(int i);
+    ConstraintT<T, D>* RemoveConstraint(int i);
+    void RemoveParticle(int p, std::vector<ForceT<T, D>*>& removedForces, std::vector<ConstraintT<T, D>*>& removedConstraints);
+
+    void BuildIslands();
+
+    // Flags constraints whose Jacobian row is a combination of the rows of
+    // earlier constraints at the current positions, done once on
+    // construction. Call again after edits that may add redundancy. Returns
+    // the number of redundant constraints.
+    int FindRedundant();
+    void Wake(int particle);
+    void WakeAll();
+    int AwakeIslands() const;
+
     void Step(double dt, int steps);
 
-    void Draw();
+    // copy the drawable state into out, segments are only rebuilt when the
+    // topology changed since out was last filled
+    void Publish(Snapshot& out) const;
+
+private:
+    int MergeIslands(int a, int b);
+    void SplitIsland(int i);
+    void RemoveIsland(int i);
+    void BuildRows(Island& island);
+
+    bool Disturbed(const Island& island) const;
+    void Sleep(Island& island);
+    // always in double, whatever T is
+    void AssembleJWJt(const Island& island, Mat& A) const;
+    void Assemble(Island& island, Mat& A, Vec& b);
+    int FindRedundant(Island& island);
+    void Correct(const Island& island, const Vec& dl, VecT<T>& q);
+    void Project(Island& island);
+    Vec SolveFactored(const Island& island, const Vec& rhs) const;
+    void SolveIsland(Island& island);
 };
+
+typedef SystemT<double, 2> System;
+typedef SystemT<double, 3> System3;
@@ -0,0 +1,304 @@
+#include "trace.hpp"
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "system.hpp"
+
+static const char traceMagic[4] = { 'S', 'P', 'T', 'R' };
+
+// frames handed to the writer at once
+static constexpr int framesPerChunk = 256;
+
+static std::size_t FrameDoubles(const TraceHeader& header)
+{
+    std::size_t n = 2 + header.N*header.DF;
+
+    if (header.flags & TRACE_VEL) n += header.N*header.DF;
+    if (header.flags & TRACE_MULTIPLIERS) n += header.NC;
+    if (header.flags & TRACE_ERROR) n += 1;
+
+    return n;
+}
+
+// frames start 8 byte aligned after the segment table
+static std::size_t DataOffset(const TraceHeader& header)
+{
+    std::size_t offset = sizeof(TraceHeader) + header.segments*sizeof(Segment);
+    return (offset + 7) & ~(std::size_t) 7;
+}
+
+template<typename T, int D>
+Recorder::Recorder(const char* path, const SystemT<T, D>& system, int interval_, int flags_)
+    : interval(interval_ > 0 ? interval_ : 1)
+    , flags(flags_)
+    , file(std::fopen(path, "wb"))
+    , stopped(false)
+    , chunkFrames(0)
+    , closing(false)
+{
+    Snapshot snapshot;
+    system.Publish(snapshot);
+
+    std::memcpy(header.magic, traceMagic, 4);
+    header.version = traceVersion;
+    header.N = system.N;
+    header.DF = system.DF;
+    header.NC = system.NC;
+    header.flags = flags;
+    header.interval = interval;
+    header.segments = snapshot.segments.size();
+    header.frameSize = FrameDoubles(header)*sizeof(double);
+
+    if (!file) { stopped = true; return; }
+
+    std::fwrite(&header, sizeof(header), 1, file);
+    std::fwrite(snapshot.segments.data(), sizeof(Segment), snapshot.segments.size(), file);
+
+    static const char zeros[8] = {  };
+    std::size_t written = sizeof(header) + snapshot.segments.size()*sizeof(Segment);
+    std::fwrite(zeros, 1, DataOffset(header) - written, file);
+
+    chunk.reserve(framesPerChunk*FrameDoubles(header));
+
+    writer = std::thread(&Recorder::Write, this);
+}
+
+Recorder::~Recorder()
+{
+    Close();
+}
+
+bool Recorder::Ok() const
+{
+    return file != NULL;
+}
+
+template<typename T, int D>
+bool Recorder::Capture(const SystemT<T, D>& system)
+{
+    if (stopped) return false;
+
+    if (system.N != (int) header.N || system.NC != (int) header.NC)
+    {
+        std::printf("WARNING: topology changed, trace recording stopped\n");
+        stopped = true;
+        return false;
+    }
+
+    int64_t steps = system.substeps;
+    double s;
+    std::memcpy(&s, &steps, sizeof(s));
+
+    chunk.push_back(system.time);
+    chunk.push_back(s);
+    chunk.insert(chunk.end(), system.pos.buf.begin(), system.pos.buf.end());
+
+    if (flags & TRACE_VEL) chunk.insert(chunk.end(), system.vel.buf.begin(), system.vel.buf.end());
+    if (flags & TRACE_MULTIPLIERS) chunk.insert(chunk.end(), system.l.buf.begin(), system.l.buf.end());
+    if (flags & TRACE_ERROR) chunk.push_back(system.totalError);
+
+    if (++chunkFrames == framesPerChunk) Submit();
+
+    return true;
+}
+
+template Recorder::Recorder(const char*, const SystemT<float, 2>&, int, int);
+template Recorder::Recorder(const char*, const SystemT<double, 2>&, int, int);
+template Recorder::Recorder(const char*, const SystemT<float, 3>&, int, int);
+template Recorder::Recorder(const char*, const SystemT<double, 3>&, int, int);
+template bool Recorder::Capture(const SystemT<float, 2>&);
+template bool Recorder::Capture(const SystemT<double, 2>&);
+template bool Recorder::Capture(const SystemT<float, 3>&);
+template bool Recorder::Capture(const SystemT<double, 3>&);
+
+void Recorder::Submit()
+{
+    if (chunk.empty()) return;
+
+    std::vector<double> next;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(std::move(chunk));
+
+        if (!spare.empty())
+        {
+            next = std::move(spare.back());
+            spare.pop_back();
+        }
+    }
+
+    wake.notify_one();
+
+    // a spare buffer keeps its capacity, otherwise allocate instead of waiting
+    next.clear();
+    next.reserve(framesPerChunk*FrameDoubles(header));
+    chunk = std::move(next);
+    chunkFrames = 0;
+}
+
+void Recorder::Write()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (true)
+    {
+        wake.wait(guard, [this] { return !queue.empty() || closing; });
+
+        if (queue.empty() && closing) return;
+
+        std::vector<double> buf = std::move(queue.front());
+        queue.pop_front();
+
+        guard.unlock();
+        std::fwrite(buf.data(), sizeof(double), buf.size(), file);
+        guard.lock();
+
+        spare.push_back(std::move(buf));
+    }
+}
+
+void Recorder::Close()
+{
+    if (!file) return;
+
+    Submit();
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closing = true;
+    }
+
+    wake.notify_one();
+    writer.join();
+
+    std::fclose(file);
+    file = NULL;
+    stopped = true;
+}
+
+Trace::Trace()
+    : data(NULL), size(0), segments(NULL), frames(0)
+{
+}
+
+Trace::~Trace()
+{
+    Close();
+}
+
+bool Trace::Open(const char* path)
+{
+    Close();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(TraceHeader)) { close(fd); return false; }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) return false;
+
+    data = static_cast<const char*>(map);
+    size = st.st_size;
+
+    std::memcpy(&header, data, sizeof(header));
+
+    if (std::memcmp(header.magic, traceMagic, 4) != 0 || header.version > traceVersion
+        || header.frameSize != FrameDoubles(header)*sizeof(double) || DataOffset(header) > size)
+    {
+        std::printf("WARNING: %s is not a trace file\n", path);
+        Close();
+        return false;
+    }
+
+    segments = reinterpret_cast<const Segment*>(data + sizeof(TraceHeader));
+
+    // a trailing partial frame from an interrupted writer is ignored
+    frames = (size - DataOffset(header))/header.frameSize;
+
+    return true;
+}
+
+void Trace::Close()
+{
+    if (data) munmap(const_cast<char*>(data), size);
+
+    data = NULL;
+    size = 0;
+    segments = NULL;
+    frames = 0;
+}
+
+long Trace::Frames() const
+{
+    return frames;
+}
+
+const double* Trace::Frame(long frame) const
+{
+    return reinterpret_cast<const double*>(data + DataOffset(header) + frame*header.frameSize);
+}
+
+double Trace::Time(long frame) const
+{
+    return Frame(frame)[0];
+}
+
+long Trace::Substeps(long frame) const
+{
+    int64_t steps;
+    std::memcpy(&steps, Frame(frame) + 1, sizeof(steps));
+    return steps;
+}
+
+const double* Trace::Pos(long frame) const
+{
+    return Frame(frame) + 2;
+}
+
+const double* Trace::Vel(long frame) const
+{
+    if (!(header.flags & TRACE_VEL)) return NULL;
+
+    return Pos(frame) + header.N*header.DF;
+}
+
+const double* Trace::Multipliers(long frame) const
+{
+    if (!(header.flags & TRACE_MULTIPLIERS)) return NULL;
+
+    const double* p = Pos(frame) + header.N*header.DF;
+    if (header.flags & TRACE_VEL) p += header.N*header.DF;
+
+    return p;
+}
+
+double Trace::Error(long frame) const
+{
+    if (!(header.flags & TRACE_ERROR)) return 0.0;
+
+    return Frame(frame)[header.frameSize/sizeof(double) - 1];
+}
+
+void Trace::Fill(long frame, Snapshot& out) const
+{
+    out.N = header.N;
+    out.DF = header.DF;
+    out.pos.assign(Pos(frame), Pos(frame) + header.N*header.DF);
+    out.steps = Substeps(frame);
+    out.time = Time(frame);
+
+    if (out.topology != 0)
+    {
+        out.segments.assign(segments, segments + header.segments);
+        out.topology = 0;
+    }
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "snapshot.hpp"
+
+template<typename T, int D> struct SystemT;
+
+// Trajectory files (.sptr), host byte order:
+//
+//   TraceHeader
+//   Segment segments[header.segments]
+//   frames, each header.frameSize bytes:
+//     double time, int64 substeps, pos[N*DF],
+//     vel[N*DF] (TRACE_VEL), l[NC] (TRACE_MULTIPLIERS), totalError (TRACE_ERROR)
+//
+// Every frame has the same size, so frame i lives at a fixed offset and the
+// frame count follows from the file size even if the writer never closed.
+
+constexpr unsigned traceVersion = 1;
+
+enum TraceFlags
+{
+    TRACE_VEL = 1,
+    TRACE_MULTIPLIERS = 2,
+    TRACE_ERROR = 4,
+};
+
+struct TraceHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t N, DF, NC;
+    uint32_t flags;
+    uint32_t interval;  // substeps between frames
+    uint32_t segments;
+    uint64_t frameSize; // bytes per frame
+};
+
+// Streams frames of a System to a trace file, frames are always stored as
+// doubles whatever the scalar type of the System. Capture only copies into a
+// chunk buffer, full chunks are handed to a writer thread so the step loop
+// never waits on the disk. The trace covers a fixed topology, Capture stops
+// recording (and returns false) once N or NC change.
+class Recorder
+{
+public:
+    template<typename T, int D>
+    Recorder(const char* path, const SystemT<T, D>& system, int interval_, int flags_ = TRACE_VEL | TRACE_ERROR);
+    ~Recorder();
+
+    bool Ok() const;
+
+    // called by System::Step after every substep
+    template<typename T, int D>
+    bool Capture(const SystemT<T, D>& system);
+
+    void Close();
+
+    const int interval;
+    const int flags;
+
+private:
+    void Write();
+    void Submit();
+
+    std::FILE* file;
+    TraceHeader header;
+    bool stopped;
+
+    std::vector<double> chunk; // frames not handed to the writer yet
+    int chunkFrames;
+
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<std::vector<double>> queue; // full chunks, oldest first
+    std::vector<std::vector<double>> spare; // written chunks for reuse
+    bool closing;
+};
+
+// Read only view of a trace file, mapped into memory so any frame can be
+// reached in O(1) without reading the ones before it.
+class Trace
+{
+public:
+    Trace();
+    ~Trace();
+
+    bool Open(const char* path);
+    void Close();
+
+    long Frames() const;
+
+    double Time(long frame) const;
+    long Substeps(long frame) const;
+    const double* Pos(long frame) const;
+    const double* Vel(long frame) const;         // NULL unless TRACE_VEL
+    const double* Multipliers(long frame) const; // NULL unless TRACE_MULTIPLIERS
+    double Error(long frame) const;              // 0 unless TRACE_ERROR
+
+    void Fill(long frame, Snapshot& out) const;
+
+    TraceHeader header;
+
+private:
+    const double* Frame(long frame) const;
+
+    const char* data;
+    std::size_t size;
+    const Segment* segments;
+    long frames;
+};
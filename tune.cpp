@@ -0,0 +1,241 @@
+#include "tune.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+// substep of the trial runs, small enough to keep any scene in one piece
+static constexpr double trialStep = 1e-4;
+
+// wall seconds and substeps timed per candidate, at most
+static constexpr double trialBudget = 0.02;
+static constexpr int trialSubsteps = 1000;
+
+// relative to the largest LU multiplier
+static constexpr double trialAgreement = 1e-6;
+
+// a later candidate has to be this much faster to replace an earlier one,
+// keeps timing noise from flipping the choice
+static constexpr double trialMargin = 0.95;
+
+static int MaxThreads()
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+static int Bucket(double v)
+{
+    return v < 1.0 ? 0 : (int) std::log2(v) + 1;
+}
+
+static int Find(std::vector<int>& parent, int i)
+{
+    while (parent[i] != i) i = parent[i] = parent[parent[i]];
+    return i;
+}
+
+template<typename T, int D>
+static void Inspect(const SystemT<T, D>& system, TuneResult& result)
+{
+    result.N = system.N;
+    result.NC = system.NC;
+
+    result.islands = 0;
+    result.largest = 0;
+
+    for (const Island& island : system.islands)
+    {
+        if (island.constraints.empty()) continue;
+
+        result.islands++;
+        result.largest = std::max(result.largest, (int) island.constraints.size());
+    }
+
+    long nonzeros = 0;
+    for (int c = 0; c < system.NC; c++)
+        nonzeros += system.J.rows[c].size();
+
+    result.nonzeros = system.NC ? (double) nonzeros/system.NC : 0.0;
+
+    std::vector<int> parent(system.N);
+    std::iota(parent.begin(), parent.end(), 0);
+
+    result.acyclic = true;
+
+    for (int c = 0; c < system.NC; c++)
+    {
+        const std::vector<int>& particles = system.constraintParticles[c];
+        if (particles.size() < 2) continue;
+
+        int a = Find(parent, particles[0]), b = Find(parent, particles[1]);
+
+        if (a == b) result.acyclic = false;
+        else parent[a] = b;
+    }
+
+    std::snprintf(result.signature, sizeof(result.signature), "%dd-%s-%s-t%d-n%d-c%d-i%d-l%d-z%d-%s",
+        D, sizeof(T) == sizeof(float) ? "float" : "double", BackendName(GetBackend()), MaxThreads(),
+        Bucket(result.N), Bucket(result.NC), Bucket(result.islands), Bucket(result.largest),
+        (int) (result.nonzeros + 0.5), result.acyclic ? "tree" : "loops");
+}
+
+static bool ReadCache(const char* path, const char* signature, Solver& solver, int& threads)
+{
+    std::FILE* file = std::fopen(path, "r");
+    if (!file) return false;
+
+    bool found = false;
+    char line[256];
+
+    // the last entry wins, a scene that is tuned again appends a new one
+    while (std::fgets(line, sizeof(line), file))
+    {
+        char key[128], name[32];
+        int n;
+
+        if (std::sscanf(line, "%127s %31s %d", key, name, &n) != 3 || std::strcmp(key, signature) != 0) continue;
+
+        Solver s = SolverByName(name);
+        if (s == SOLVER_COUNT || n < 1) continue;
+
+        solver = s;
+        threads = std::min(n, MaxThreads());
+        found = true;
+    }
+
+    std::fclose(file);
+
+    return found;
+}
+
+static void WriteCache(const char* path, const TuneResult& result)
+{
+    std::FILE* file = std::fopen(path, "a");
+
+    if (!file || std::fprintf(file, "%s %s %d\n", result.signature, SolverName(result.solver), result.threads) < 0 || std::fclose(file) != 0)
+        std::printf("WARNING: could not write the solver choice to %s\n", path);
+}
+
+template<typename T, int D>
+static SystemT<T, D> Trial(const SystemT<T, D>& system, Solver solver, int threads)
+{
+    SystemT<T, D> trial(system);
+
+    trial.recorder = NULL;
+    trial.solver = solver;
+    trial.threads = threads;
+
+    return trial;
+}
+
+template<typename T, int D>
+TuneResult Tune(SystemT<T, D>& system, const char* cachePath)
+{
+    TuneResult result;
+    result.solver = SOLVER_LU;
+    result.threads = 1;
+    result.cached = false;
+    result.timed = false;
+
+    // one substep fills J, and the reference multipliers
+    SystemT<T, D> reference = Trial(system, SOLVER_LU, 1);
+    reference.Step(trialStep, 1);
+
+    Inspect(reference, result);
+
+    if (result.NC >= tuneMinConstraints && !(cachePath && ReadCache(cachePath, result.signature, result.solver, result.threads)))
+    {
+        double scale = 1.0;
+        for (int c = 0; c < reference.NC; c++)
+            scale = std::max(scale, std::abs((double) reference.l.At(c)));
+
+        std::vector<int> threadCounts = { 1 };
+        if (MaxThreads() > 1 && result.islands > 1) threadCounts.push_back(MaxThreads());
+
+        double best = 0.0;
+
+        for (int s = 0; s < SOLVER_COUNT; s++)
+        {
+            for (int threads : threadCounts)
+            {
+                SystemT<T, D> trial = Trial(system, (Solver) s, threads);
+                trial.Step(trialStep, 1);
+
+                TuneCandidate candidate = { (Solver) s, threads, 0.0, true };
+
+                for (int c = 0; c < trial.NC; c++)
+                {
+                    double dl = std::abs((double) trial.l.At(c) - (double) reference.l.At(c));
+                    if (!(dl <= trialAgreement*scale)) candidate.accurate = false;
+                }
+
+                int substeps = 0;
+                double wall = 0.0;
+
+                Clock::time_point start = Clock::now();
+
+                while (substeps < trialSubsteps && (substeps < 2 || wall < trialBudget))
+                {
+                    trial.Step(trialStep, 1);
+                    substeps++;
+                    wall = std::chrono::duration<double>(Clock::now() - start).count();
+                }
+
+                candidate.cost = wall/substeps;
+                result.candidates.push_back(candidate);
+
+                if (candidate.accurate && (best == 0.0 || candidate.cost < trialMargin*best))
+                {
+                    best = candidate.cost;
+                    result.solver = candidate.solver;
+                    result.threads = candidate.threads;
+                }
+            }
+        }
+
+        result.timed = true;
+
+        if (cachePath) WriteCache(cachePath, result);
+    }
+    else if (result.NC >= tuneMinConstraints)
+    {
+        result.cached = true;
+    }
+
+    system.solver = result.solver;
+    system.threads = result.threads;
+
+    return result;
+}
+
+void PrintTune(const TuneResult& result)
+{
+    std::printf("solver: %s on %d thread%s (%s, %d constraints in %d islands, largest %d, %0.1f nonzeros per row, %s)\n",
+        SolverName(result.solver), result.threads, result.threads == 1 ? "" : "s",
+        result.cached ? "cached" : result.timed ? "timed" : "too small to time",
+        result.NC, result.islands, result.largest, result.nonzeros, result.acyclic ? "acyclic" : "with loops");
+
+    for (const TuneCandidate& c : result.candidates)
+    {
+        std::printf("  %-8s %2d thread%s %8.3f ms per substep%s\n", SolverName(c.solver), c.threads, c.threads == 1 ? " " : "s",
+            c.cost*1e3, c.accurate ? "" : "  (inaccurate)");
+    }
+}
+
+template TuneResult Tune(SystemT<float, 2>&, const char*);
+template TuneResult Tune(SystemT<double, 2>&, const char*);
+template TuneResult Tune(SystemT<float, 3>&, const char*);
+template TuneResult Tune(SystemT<double, 3>&, const char*);
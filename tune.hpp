@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vector>
+
+#include "system.hpp"
+
+// Picks the solver and the island threads of a System for its scene. Every
+// candidate runs a few substeps on a copy of the system, candidates whose
+// multipliers disagree with LU are dropped and the fastest one wins. Winners
+// are appended to a cache file under a signature of the scene (sizes rounded
+// to powers of two, so a scene of the same shape is not timed again).
+
+constexpr const char* tuneCachePath = "SimplePhysics.tune";
+
+// fewer constraints than this stay on LU in order, without timing
+constexpr int tuneMinConstraints = 32;
+
+struct TuneCandidate
+{
+    Solver solver;
+    int threads;
+    double cost;   // wall seconds per substep
+    bool accurate; // multipliers agree with LU
+};
+
+struct TuneResult
+{
+    Solver solver;
+    int threads;
+
+    bool cached; // found in the cache file
+    bool timed;  // false for scenes too small to bother
+
+    // what the signature is made of
+    int N, NC;
+    int islands;       // with constraints
+    int largest;       // constraints of the largest island
+    double nonzeros;   // per row of J
+    bool acyclic;      // no constraint closes a loop of particles
+
+    char signature[128];
+
+    std::vector<TuneCandidate> candidates; // empty unless timed
+};
+
+// sets system.solver and system.threads, cachePath NULL neither reads nor
+// writes a cache
+template<typename T, int D>
+TuneResult Tune(SystemT<T, D>& system, const char* cachePath = tuneCachePath);
+
+void PrintTune(const TuneResult& result);
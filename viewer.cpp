@@ -0,0 +1,110 @@
+#include "viewer.hpp"
+
+#include <cstdio>
+#include <raylib.h>
+
+#include "render.hpp"
+#include "stream.hpp"
+#include "trace.hpp"
+
+int RunReplay(const char* path)
+{
+    Trace trace;
+    if (!trace.Open(path) || trace.Frames() == 0)
+    {
+        std::printf("ERROR: could not open %s or it has no frames\n", path);
+        return 1;
+    }
+
+    constexpr int width = 1300;
+    constexpr int height = 800;
+
+    SetTraceLogLevel(LOG_NONE);
+    InitWindow(width, height, "Simple Physics - replay");
+    SetTargetFPS(60);
+
+    long frame = 0;
+    bool playing = false;
+    Snapshot snapshot;
+
+    while (!WindowShouldClose())
+    {
+        long last = trace.Frames() - 1;
+
+        if (IsKeyPressed(KEY_SPACE)) playing = !playing;
+        if (IsKeyDown(KEY_RIGHT)) frame++;
+        if (IsKeyDown(KEY_LEFT)) frame--;
+        if (IsKeyPressed(KEY_UP)) frame += 100;
+        if (IsKeyPressed(KEY_DOWN)) frame -= 100;
+
+        if (IsMouseButtonDown(MOUSE_BUTTON_LEFT) && GetMouseY() > height - 20)
+            frame = (long) ((double) GetMouseX()/width*last);
+
+        if (playing) frame++;
+
+        if (frame < 0) frame = 0;
+        if (frame > last) { frame = last; playing = false; }
+
+        trace.Fill(frame, snapshot);
+
+        BeginDrawing();
+        {
+            ClearBackground(BLACK);
+
+            DrawSnapshot(snapshot);
+
+            DrawRectangle(0, height - 20, width, 20, DARKGRAY);
+            DrawRectangle(0, height - 20, (int) ((double) frame/(last > 0 ? last : 1)*width), 20, GRAY);
+
+            char text[128];
+            std::snprintf(text, sizeof(text), "frame %ld/%ld  t = %0.3f s  error = %0.6f", frame, last, snapshot.time, trace.Error(frame));
+            DrawText(text, 10, 10, 20, WHITE);
+        }
+        EndDrawing();
+    }
+
+    CloseWindow();
+
+    return 0;
+}
+
+int RunWatch(const char* name)
+{
+    constexpr int width = 1300;
+    constexpr int height = 800;
+
+    SetTraceLogLevel(LOG_NONE);
+    InitWindow(width, height, "Simple Physics - watch");
+    SetTargetFPS(60);
+
+    StreamReader reader;
+    bool open = false;
+    Snapshot snapshot;
+
+    while (!WindowShouldClose())
+    {
+        // attach, and once the writer is gone attach to the next one that
+        // shows up under the same name, the last frame stays on screen
+        if (reader.Closed()) open = reader.Open(name) || open;
+
+        bool fresh = open && reader.Fill(snapshot);
+
+        BeginDrawing();
+        {
+            ClearBackground(BLACK);
+
+            DrawSnapshot(snapshot);
+
+            char text[160];
+            if (!open) std::snprintf(text, sizeof(text), "waiting for %s", name);
+            else std::snprintf(text, sizeof(text), "%s  frame %lu  t = %0.3f s  substeps %ld%s", name, (unsigned long) reader.Published(),
+                snapshot.time, snapshot.steps, reader.Closed() ? "  (closed)" : fresh ? "" : "  (no frame)");
+            DrawText(text, 10, 10, 20, WHITE);
+        }
+        EndDrawing();
+    }
+
+    CloseWindow();
+
+    return 0;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+// Opens a window showing a recorded trace. LEFT/RIGHT step one frame,
+// UP/DOWN step a hundred, SPACE plays and pauses, clicking the bar at the
+// bottom jumps to that point.
+int RunReplay(const char* path);
+
+// Opens a window following a stream published by another process (run
+// --stream), waits for the stream to appear and keeps the last frame once
+// the writer is gone.
+int RunWatch(const char* name);